@@ -0,0 +1,457 @@
+// Macro benchmark of the sorting engine on a generated corpus. Build it next to the tool:
+//
+//   g++ -std=c++17 -O2 -pthread -Isrc -o push_bench bench/bench_engine.cpp src/push_engine.cpp src/file_system.cpp
+//   cl /std:c++17 /EHsc /O2 /Isrc /Fe:push_bench.exe bench\bench_engine.cpp src\push_engine.cpp src\file_system.cpp
+//
+// Each run generates a corpus, then times these scenarios in order, every one on the tree the
+// previous one left behind:
+//
+//   process       sort the corpus folder (processDirectory)
+//   rerun         sort the already sorted folder again, which finds nothing to move
+//   flatten       move every file back up
+//   process-files sort the same files passed as an explicit list (processFiles)
+//
+// With --shape FILE the corpus is instead rebuilt from a shape file written by
+// `PushToFolders --capture-shape`, and only process and rerun are timed, over every folder of the
+// replayed tree that holds files; flattening would fold the captured sub-folders into their parents.
+//
+// Results go to stdout (or --output) as one JSON object.
+
+#include "bench_util.h"
+#include "push_engine.h"
+#include "shape_replay.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <new>
+#include <optional>
+#include <random>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#ifndef _WIN32
+#include <unistd.h>
+#endif
+
+namespace fs = std::filesystem;
+
+namespace {
+
+std::atomic<std::uint64_t> allocationCount {0};
+std::atomic<std::uint64_t> allocatedBytes {0};
+
+void *countedAllocate(std::size_t size) {
+    allocationCount.fetch_add(1, std::memory_order_relaxed);
+    allocatedBytes.fetch_add(size, std::memory_order_relaxed);
+    if (void *block = std::malloc(size == 0 ? 1 : size)) {
+        return block;
+    }
+    throw std::bad_alloc();
+}
+
+} // namespace
+
+void *operator new(std::size_t size) {
+    return countedAllocate(size);
+}
+
+void *operator new[](std::size_t size) {
+    return countedAllocate(size);
+}
+
+void operator delete(void *block) noexcept {
+    std::free(block);
+}
+
+void operator delete[](void *block) noexcept {
+    std::free(block);
+}
+
+void operator delete(void *block, std::size_t) noexcept {
+    std::free(block);
+}
+
+void operator delete[](void *block, std::size_t) noexcept {
+    std::free(block);
+}
+
+namespace {
+
+using namespace pushtofolders;
+
+// Counts the calls that reach the wrapped file system, as a portable stand-in for syscalls: every
+// call is one system call on POSIX, apart from listings (one per batch of entries) and reflinks.
+class CountingFileSystem final : public FileSystem {
+public:
+    explicit CountingFileSystem(FileSystem &inner) : inner_(inner) {}
+
+    std::uint64_t calls() const {
+        return calls_.load();
+    }
+
+    bool listDirectory(const fs::path &directory, std::vector<DirectoryEntry> &entries, std::string &errorMessage) override {
+        count();
+        return inner_.listDirectory(directory, entries, errorMessage);
+    }
+    bool readMetadata(const fs::path &path, unsigned fields, FileMetadata &metadata, std::string &errorMessage) override {
+        count();
+        return inner_.readMetadata(path, fields, metadata, errorMessage);
+    }
+    bool readPrefix(const fs::path &file, std::string &buffer, std::size_t &bytesRead, std::string &errorMessage) override {
+        count();
+        return inner_.readPrefix(file, buffer, bytesRead, errorMessage);
+    }
+    bool createDirectories(const fs::path &directory, std::string &errorMessage) override {
+        count();
+        return inner_.createDirectories(directory, errorMessage);
+    }
+    bool renameNoReplace(const fs::path &source, const fs::path &destination, std::string &errorMessage) override {
+        count();
+        return inner_.renameNoReplace(source, destination, errorMessage);
+    }
+    bool linkNoReplace(const fs::path &source, const fs::path &destination, LinkKind kind, std::string &errorMessage) override {
+        count();
+        return inner_.linkNoReplace(source, destination, kind, errorMessage);
+    }
+    bool isLinkTo(const fs::path &link, const fs::path &source, LinkKind kind) override {
+        count();
+        return inner_.isLinkTo(link, source, kind);
+    }
+    bool removeEmptyDirectory(const fs::path &directory, std::string &errorMessage) override {
+        count();
+        return inner_.removeEmptyDirectory(directory, errorMessage);
+    }
+    std::optional<DirectoryStamp> readDirectoryStamp(const fs::path &directory) override {
+        count();
+        return inner_.readDirectoryStamp(directory);
+    }
+    bool isCaseInsensitive(const fs::path &directory) override {
+        count();
+        return inner_.isCaseInsensitive(directory);
+    }
+
+private:
+    void count() {
+        calls_.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    FileSystem &inner_;
+    std::atomic<std::uint64_t> calls_ {0};
+};
+
+struct CorpusSpec {
+    std::size_t files = 10000;
+    // Fraction of files that share their stem with the file before them (sidecars, RAW+JPEG pairs).
+    double collisionRatio = 0.3;
+    std::size_t nameLength = 16;
+    // Fraction of stems that carry non-ASCII characters, some of them in decomposed form.
+    double unicodeRatio = 0.1;
+    // Folders between the scratch root and the corpus, which lengthens every path.
+    std::size_t depth = 2;
+    std::uint32_t seed = 1;
+};
+
+struct BenchConfig {
+    CorpusSpec corpus;
+    fs::path scratch;
+    bool inMemory = false;
+    unsigned jobs = 0;
+    bool keep = false;
+    bool help = false;
+    fs::path output;
+    fs::path shape;
+};
+
+// Names of every corpus file, generated up front so that generation is not timed.
+std::vector<std::string> generateNames(const CorpusSpec &spec) {
+    static const char *const kExtensions[] = {"jpg", "cr2", "xmp", "mp4", "txt", "pdf", "png", "json"};
+    static const char *const kUnicode[] = {"\xC3\xA9", "\xC3\xBC", "\xC3\x9F", "\xE6\x97\xA5", "\xE6\x9C\xAC", "e\xCC\x81", "\xD0\x96"};
+    constexpr std::size_t kExtensionCount = sizeof(kExtensions) / sizeof(kExtensions[0]);
+    static const char kAlphabet[] = "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789_-";
+
+    std::mt19937 random(spec.seed);
+    std::uniform_real_distribution<double> chance(0.0, 1.0);
+    std::uniform_int_distribution<std::size_t> letter(0, sizeof(kAlphabet) - 2);
+    std::uniform_int_distribution<std::size_t> unicode(0, sizeof(kUnicode) / sizeof(kUnicode[0]) - 1);
+
+    std::vector<std::string> names;
+    names.reserve(spec.files);
+    std::string stem;
+    std::size_t groupSize = 0;
+    for (std::size_t i = 0; i < spec.files; ++i) {
+        if (i == 0 || groupSize == kExtensionCount || chance(random) >= spec.collisionRatio) {
+            // The index keeps stems unique however short they are.
+            stem = std::to_string(i) + "_";
+            while (stem.size() < spec.nameLength) {
+                stem.push_back(kAlphabet[letter(random)]);
+            }
+            if (chance(random) < spec.unicodeRatio) {
+                stem.insert(stem.size() / 2, kUnicode[unicode(random)]);
+            }
+            groupSize = 0;
+        }
+        names.push_back(stem + "." + kExtensions[groupSize++]);
+    }
+    return names;
+}
+
+bool writeCorpus(const fs::path &root, const std::vector<std::string> &names, MemoryFileSystem *memory, std::string &errorMessage) {
+    if (memory) {
+        memory->addDirectory(root);
+        for (const auto &name : names) {
+            memory->addFile(root / fs::u8path(name));
+        }
+        return true;
+    }
+
+    std::error_code ec;
+    fs::create_directories(root, ec);
+    if (ec) {
+        errorMessage = "Cannot create " + root.u8string() + ": " + ec.message();
+        return false;
+    }
+    for (const auto &name : names) {
+        std::ofstream file(root / fs::u8path(name), std::ios::binary);
+        if (!file) {
+            errorMessage = "Cannot create " + (root / fs::u8path(name)).u8string();
+            return false;
+        }
+    }
+    return true;
+}
+
+struct ScenarioResult {
+    std::string name;
+    std::size_t files = 0;
+    double seconds = 0;
+    std::uint64_t fileSystemCalls = 0;
+    std::uint64_t allocations = 0;
+    std::uint64_t allocatedBytes = 0;
+    std::size_t errors = 0;
+};
+
+template <typename Body>
+ScenarioResult measure(const std::string &name, std::size_t files, CountingFileSystem &counter, const std::size_t &errors, Body body) {
+    ScenarioResult result;
+    result.name = name;
+    result.files = files;
+    std::uint64_t callsBefore = counter.calls();
+    std::size_t errorsBefore = errors;
+    std::uint64_t allocationsBefore = allocationCount.load();
+    std::uint64_t bytesBefore = allocatedBytes.load();
+    auto start = std::chrono::steady_clock::now();
+    body();
+    result.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    result.allocations = allocationCount.load() - allocationsBefore;
+    result.allocatedBytes = allocatedBytes.load() - bytesBefore;
+    result.fileSystemCalls = counter.calls() - callsBefore;
+    result.errors = errors - errorsBefore;
+    return result;
+}
+
+std::string toJson(const BenchConfig &config, const bench::Shape *shape, const std::vector<ScenarioResult> &results) {
+    const auto perFile = [](double value, std::size_t files) {
+        return files == 0 ? 0.0 : value / static_cast<double>(files);
+    };
+    std::ostringstream json;
+    json.precision(6);
+    json << "{\n";
+    if (shape) {
+        json << "  \"corpus\": {\"shape\": " << bench::jsonString(config.shape.u8string()) << ", \"files\": " << shape->files.size()
+             << ", \"folders\": " << shape->folders.size() << "},\n";
+    } else {
+        json << "  \"corpus\": {\"files\": " << config.corpus.files << ", \"collisionRatio\": " << config.corpus.collisionRatio
+             << ", \"nameLength\": " << config.corpus.nameLength << ", \"unicodeRatio\": " << config.corpus.unicodeRatio
+             << ", \"depth\": " << config.corpus.depth << ", \"seed\": " << config.corpus.seed << "},\n";
+    }
+    json << "  \"fileSystem\": " << bench::jsonString(config.inMemory ? "memory" : config.scratch.u8string()) << ",\n";
+    json << "  \"jobs\": " << config.jobs << ",\n";
+    json << "  \"scenarios\": [\n";
+    for (std::size_t i = 0; i < results.size(); ++i) {
+        const ScenarioResult &result = results[i];
+        json << "    {\"name\": " << bench::jsonString(result.name) << ", \"files\": " << result.files << ", \"seconds\": " << result.seconds
+             << ", \"filesPerSecond\": " << (result.seconds > 0 ? static_cast<double>(result.files) / result.seconds : 0.0)
+             << ", \"fileSystemCallsPerFile\": " << perFile(static_cast<double>(result.fileSystemCalls), result.files)
+             << ", \"allocationsPerFile\": " << perFile(static_cast<double>(result.allocations), result.files)
+             << ", \"allocatedBytesPerFile\": " << perFile(static_cast<double>(result.allocatedBytes), result.files)
+             << ", \"errors\": " << result.errors << "}" << (i + 1 < results.size() ? "," : "") << "\n";
+    }
+    json << "  ]\n}\n";
+    return json.str();
+}
+
+void printUsage() {
+    std::cerr << "Usage: push_bench [options]\n"
+              << "  --files N          Files in the corpus, 1000 to 10000000 (default 10000)\n"
+              << "  --collisions R     Fraction of files sharing a stem with another (default 0.3)\n"
+              << "  --name-length N    Characters per stem (default 16)\n"
+              << "  --unicode R        Fraction of stems with non-ASCII characters (default 0.1)\n"
+              << "  --depth N          Folders above the corpus (default 2)\n"
+              << "  --seed N           Seed for the generated names (default 1)\n"
+              << "  --shape FILE       Rebuild the corpus from a --capture-shape file instead of generating it\n"
+              << "  --scratch DIR      Where the corpus is created (default /dev/shm or the temp folder)\n"
+              << "  --memory           Use the in-memory file system instead of a scratch folder\n"
+              << "  --jobs N           Worker threads for the engine (default: one per core)\n"
+              << "  --keep             Leave the corpus in place afterwards\n"
+              << "  --output FILE      Write the JSON results to FILE instead of stdout\n";
+}
+
+bool parseArguments(int argc, char **argv, BenchConfig &config, std::string &errorMessage) {
+    for (int i = 1; i < argc; ++i) {
+        std::string_view argument(argv[i]);
+        const auto value = [&](const char *option) -> const char * {
+            if (i + 1 >= argc) {
+                errorMessage = std::string(option) + " requires a value.";
+                return nullptr;
+            }
+            return argv[++i];
+        };
+        const char *text = nullptr;
+        if (argument == "--help") {
+            config.help = true;
+        } else if (argument == "--memory") {
+            config.inMemory = true;
+        } else if (argument == "--keep") {
+            config.keep = true;
+        } else if (argument == "--files" && (text = value("--files"))) {
+            config.corpus.files = static_cast<std::size_t>(std::strtoull(text, nullptr, 10));
+        } else if (argument == "--collisions" && (text = value("--collisions"))) {
+            config.corpus.collisionRatio = std::strtod(text, nullptr);
+        } else if (argument == "--name-length" && (text = value("--name-length"))) {
+            config.corpus.nameLength = static_cast<std::size_t>(std::strtoull(text, nullptr, 10));
+        } else if (argument == "--unicode" && (text = value("--unicode"))) {
+            config.corpus.unicodeRatio = std::strtod(text, nullptr);
+        } else if (argument == "--depth" && (text = value("--depth"))) {
+            config.corpus.depth = static_cast<std::size_t>(std::strtoull(text, nullptr, 10));
+        } else if (argument == "--seed" && (text = value("--seed"))) {
+            config.corpus.seed = static_cast<std::uint32_t>(std::strtoul(text, nullptr, 10));
+        } else if (argument == "--scratch" && (text = value("--scratch"))) {
+            config.scratch = fs::u8path(text);
+        } else if (argument == "--jobs" && (text = value("--jobs"))) {
+            config.jobs = static_cast<unsigned>(std::strtoul(text, nullptr, 10));
+        } else if (argument == "--shape" && (text = value("--shape"))) {
+            config.shape = fs::u8path(text);
+        } else if (argument == "--output" && (text = value("--output"))) {
+            config.output = fs::u8path(text);
+        } else {
+            if (errorMessage.empty()) {
+                errorMessage = "Unknown option: " + std::string(argument);
+            }
+            return false;
+        }
+    }
+    if (config.corpus.files == 0) {
+        errorMessage = "--files must be at least 1.";
+        return false;
+    }
+    return true;
+}
+
+} // namespace
+
+int main(int argc, char **argv) {
+    BenchConfig config;
+    std::string errorMessage;
+    if (!parseArguments(argc, argv, config, errorMessage)) {
+        std::cerr << errorMessage << "\n";
+        printUsage();
+        return 2;
+    }
+    if (config.help) {
+        printUsage();
+        return 0;
+    }
+    if (config.scratch.empty()) {
+        config.scratch = config.inMemory ? fs::path("/scratch") : bench::defaultScratch();
+    }
+
+#ifdef _WIN32
+    fs::path runRoot = config.scratch / ("pushbench-" + std::to_string(std::chrono::steady_clock::now().time_since_epoch().count()));
+#else
+    fs::path runRoot = config.scratch / ("pushbench-" + std::to_string(::getpid()));
+#endif
+    fs::path corpus = runRoot;
+    for (std::size_t level = 0; level < config.corpus.depth; ++level) {
+        corpus /= "level" + std::to_string(level);
+    }
+    corpus /= "corpus";
+
+    std::optional<MemoryFileSystem> memory;
+    if (config.inMemory) {
+        memory.emplace();
+    }
+    std::optional<bench::Shape> shape;
+    std::vector<fs::path> shapeFolders;
+    std::vector<std::string> names;
+    if (!config.shape.empty()) {
+        shape.emplace();
+        if (!bench::readShape(config.shape, *shape, errorMessage) ||
+            !bench::replayShape(*shape, corpus, memory ? &*memory : nullptr, shapeFolders, errorMessage)) {
+            std::cerr << errorMessage << "\n";
+            return 1;
+        }
+    } else {
+        names = generateNames(config.corpus);
+        if (!writeCorpus(corpus, names, memory ? &*memory : nullptr, errorMessage)) {
+            std::cerr << errorMessage << "\n";
+            return 1;
+        }
+    }
+
+    CountingFileSystem counter(memory ? static_cast<FileSystem &>(*memory) : nativeFileSystem());
+    Options options;
+    options.jobs = config.jobs;
+    options.fileSystem = &counter;
+    std::size_t errors = 0;
+    auto engine = PushEngine::create(options, nullptr, [&errors](const Event &event) {
+        if (event.kind == EventKind::Error) {
+            ++errors;
+        }
+    }, errorMessage);
+    if (!engine) {
+        std::cerr << errorMessage << "\n";
+        return 1;
+    }
+
+    std::vector<fs::path> files;
+    files.reserve(names.size());
+    for (const auto &name : names) {
+        files.push_back(corpus / fs::u8path(name));
+    }
+
+    std::vector<ScenarioResult> results;
+    if (shape) {
+        results.push_back(measure("process", shape->files.size(), counter, errors, [&] { engine->process(shapeFolders); }));
+        results.push_back(measure("rerun", shape->files.size(), counter, errors, [&] { engine->process(shapeFolders); }));
+    } else {
+        results.push_back(measure("process", names.size(), counter, errors, [&] { engine->process({corpus}); }));
+        results.push_back(measure("rerun", names.size(), counter, errors, [&] { engine->process({corpus}); }));
+        results.push_back(measure("flatten", names.size(), counter, errors, [&] { engine->flatten(corpus); }));
+        results.push_back(measure("process-files", names.size(), counter, errors, [&] { engine->process(files); }));
+    }
+
+    if (!config.inMemory && !config.keep) {
+        std::error_code ec;
+        fs::remove_all(runRoot, ec);
+    }
+
+    const std::string json = toJson(config, shape ? &*shape : nullptr, results);
+    if (config.output.empty()) {
+        std::cout << json;
+        return 0;
+    }
+    std::ofstream out(config.output, std::ios::binary | std::ios::trunc);
+    out << json;
+    if (!out) {
+        std::cerr << "Cannot write " << config.output.u8string() << "\n";
+        return 1;
+    }
+    return 0;
+}
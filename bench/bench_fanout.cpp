@@ -0,0 +1,387 @@
+// Multi-process stress benchmark: the Explorer context-menu entry starts one PushToFolders process
+// per selected file, so selecting thousands of files starts thousands of processes that share one
+// folder and one log file. This harness reproduces that on POSIX. Build it next to the tool:
+//
+//   g++ -std=c++17 -O2 -pthread -Isrc -o push_bench_fanout bench/bench_fanout.cpp
+//
+// It generates a corpus in which some files share their stem with a neighbour, so that several
+// processes race to create the same folder. It then starts one process per --files-per-process
+// files, at most --concurrency at a time, and checks the result afterwards:
+//
+//   - every file must be in the folder named after its stem; files left behind or placed wrongly
+//     are failed moves
+//   - every log line must be a whole record, every process must have written its run header, and
+//     there must be one "Moved" record per moved file
+//
+// Startup cost is the median lifetime of processes started one after another with a single missing
+// file, which covers process creation, runtime start-up and opening the log.
+//
+// The children get TMPDIR pointed at the scratch folder, which is where the tool keeps its log.
+// Results go to stdout (or --output) as one JSON object.
+
+#include "bench_util.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <random>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <spawn.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+extern char **environ;
+#endif
+
+namespace fs = std::filesystem;
+
+namespace {
+
+struct BenchConfig {
+    fs::path executable = "./PushToFolders";
+    std::size_t processes = 200;
+    std::size_t filesPerProcess = 1;
+    std::size_t concurrency = 0;
+    // Fraction of files that share their stem with the file before them.
+    double collisionRatio = 0.3;
+    std::size_t startupSamples = 20;
+    fs::path scratch;
+    bool keep = false;
+    bool help = false;
+    fs::path output;
+};
+
+struct CorpusFile {
+    std::string name;
+    std::string stem;
+};
+
+// Stems shared by runs of neighbouring files end up in different processes, which then race.
+std::vector<CorpusFile> generateCorpus(std::size_t count, double collisionRatio) {
+    static const char *const kExtensions[] = {"jpg", "cr2", "xmp", "mp4", "txt", "pdf"};
+    constexpr std::size_t kExtensionCount = sizeof(kExtensions) / sizeof(kExtensions[0]);
+    std::mt19937 random(11);
+    std::uniform_real_distribution<double> chance(0.0, 1.0);
+
+    std::vector<CorpusFile> files;
+    files.reserve(count);
+    std::string stem;
+    std::size_t groupSize = 0;
+    for (std::size_t i = 0; i < count; ++i) {
+        if (i == 0 || groupSize == kExtensionCount || chance(random) >= collisionRatio) {
+            stem = "IMG_" + std::to_string(100000 + i);
+            groupSize = 0;
+        }
+        files.push_back({stem + "." + kExtensions[groupSize++], stem});
+    }
+    return files;
+}
+
+double percentile(std::vector<double> values, double fraction) {
+    if (values.empty()) {
+        return 0;
+    }
+    std::sort(values.begin(), values.end());
+    auto index = static_cast<std::size_t>(fraction * static_cast<double>(values.size() - 1) + 0.5);
+    return values[std::min(index, values.size() - 1)];
+}
+
+#ifndef _WIN32
+// The environment of this process with TMPDIR replaced, so that the children log to `logFolder`.
+std::vector<std::string> childEnvironment(const fs::path &logFolder) {
+    std::vector<std::string> variables;
+    for (char **entry = environ; *entry != nullptr; ++entry) {
+        if (std::string_view(*entry).rfind("TMPDIR=", 0) != 0) {
+            variables.emplace_back(*entry);
+        }
+    }
+    variables.push_back("TMPDIR=" + logFolder.string());
+    return variables;
+}
+
+// Starts the tool with its output discarded. Returns the child's pid, or -1.
+pid_t spawnTool(const BenchConfig &config, const std::vector<std::string> &arguments, std::vector<char *> &environment) {
+    std::vector<char *> argv;
+    std::string executable = config.executable.string();
+    argv.push_back(executable.data());
+    for (const auto &argument : arguments) {
+        argv.push_back(const_cast<char *>(argument.c_str()));
+    }
+    argv.push_back(nullptr);
+
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_addopen(&actions, STDOUT_FILENO, "/dev/null", O_WRONLY, 0);
+    posix_spawn_file_actions_addopen(&actions, STDERR_FILENO, "/dev/null", O_WRONLY, 0);
+    pid_t pid = -1;
+    int error = posix_spawn(&pid, executable.c_str(), &actions, nullptr, argv.data(), environment.data());
+    posix_spawn_file_actions_destroy(&actions);
+    return error == 0 ? pid : -1;
+}
+#endif
+
+struct LogCheck {
+    std::size_t lines = 0;
+    std::size_t malformed = 0;
+    std::size_t runHeaders = 0;
+    std::size_t movedRecords = 0;
+    std::size_t errorRecords = 0;
+};
+
+// A whole record is a run header or "[YYYY-MM-DD HH:MM:SS] INFO: " / "ERROR: " followed by text.
+// Interleaved writes from two processes show up as lines that are neither.
+LogCheck checkLog(const fs::path &logPath) {
+    LogCheck check;
+    std::ifstream log(logPath, std::ios::binary);
+    std::string line;
+    while (std::getline(log, line)) {
+        ++check.lines;
+        if (line.rfind("--- Run started at ", 0) == 0 && line.size() == 42 && line.compare(line.size() - 4, 4, " ---") == 0) {
+            ++check.runHeaders;
+            continue;
+        }
+        bool stamped = line.size() > 22 && line[0] == '[' && line[5] == '-' && line[8] == '-' && line[11] == ' ' && line[14] == ':' &&
+                       line[17] == ':' && line[20] == ']' && line[21] == ' ';
+        std::string_view body = stamped ? std::string_view(line).substr(22) : std::string_view();
+        if (body.rfind("INFO: ", 0) == 0) {
+            check.movedRecords += body.rfind("INFO: Moved ", 0) == 0 ? 1 : 0;
+        } else if (body.rfind("ERROR: ", 0) == 0) {
+            ++check.errorRecords;
+        } else {
+            ++check.malformed;
+        }
+    }
+    return check;
+}
+
+void printUsage() {
+    std::cerr << "Usage: push_bench_fanout [options]\n"
+              << "  --exe PATH              The PushToFolders binary (default ./PushToFolders)\n"
+              << "  --processes N           Processes to start (default 200)\n"
+              << "  --files-per-process N   Files passed to each process (default 1, as Explorer does)\n"
+              << "  --concurrency N         Processes running at once (default: all of them)\n"
+              << "  --collisions R          Fraction of files sharing a stem with another (default 0.3)\n"
+              << "  --startup-samples N     Sequential runs used to measure startup cost (default 20)\n"
+              << "  --scratch DIR           Where the corpus and log are created (default /dev/shm or the temp folder)\n"
+              << "  --keep                  Leave the corpus and log in place\n"
+              << "  --output FILE           Write the JSON results to FILE instead of stdout\n";
+}
+
+bool parseArguments(int argc, char **argv, BenchConfig &config, std::string &errorMessage) {
+    for (int i = 1; i < argc; ++i) {
+        std::string_view argument(argv[i]);
+        const auto value = [&](const char *option) -> const char * {
+            if (i + 1 >= argc) {
+                errorMessage = std::string(option) + " requires a value.";
+                return nullptr;
+            }
+            return argv[++i];
+        };
+        const char *text = nullptr;
+        if (argument == "--help") {
+            config.help = true;
+        } else if (argument == "--keep") {
+            config.keep = true;
+        } else if (argument == "--exe" && (text = value("--exe"))) {
+            config.executable = text;
+        } else if (argument == "--processes" && (text = value("--processes"))) {
+            config.processes = static_cast<std::size_t>(std::strtoull(text, nullptr, 10));
+        } else if (argument == "--files-per-process" && (text = value("--files-per-process"))) {
+            config.filesPerProcess = static_cast<std::size_t>(std::strtoull(text, nullptr, 10));
+        } else if (argument == "--concurrency" && (text = value("--concurrency"))) {
+            config.concurrency = static_cast<std::size_t>(std::strtoull(text, nullptr, 10));
+        } else if (argument == "--collisions" && (text = value("--collisions"))) {
+            config.collisionRatio = std::strtod(text, nullptr);
+        } else if (argument == "--startup-samples" && (text = value("--startup-samples"))) {
+            config.startupSamples = static_cast<std::size_t>(std::strtoull(text, nullptr, 10));
+        } else if (argument == "--scratch" && (text = value("--scratch"))) {
+            config.scratch = text;
+        } else if (argument == "--output" && (text = value("--output"))) {
+            config.output = text;
+        } else {
+            if (errorMessage.empty()) {
+                errorMessage = "Unknown option: " + std::string(argument);
+            }
+            return false;
+        }
+    }
+    if (config.processes == 0 || config.filesPerProcess == 0) {
+        errorMessage = "--processes and --files-per-process must be at least 1.";
+        return false;
+    }
+    return true;
+}
+
+} // namespace
+
+int main(int argc, char **argv) {
+    BenchConfig config;
+    std::string errorMessage;
+    if (!parseArguments(argc, argv, config, errorMessage)) {
+        std::cerr << errorMessage << "\n";
+        printUsage();
+        return 2;
+    }
+    if (config.help) {
+        printUsage();
+        return 0;
+    }
+#ifdef _WIN32
+    std::cerr << "push_bench_fanout runs on POSIX systems only.\n";
+    return 1;
+#else
+    std::error_code ec;
+    config.executable = fs::absolute(config.executable, ec);
+    if (::access(config.executable.c_str(), X_OK) != 0) {
+        std::cerr << "Cannot run " << config.executable.string() << "; pass the tool with --exe.\n";
+        return 1;
+    }
+    if (config.scratch.empty()) {
+        config.scratch = bench::defaultScratch();
+    }
+    if (config.concurrency == 0) {
+        config.concurrency = config.processes;
+    }
+
+    const fs::path runRoot = config.scratch / ("pushbench-fanout-" + std::to_string(::getpid()));
+    const fs::path corpus = runRoot / "corpus";
+    const fs::path logFolder = runRoot / "log";
+    const fs::path startupFolder = runRoot / "startup";
+    for (const auto &folder : {corpus, logFolder, startupFolder}) {
+        fs::create_directories(folder, ec);
+        if (ec) {
+            std::cerr << "Cannot create " << folder.string() << ": " << ec.message() << "\n";
+            return 1;
+        }
+    }
+
+    const std::vector<CorpusFile> files = generateCorpus(config.processes * config.filesPerProcess, config.collisionRatio);
+    for (const auto &file : files) {
+        std::ofstream(corpus / file.name, std::ios::binary);
+    }
+
+    // Startup cost, measured sequentially against a separate log so the fan-out log stays clean.
+    std::vector<std::string> startupVariables = childEnvironment(startupFolder);
+    std::vector<char *> startupEnvironment;
+    for (auto &variable : startupVariables) {
+        startupEnvironment.push_back(variable.data());
+    }
+    startupEnvironment.push_back(nullptr);
+    std::vector<double> startupMs;
+    for (std::size_t i = 0; i < config.startupSamples; ++i) {
+        auto start = std::chrono::steady_clock::now();
+        pid_t pid = spawnTool(config, {(startupFolder / "missing.txt").string()}, startupEnvironment);
+        int status = 0;
+        if (pid < 0 || ::waitpid(pid, &status, 0) < 0) {
+            std::cerr << "Cannot start " << config.executable.string() << "\n";
+            return 1;
+        }
+        startupMs.push_back(std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count());
+    }
+
+    std::vector<std::string> variables = childEnvironment(logFolder);
+    std::vector<char *> environment;
+    for (auto &variable : variables) {
+        environment.push_back(variable.data());
+    }
+    environment.push_back(nullptr);
+
+    std::map<pid_t, std::chrono::steady_clock::time_point> running;
+    std::vector<double> lifetimesMs;
+    std::size_t nonZeroExits = 0;
+    std::size_t spawnFailures = 0;
+    const auto reapOne = [&] {
+        int status = 0;
+        pid_t pid = ::waitpid(-1, &status, 0);
+        auto it = running.find(pid);
+        if (pid <= 0 || it == running.end()) {
+            return false;
+        }
+        lifetimesMs.push_back(std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - it->second).count());
+        if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+            ++nonZeroExits;
+        }
+        running.erase(it);
+        return true;
+    };
+
+    auto start = std::chrono::steady_clock::now();
+    for (std::size_t process = 0; process < config.processes; ++process) {
+        while (running.size() >= config.concurrency && reapOne()) {
+        }
+        std::vector<std::string> arguments;
+        for (std::size_t i = 0; i < config.filesPerProcess; ++i) {
+            arguments.push_back((corpus / files[process * config.filesPerProcess + i].name).string());
+        }
+        auto spawned = std::chrono::steady_clock::now();
+        pid_t pid = spawnTool(config, arguments, environment);
+        if (pid < 0) {
+            ++spawnFailures;
+            continue;
+        }
+        running.emplace(pid, spawned);
+    }
+    while (!running.empty() && reapOne()) {
+    }
+    double wallSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    std::size_t placed = 0;
+    std::size_t leftBehind = 0;
+    for (const auto &file : files) {
+        if (fs::is_regular_file(corpus / file.stem / file.name, ec)) {
+            ++placed;
+        } else if (fs::exists(corpus / file.name, ec)) {
+            ++leftBehind;
+        }
+    }
+    const std::size_t misplaced = files.size() - placed - leftBehind;
+    const LogCheck log = checkLog(logFolder / "PushToFolders.log");
+
+    if (!config.keep) {
+        fs::remove_all(runRoot, ec);
+    }
+
+    std::ostringstream json;
+    json.precision(6);
+    json << "{\n"
+         << "  \"processes\": " << config.processes << ",\n"
+         << "  \"filesPerProcess\": " << config.filesPerProcess << ",\n"
+         << "  \"concurrency\": " << config.concurrency << ",\n"
+         << "  \"collisionRatio\": " << config.collisionRatio << ",\n"
+         << "  \"wallSeconds\": " << wallSeconds << ",\n"
+         << "  \"filesPerSecond\": " << (wallSeconds > 0 ? static_cast<double>(files.size()) / wallSeconds : 0.0) << ",\n"
+         << "  \"startupMs\": {\"p50\": " << percentile(startupMs, 0.5) << ", \"p90\": " << percentile(startupMs, 0.9) << "},\n"
+         << "  \"processLifetimeMs\": {\"p50\": " << percentile(lifetimesMs, 0.5) << ", \"p90\": " << percentile(lifetimesMs, 0.9)
+         << ", \"p99\": " << percentile(lifetimesMs, 0.99) << ", \"max\": " << percentile(lifetimesMs, 1.0) << "},\n"
+         << "  \"spawnFailures\": " << spawnFailures << ",\n"
+         << "  \"nonZeroExits\": " << nonZeroExits << ",\n"
+         << "  \"moves\": {\"placed\": " << placed << ", \"leftBehind\": " << leftBehind << ", \"misplaced\": " << misplaced << "},\n"
+         << "  \"log\": {\"lines\": " << log.lines << ", \"malformedLines\": " << log.malformed << ", \"runHeaders\": " << log.runHeaders
+         << ", \"missingRunHeaders\": " << (config.processes - spawnFailures > log.runHeaders ? config.processes - spawnFailures - log.runHeaders : 0)
+         << ", \"movedRecords\": " << log.movedRecords << ", \"missingMovedRecords\": " << (placed > log.movedRecords ? placed - log.movedRecords : 0)
+         << ", \"errorRecords\": " << log.errorRecords << "}\n"
+         << "}\n";
+
+    if (config.output.empty()) {
+        std::cout << json.str();
+        return 0;
+    }
+    std::ofstream out(config.output, std::ios::binary | std::ios::trunc);
+    out << json.str();
+    if (!out) {
+        std::cerr << "Cannot write " << config.output.string() << "\n";
+        return 1;
+    }
+    return 0;
+#endif
+}
@@ -0,0 +1,354 @@
+// Throughput and contention micro-benchmark of FileLogger. Build it next to the tool:
+//
+//   g++ -std=c++17 -O2 -pthread -Isrc -o push_bench_logger bench/bench_logger.cpp src/file_logger.cpp src/push_engine.cpp src/file_system.cpp
+//   cl /std:c++17 /EHsc /O2 /Isrc /Fe:push_bench_logger.exe bench\bench_logger.cpp src\file_logger.cpp src\push_engine.cpp src\file_system.cpp
+//
+// Every combination of logging mode and thread count writes the same number of records to a fresh
+// log file. The messages are built before timing starts, as the engine builds them before calling
+// the logger, so the numbers cover the lock, the timestamp, the path escaping and the stream write.
+//
+//   info    logInfo("Moved <file> to <folder>"), the record every successful move writes
+//   error   logError(target, "Failed to move file: ..."), which also escapes the target path
+//   mixed   nine info records to one error record
+//
+// Results go to stdout (or --output) as one JSON object.
+
+#include "bench_util.h"
+#include "file_logger.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <random>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#ifndef _WIN32
+#include <unistd.h>
+#endif
+
+namespace fs = std::filesystem;
+
+namespace {
+
+using pushtofolders::displayPath;
+using pushtofolders::FileLogger;
+
+enum class LogMode {
+    Info,
+    Error,
+    Mixed,
+};
+
+const char *modeName(LogMode mode) {
+    switch (mode) {
+    case LogMode::Info:
+        return "info";
+    case LogMode::Error:
+        return "error";
+    case LogMode::Mixed:
+        return "mixed";
+    }
+    return "";
+}
+
+struct BenchConfig {
+    std::vector<unsigned> threads {1, 2, 4, 8, 16, 32, 64};
+    std::vector<LogMode> modes {LogMode::Info, LogMode::Error, LogMode::Mixed};
+    std::size_t records = 200000;
+    fs::path scratch;
+    bool keep = false;
+    bool help = false;
+    fs::path output;
+};
+
+struct Record {
+    fs::path target;
+    std::string message;
+    bool error = false;
+};
+
+// Paths shaped like a photo library or a download folder: 30 to 220 characters, a few deep, some
+// with non-ASCII names.
+std::vector<fs::path> generatePaths(std::size_t count) {
+    static const char *const kFolders[] = {"home", "alex", "Pictures", "2024", "Holiday in Lisbon", "Downloads", "Projects",
+                                           "client-archive", "Scans", "Rechnungen", "\xE5\x86\x99\xE7\x9C\x9F", "Se\xC3\xB1or Garc\xC3\xAD" "a",
+                                           "Raw imports", "exports (final)", "Q3 reports"};
+    static const char *const kExtensions[] = {".jpg", ".CR2", ".xmp", ".mp4", ".pdf", ".docx", ".tar.gz"};
+    std::mt19937 random(7);
+    std::uniform_int_distribution<std::size_t> folder(0, sizeof(kFolders) / sizeof(kFolders[0]) - 1);
+    std::uniform_int_distribution<std::size_t> extension(0, sizeof(kExtensions) / sizeof(kExtensions[0]) - 1);
+    std::uniform_int_distribution<int> depth(2, 7);
+    std::uniform_int_distribution<int> stemLength(8, 60);
+    std::uniform_int_distribution<int> letter('a', 'z');
+
+    std::vector<fs::path> paths;
+    paths.reserve(count);
+    for (std::size_t i = 0; i < count; ++i) {
+        fs::path path = "/";
+        for (int level = depth(random); level > 0; --level) {
+            path /= fs::u8path(kFolders[folder(random)]);
+        }
+        std::string stem = "IMG_" + std::to_string(20240000 + i) + "_";
+        for (int length = stemLength(random); static_cast<int>(stem.size()) < length;) {
+            stem.push_back(static_cast<char>(letter(random)));
+        }
+        paths.push_back(path / fs::u8path(stem + kExtensions[extension(random)]));
+    }
+    return paths;
+}
+
+std::vector<Record> buildRecords(LogMode mode, std::size_t count, const std::vector<fs::path> &paths) {
+    static const char *const kErrors[] = {"Failed to move file: Permission denied", "Failed to move file: No space left on device",
+                                          "Destination file already exists.", "File does not exist."};
+    std::vector<Record> records;
+    records.reserve(count);
+    for (std::size_t i = 0; i < count; ++i) {
+        const fs::path &path = paths[i % paths.size()];
+        bool error = mode == LogMode::Error || (mode == LogMode::Mixed && i % 10 == 9);
+        if (error) {
+            records.push_back({path, kErrors[i % 4], true});
+        } else {
+            fs::path folder = path.parent_path() / path.stem();
+            records.push_back({{}, "Moved " + displayPath(path) + " to " + displayPath(folder), false});
+        }
+    }
+    return records;
+}
+
+struct RunResult {
+    LogMode mode = LogMode::Info;
+    unsigned threads = 1;
+    std::size_t records = 0;
+    double seconds = 0;
+    std::uint64_t bytes = 0;
+    // Latency of single calls in nanoseconds, sorted.
+    std::vector<std::uint32_t> latencies;
+};
+
+RunResult runOnce(LogMode mode, unsigned threadCount, const std::vector<Record> &records, const fs::path &logPath) {
+    std::error_code ec;
+    fs::remove(logPath, ec);
+    RunResult result;
+    result.mode = mode;
+    result.threads = threadCount;
+    result.records = records.size();
+    std::vector<std::vector<std::uint32_t>> latencies(threadCount);
+
+    {
+        FileLogger logger(logPath);
+        std::atomic<unsigned> ready {0};
+        std::atomic<bool> go {false};
+        std::vector<std::thread> workers;
+        workers.reserve(threadCount);
+        for (unsigned t = 0; t < threadCount; ++t) {
+            workers.emplace_back([&, t] {
+                std::vector<std::uint32_t> &own = latencies[t];
+                own.reserve(records.size() / threadCount + 1);
+                ready.fetch_add(1);
+                while (!go.load(std::memory_order_acquire)) {
+                    std::this_thread::yield();
+                }
+                for (std::size_t i = t; i < records.size(); i += threadCount) {
+                    const Record &record = records[i];
+                    auto start = std::chrono::steady_clock::now();
+                    if (record.error) {
+                        logger.logError(record.target, record.message);
+                    } else {
+                        logger.logInfo(record.message);
+                    }
+                    auto elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+                    own.push_back(static_cast<std::uint32_t>(std::min<long long>(elapsed, UINT32_MAX)));
+                }
+            });
+        }
+        while (ready.load() < threadCount) {
+            std::this_thread::yield();
+        }
+        auto start = std::chrono::steady_clock::now();
+        go.store(true, std::memory_order_release);
+        for (auto &worker : workers) {
+            worker.join();
+        }
+        result.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    }
+
+    result.bytes = static_cast<std::uint64_t>(fs::file_size(logPath, ec));
+    for (auto &own : latencies) {
+        result.latencies.insert(result.latencies.end(), own.begin(), own.end());
+    }
+    std::sort(result.latencies.begin(), result.latencies.end());
+    return result;
+}
+
+std::uint32_t percentile(const std::vector<std::uint32_t> &sorted, double fraction) {
+    if (sorted.empty()) {
+        return 0;
+    }
+    auto index = static_cast<std::size_t>(fraction * static_cast<double>(sorted.size() - 1) + 0.5);
+    return sorted[std::min(index, sorted.size() - 1)];
+}
+
+std::string toJson(const BenchConfig &config, const fs::path &logPath, const std::vector<RunResult> &results) {
+    std::ostringstream json;
+    json.precision(6);
+    json << "{\n";
+    json << "  \"recordsPerRun\": " << config.records << ",\n";
+    json << "  \"logFile\": " << bench::jsonString(logPath.u8string()) << ",\n";
+    json << "  \"runs\": [\n";
+    for (std::size_t i = 0; i < results.size(); ++i) {
+        const RunResult &result = results[i];
+        const auto &latencies = result.latencies;
+        json << "    {\"mode\": " << bench::jsonString(modeName(result.mode)) << ", \"threads\": " << result.threads
+             << ", \"records\": " << result.records << ", \"seconds\": " << result.seconds
+             << ", \"recordsPerSecond\": " << (result.seconds > 0 ? static_cast<double>(result.records) / result.seconds : 0.0)
+             << ", \"nsPerRecord\": " << (result.records > 0 ? result.seconds * 1e9 / static_cast<double>(result.records) : 0.0)
+             << ", \"bytesPerRecord\": " << (result.records > 0 ? static_cast<double>(result.bytes) / static_cast<double>(result.records) : 0.0)
+             << ", \"latencyNs\": {\"p50\": " << percentile(latencies, 0.50) << ", \"p90\": " << percentile(latencies, 0.90)
+             << ", \"p99\": " << percentile(latencies, 0.99) << ", \"p999\": " << percentile(latencies, 0.999)
+             << ", \"max\": " << (latencies.empty() ? 0 : latencies.back()) << "}}" << (i + 1 < results.size() ? "," : "") << "\n";
+    }
+    json << "  ]\n}\n";
+    return json.str();
+}
+
+void printUsage() {
+    std::cerr << "Usage: push_bench_logger [options]\n"
+              << "  --threads N,N,...  Thread counts to run (default 1,2,4,8,16,32,64)\n"
+              << "  --modes M,M,...    Any of info, error and mixed (default all three)\n"
+              << "  --records N        Records written per run (default 200000)\n"
+              << "  --scratch DIR      Where the log file is written (default /dev/shm or the temp folder)\n"
+              << "  --keep             Leave the last log file in place\n"
+              << "  --output FILE      Write the JSON results to FILE instead of stdout\n";
+}
+
+std::vector<std::string> splitList(std::string_view text) {
+    std::vector<std::string> items;
+    while (!text.empty()) {
+        std::size_t comma = text.find(',');
+        items.emplace_back(text.substr(0, comma));
+        text = comma == std::string_view::npos ? std::string_view() : text.substr(comma + 1);
+    }
+    return items;
+}
+
+bool parseArguments(int argc, char **argv, BenchConfig &config, std::string &errorMessage) {
+    for (int i = 1; i < argc; ++i) {
+        std::string_view argument(argv[i]);
+        const auto value = [&](const char *option) -> const char * {
+            if (i + 1 >= argc) {
+                errorMessage = std::string(option) + " requires a value.";
+                return nullptr;
+            }
+            return argv[++i];
+        };
+        const char *text = nullptr;
+        if (argument == "--help") {
+            config.help = true;
+        } else if (argument == "--keep") {
+            config.keep = true;
+        } else if (argument == "--threads" && (text = value("--threads"))) {
+            config.threads.clear();
+            for (const auto &item : splitList(text)) {
+                unsigned count = static_cast<unsigned>(std::strtoul(item.c_str(), nullptr, 10));
+                if (count == 0) {
+                    errorMessage = "--threads needs positive counts.";
+                    return false;
+                }
+                config.threads.push_back(count);
+            }
+        } else if (argument == "--modes" && (text = value("--modes"))) {
+            config.modes.clear();
+            for (const auto &item : splitList(text)) {
+                if (item == "info") {
+                    config.modes.push_back(LogMode::Info);
+                } else if (item == "error") {
+                    config.modes.push_back(LogMode::Error);
+                } else if (item == "mixed") {
+                    config.modes.push_back(LogMode::Mixed);
+                } else {
+                    errorMessage = "Unknown logging mode: " + item;
+                    return false;
+                }
+            }
+        } else if (argument == "--records" && (text = value("--records"))) {
+            config.records = static_cast<std::size_t>(std::strtoull(text, nullptr, 10));
+        } else if (argument == "--scratch" && (text = value("--scratch"))) {
+            config.scratch = fs::u8path(text);
+        } else if (argument == "--output" && (text = value("--output"))) {
+            config.output = fs::u8path(text);
+        } else {
+            if (errorMessage.empty()) {
+                errorMessage = "Unknown option: " + std::string(argument);
+            }
+            return false;
+        }
+    }
+    if (config.records == 0 || config.threads.empty() || config.modes.empty()) {
+        errorMessage = "Nothing to run.";
+        return false;
+    }
+    return true;
+}
+
+} // namespace
+
+int main(int argc, char **argv) {
+    BenchConfig config;
+    std::string errorMessage;
+    if (!parseArguments(argc, argv, config, errorMessage)) {
+        std::cerr << errorMessage << "\n";
+        printUsage();
+        return 2;
+    }
+    if (config.help) {
+        printUsage();
+        return 0;
+    }
+    if (config.scratch.empty()) {
+        config.scratch = bench::defaultScratch();
+    }
+
+#ifdef _WIN32
+    const fs::path logPath = config.scratch / "pushbench-logger.log";
+#else
+    const fs::path logPath = config.scratch / ("pushbench-logger-" + std::to_string(::getpid()) + ".log");
+#endif
+    const std::vector<fs::path> paths = generatePaths(4096);
+
+    std::vector<RunResult> results;
+    for (LogMode mode : config.modes) {
+        const std::vector<Record> records = buildRecords(mode, config.records, paths);
+        for (unsigned threads : config.threads) {
+            results.push_back(runOnce(mode, threads, records, logPath));
+            if (results.back().bytes == 0) {
+                std::cerr << "Unable to write the log file at " << displayPath(logPath) << "\n";
+                return 1;
+            }
+        }
+    }
+    if (!config.keep) {
+        std::error_code ec;
+        fs::remove(logPath, ec);
+    }
+
+    const std::string json = toJson(config, logPath, results);
+    if (config.output.empty()) {
+        std::cout << json;
+        return 0;
+    }
+    std::ofstream out(config.output, std::ios::binary | std::ios::trunc);
+    out << json;
+    if (!out) {
+        std::cerr << "Cannot write " << config.output.u8string() << "\n";
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,261 @@
+// Start-up benchmark: the time from starting the tool to its exit for the smallest useful job,
+// moving one file, which is what every Explorer context-menu launch does. Build it next to the tool:
+//
+//   g++ -std=c++17 -O2 -pthread -Isrc -o push_bench_startup bench/bench_startup.cpp
+//
+// Processes are started one after another (never overlapping) and timed from posix_spawn to waitpid.
+// Three scenarios are measured:
+//
+//   baseline   /bin/true, the cost of creating and reaping any process on this machine
+//   move       one fresh file, moved into its folder; this is the number to watch
+//   show-log   --show-log on the log the move runs wrote, which writes nothing itself
+//
+// The children get TMPDIR pointed at the scratch folder, which is where the tool keeps its log.
+// Results go to stdout (or --output) as one JSON object. POSIX only.
+
+#include "bench_util.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <spawn.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+extern char **environ;
+#endif
+
+namespace fs = std::filesystem;
+
+namespace {
+
+struct BenchConfig {
+    fs::path executable = "./PushToFolders";
+    std::size_t samples = 200;
+    std::size_t warmup = 10;
+    fs::path scratch;
+    bool keep = false;
+    bool help = false;
+    fs::path output;
+};
+
+struct ScenarioResult {
+    std::string name;
+    std::vector<double> milliseconds;
+    std::size_t failures = 0;
+};
+
+double percentile(std::vector<double> values, double fraction) {
+    if (values.empty()) {
+        return 0;
+    }
+    std::sort(values.begin(), values.end());
+    auto index = static_cast<std::size_t>(fraction * static_cast<double>(values.size() - 1) + 0.5);
+    return values[std::min(index, values.size() - 1)];
+}
+
+#ifndef _WIN32
+// Runs `arguments` with its output discarded and waits for it. Returns the elapsed milliseconds, or a
+// negative value when the process could not be started or did not exit with status 0.
+double runOnce(const std::vector<std::string> &arguments, std::vector<char *> &environment) {
+    std::vector<char *> argv;
+    for (const auto &argument : arguments) {
+        argv.push_back(const_cast<char *>(argument.c_str()));
+    }
+    argv.push_back(nullptr);
+
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_addopen(&actions, STDOUT_FILENO, "/dev/null", O_WRONLY, 0);
+    posix_spawn_file_actions_addopen(&actions, STDERR_FILENO, "/dev/null", O_WRONLY, 0);
+    auto start = std::chrono::steady_clock::now();
+    pid_t pid = -1;
+    int error = posix_spawn(&pid, argv[0], &actions, nullptr, argv.data(), environment.data());
+    posix_spawn_file_actions_destroy(&actions);
+    int status = 0;
+    if (error != 0 || ::waitpid(pid, &status, 0) < 0) {
+        return -1;
+    }
+    double elapsed = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    return WIFEXITED(status) && WEXITSTATUS(status) == 0 ? elapsed : -1;
+}
+#endif
+
+void printUsage() {
+    std::cerr << "Usage: push_bench_startup [options]\n"
+              << "  --exe PATH      The PushToFolders binary (default ./PushToFolders)\n"
+              << "  --samples N     Timed runs per scenario (default 200)\n"
+              << "  --warmup N      Untimed runs per scenario first, to fill the page cache (default 10)\n"
+              << "  --scratch DIR   Where the files and log are created (default /dev/shm or the temp folder)\n"
+              << "  --keep          Leave the files and log in place\n"
+              << "  --output FILE   Write the JSON results to FILE instead of stdout\n";
+}
+
+bool parseArguments(int argc, char **argv, BenchConfig &config, std::string &errorMessage) {
+    for (int i = 1; i < argc; ++i) {
+        std::string_view argument(argv[i]);
+        const auto value = [&](const char *option) -> const char * {
+            if (i + 1 >= argc) {
+                errorMessage = std::string(option) + " requires a value.";
+                return nullptr;
+            }
+            return argv[++i];
+        };
+        const char *text = nullptr;
+        if (argument == "--help") {
+            config.help = true;
+        } else if (argument == "--keep") {
+            config.keep = true;
+        } else if (argument == "--exe" && (text = value("--exe"))) {
+            config.executable = text;
+        } else if (argument == "--samples" && (text = value("--samples"))) {
+            config.samples = static_cast<std::size_t>(std::strtoull(text, nullptr, 10));
+        } else if (argument == "--warmup" && (text = value("--warmup"))) {
+            config.warmup = static_cast<std::size_t>(std::strtoull(text, nullptr, 10));
+        } else if (argument == "--scratch" && (text = value("--scratch"))) {
+            config.scratch = text;
+        } else if (argument == "--output" && (text = value("--output"))) {
+            config.output = text;
+        } else {
+            if (errorMessage.empty()) {
+                errorMessage = "Unknown option: " + std::string(argument);
+            }
+            return false;
+        }
+    }
+    if (config.samples == 0) {
+        errorMessage = "--samples must be at least 1.";
+        return false;
+    }
+    return true;
+}
+
+} // namespace
+
+int main(int argc, char **argv) {
+    BenchConfig config;
+    std::string errorMessage;
+    if (!parseArguments(argc, argv, config, errorMessage)) {
+        std::cerr << errorMessage << "\n";
+        printUsage();
+        return 2;
+    }
+    if (config.help) {
+        printUsage();
+        return 0;
+    }
+#ifdef _WIN32
+    std::cerr << "push_bench_startup runs on POSIX systems only.\n";
+    return 1;
+#else
+    std::error_code ec;
+    config.executable = fs::absolute(config.executable, ec);
+    if (::access(config.executable.c_str(), X_OK) != 0) {
+        std::cerr << "Cannot run " << config.executable.string() << "; pass the tool with --exe.\n";
+        return 1;
+    }
+    if (config.scratch.empty()) {
+        config.scratch = bench::defaultScratch();
+    }
+
+    const fs::path runRoot = config.scratch / ("pushbench-startup-" + std::to_string(::getpid()));
+    const fs::path inbox = runRoot / "inbox";
+    const fs::path logFolder = runRoot / "log";
+    for (const auto &folder : {inbox, logFolder}) {
+        fs::create_directories(folder, ec);
+        if (ec) {
+            std::cerr << "Cannot create " << folder.string() << ": " << ec.message() << "\n";
+            return 1;
+        }
+    }
+
+    std::vector<std::string> variables;
+    for (char **entry = environ; *entry != nullptr; ++entry) {
+        if (std::string_view(*entry).rfind("TMPDIR=", 0) != 0) {
+            variables.emplace_back(*entry);
+        }
+    }
+    variables.push_back("TMPDIR=" + logFolder.string());
+    std::vector<char *> environment;
+    for (auto &variable : variables) {
+        environment.push_back(variable.data());
+    }
+    environment.push_back(nullptr);
+
+    const std::string executable = config.executable.string();
+    std::size_t fileIndex = 0;
+    // Each move run gets a file of its own, created before the clock starts.
+    const auto moveArguments = [&] {
+        fs::path file = inbox / ("IMG_" + std::to_string(fileIndex++) + ".jpg");
+        std::ofstream(file, std::ios::binary);
+        return std::vector<std::string> {executable, file.string()};
+    };
+
+    std::vector<ScenarioResult> results;
+    const auto measure = [&](const std::string &name, auto &&argumentsFor) {
+        ScenarioResult result;
+        result.name = name;
+        for (std::size_t i = 0; i < config.warmup + config.samples; ++i) {
+            std::vector<std::string> arguments = argumentsFor();
+            double milliseconds = runOnce(arguments, environment);
+            if (i < config.warmup) {
+                continue;
+            }
+            if (milliseconds < 0) {
+                ++result.failures;
+            } else {
+                result.milliseconds.push_back(milliseconds);
+            }
+        }
+        results.push_back(std::move(result));
+    };
+    measure("baseline", [] { return std::vector<std::string> {"/bin/true"}; });
+    measure("move", moveArguments);
+    measure("show-log", [&] { return std::vector<std::string> {executable, "--show-log"}; });
+
+    std::size_t leftBehind = 0;
+    for (std::size_t i = 0; i < fileIndex; ++i) {
+        leftBehind += fs::exists(inbox / ("IMG_" + std::to_string(i) + ".jpg"), ec) ? 1 : 0;
+    }
+    if (!config.keep) {
+        fs::remove_all(runRoot, ec);
+    }
+
+    std::ostringstream json;
+    json.precision(6);
+    json << "{\n"
+         << "  \"samples\": " << config.samples << ",\n"
+         << "  \"filesLeftBehind\": " << leftBehind << ",\n"
+         << "  \"scenarios\": [\n";
+    for (std::size_t i = 0; i < results.size(); ++i) {
+        const ScenarioResult &result = results[i];
+        json << "    {\"name\": " << bench::jsonString(result.name) << ", \"runs\": " << result.milliseconds.size()
+             << ", \"failures\": " << result.failures << ", \"ms\": {\"min\": " << percentile(result.milliseconds, 0.0)
+             << ", \"p50\": " << percentile(result.milliseconds, 0.5) << ", \"p90\": " << percentile(result.milliseconds, 0.9)
+             << ", \"p99\": " << percentile(result.milliseconds, 0.99) << ", \"max\": " << percentile(result.milliseconds, 1.0) << "}}"
+             << (i + 1 < results.size() ? "," : "") << "\n";
+    }
+    json << "  ]\n}\n";
+
+    if (config.output.empty()) {
+        std::cout << json.str();
+        return 0;
+    }
+    std::ofstream out(config.output, std::ios::binary | std::ios::trunc);
+    out << json.str();
+    if (!out) {
+        std::cerr << "Cannot write " << config.output.string() << "\n";
+        return 1;
+    }
+    return 0;
+#endif
+}
@@ -0,0 +1,42 @@
+#pragma once
+
+#include <cstdio>
+#include <filesystem>
+#include <string>
+#include <string_view>
+#include <system_error>
+
+// Helpers shared by the benchmark programs.
+namespace bench {
+
+namespace fs = std::filesystem;
+
+// Picks tmpfs when there is one, so that the numbers measure the code rather than the disk.
+inline fs::path defaultScratch() {
+#ifdef __linux__
+    std::error_code ec;
+    if (fs::is_directory("/dev/shm", ec)) {
+        return "/dev/shm";
+    }
+#endif
+    return fs::temp_directory_path();
+}
+
+inline std::string jsonString(std::string_view text) {
+    std::string out = "\"";
+    for (char c : text) {
+        if (c == '"' || c == '\\') {
+            out.push_back('\\');
+            out.push_back(c);
+        } else if (static_cast<unsigned char>(c) < 0x20) {
+            char escaped[8];
+            std::snprintf(escaped, sizeof(escaped), "\\u%04x", static_cast<unsigned>(c));
+            out += escaped;
+        } else {
+            out.push_back(c);
+        }
+    }
+    return out + "\"";
+}
+
+} // namespace bench
@@ -0,0 +1,41 @@
+// Rebuilds a tree from a shape file written by `PushToFolders --capture-shape`, so that the tool or
+// push_bench can be run on something that looks like a production folder. Build it next to the tool:
+//
+//   g++ -std=c++17 -O2 -pthread -Isrc -o replay_shape bench/replay_shape.cpp src/file_system.cpp
+//   cl /std:c++17 /EHsc /O2 /Isrc /Fe:replay_shape.exe bench\replay_shape.cpp src\file_system.cpp
+//
+// Usage: replay_shape SHAPE DIR. Every captured root becomes DIR/shape-N; the folders that hold files
+// are printed one per line, ready to pass to PushToFolders.
+
+#include "shape_replay.h"
+
+#include <iostream>
+#include <string>
+#include <string_view>
+#include <vector>
+
+int main(int argc, char **argv) {
+    const bool help = argc == 2 && std::string_view(argv[1]) == "--help";
+    if (argc != 3) {
+        std::cerr << "Usage: replay_shape SHAPE DIR\n";
+        return help ? 0 : 2;
+    }
+
+    bench::Shape shape;
+    std::string errorMessage;
+    if (!bench::readShape(bench::fs::u8path(argv[1]), shape, errorMessage)) {
+        std::cerr << errorMessage << "\n";
+        return 1;
+    }
+    std::vector<bench::fs::path> folders;
+    if (!bench::replayShape(shape, bench::fs::u8path(argv[2]), nullptr, folders, errorMessage)) {
+        std::cerr << errorMessage << "\n";
+        return 1;
+    }
+
+    std::cerr << "Created " << shape.files.size() << " files in " << shape.folders.size() << " folders.\n";
+    for (const auto &folder : folders) {
+        std::cout << folder.u8string() << "\n";
+    }
+    return 0;
+}
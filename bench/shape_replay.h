@@ -0,0 +1,207 @@
+#pragma once
+
+#include "file_system.h"
+
+#include <cstdint>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <map>
+#include <set>
+#include <sstream>
+#include <string>
+#include <system_error>
+#include <vector>
+
+// Reads the shape files written by `PushToFolders --capture-shape` and rebuilds a tree of the same
+// shape: the same folders, the same number of files per folder, the same name lengths, extensions,
+// rounded sizes and stems shared between files. The names themselves are made up.
+namespace bench {
+
+namespace fs = std::filesystem;
+
+struct ShapeFolder {
+    // SIZE_MAX for the captured roots.
+    std::size_t parent = SIZE_MAX;
+    std::size_t nameLength = 0;
+    bool unicode = false;
+};
+
+struct ShapeFile {
+    std::size_t folder = 0;
+    std::uint64_t stemHash = 0;
+    std::size_t stemLength = 0;
+    bool unicode = false;
+    // Includes the leading dot; empty when the file has none.
+    std::string extension;
+    std::uintmax_t size = 0;
+};
+
+struct Shape {
+    std::vector<ShapeFolder> folders;
+    std::vector<ShapeFile> files;
+};
+
+// A name of exactly `length` UTF-8 bytes derived from `seed`. Lower case only, so that generated
+// names never collide on a case-insensitive volume; a flagged name ends in "é".
+inline std::string shapeName(std::uint64_t seed, std::size_t length, bool unicode) {
+    static const char kAlphabet[] = "abcdefghijklmnopqrstuvwxyz0123456789";
+    std::string name;
+    std::size_t plainLength = unicode && length >= 2 ? length - 2 : length;
+    while (name.size() < plainLength) {
+        seed += 0x9E3779B97F4A7C15ull;
+        std::uint64_t bits = seed;
+        bits = (bits ^ (bits >> 30)) * 0xBF58476D1CE4E5B9ull;
+        bits = (bits ^ (bits >> 27)) * 0x94D049BB133111EBull;
+        bits ^= bits >> 31;
+        name.push_back(kAlphabet[bits % (sizeof(kAlphabet) - 1)]);
+    }
+    if (plainLength < length) {
+        name += "\xC3\xA9";
+    }
+    return name;
+}
+
+inline bool readShape(const fs::path &shapeFile, Shape &shape, std::string &errorMessage) {
+    std::ifstream input(shapeFile, std::ios::binary);
+    std::string line;
+    if (!input || !std::getline(input, line) || line != "PushToFolders shape 1") {
+        errorMessage = "Not a shape file: " + shapeFile.u8string();
+        return false;
+    }
+
+    std::size_t lineNumber = 1;
+    while (std::getline(input, line)) {
+        ++lineNumber;
+        if (line.empty()) {
+            continue;
+        }
+        std::istringstream fields(line);
+        std::string kind;
+        std::string flag;
+        fields >> kind;
+        if (kind == "D") {
+            std::size_t id = 0;
+            std::string parent;
+            ShapeFolder folder;
+            fields >> id >> parent >> folder.nameLength >> flag;
+            if (fields && id == shape.folders.size()) {
+                if (parent != "-") {
+                    folder.parent = static_cast<std::size_t>(std::strtoull(parent.c_str(), nullptr, 10));
+                }
+                folder.unicode = flag == "u";
+                if (folder.parent == SIZE_MAX || folder.parent < id) {
+                    shape.folders.push_back(folder);
+                    continue;
+                }
+            }
+        } else if (kind == "F") {
+            std::string hash;
+            std::string extension;
+            ShapeFile file;
+            fields >> file.folder >> hash >> file.stemLength >> flag >> extension >> file.size;
+            if (fields && file.folder < shape.folders.size() && file.stemLength > 0) {
+                file.stemHash = std::strtoull(hash.c_str(), nullptr, 16);
+                file.unicode = flag == "u";
+                if (extension[0] == '~') {
+                    // An extension whose text was not kept: "~length" or "~length:hash". Equal hashes get
+                    // the same made-up extension, so files that shared one still do.
+                    char *end = nullptr;
+                    std::size_t length = static_cast<std::size_t>(std::strtoull(extension.c_str() + 1, &end, 10));
+                    std::uint64_t hash = *end == ':' ? std::strtoull(end + 1, nullptr, 16) : 0;
+                    file.extension = length == 0 ? std::string() : "." + shapeName(hash, length - 1, false);
+                } else if (extension != "-") {
+                    file.extension = extension;
+                }
+                shape.files.push_back(std::move(file));
+                continue;
+            }
+        }
+        errorMessage = "Malformed line " + std::to_string(lineNumber) + " in " + shapeFile.u8string();
+        return false;
+    }
+    return true;
+}
+
+// Rebuilds `shape` below `root`, in `memory` when it is given and on the disk otherwise, and lists the
+// folders that directly hold files. Each captured root becomes root/shape-N. Files on the disk are
+// sparse and take their rounded size; files in memory are empty.
+inline bool replayShape(const Shape &shape, const fs::path &root, pushtofolders::MemoryFileSystem *memory, std::vector<fs::path> &folders,
+                        std::string &errorMessage) {
+    std::vector<fs::path> paths(shape.folders.size());
+    std::map<std::size_t, std::set<std::string>> takenNames;
+    std::size_t rootCount = 0;
+    for (std::size_t id = 0; id < shape.folders.size(); ++id) {
+        const ShapeFolder &folder = shape.folders[id];
+        if (folder.parent == SIZE_MAX) {
+            paths[id] = root / ("shape-" + std::to_string(rootCount++));
+        } else {
+            std::set<std::string> &taken = takenNames[folder.parent];
+            std::uint64_t seed = 0xD1B54A32D192ED03ull ^ id;
+            std::string name = shapeName(seed, folder.nameLength, folder.unicode);
+            while (name.empty() || !taken.insert(name).second) {
+                name = shapeName(++seed, folder.nameLength + (folder.nameLength == 0), folder.unicode);
+            }
+            paths[id] = paths[folder.parent] / fs::u8path(name);
+        }
+
+        if (memory) {
+            memory->addDirectory(paths[id]);
+            continue;
+        }
+        std::error_code ec;
+        fs::create_directories(paths[id], ec);
+        if (ec) {
+            errorMessage = "Cannot create " + paths[id].u8string() + ": " + ec.message();
+            return false;
+        }
+    }
+
+    // Files with the same stem hash in a folder get the same made-up stem, which keeps the groups the
+    // engine will form. Folders were named first, so a file never takes a folder's name.
+    std::map<std::pair<std::size_t, std::uint64_t>, std::string> stems;
+    std::vector<bool> holdsFiles(shape.folders.size(), false);
+    for (const ShapeFile &file : shape.files) {
+        std::set<std::string> &taken = takenNames[file.folder];
+        auto found = stems.find({file.folder, file.stemHash});
+        if (found == stems.end()) {
+            std::uint64_t seed = file.stemHash;
+            std::string stem = shapeName(seed, file.stemLength, file.unicode);
+            while (!taken.insert(stem).second) {
+                stem = shapeName(++seed, file.stemLength, file.unicode);
+            }
+            found = stems.emplace(std::make_pair(file.folder, file.stemHash), std::move(stem)).first;
+        }
+        std::string name = found->second + file.extension;
+        if (!file.extension.empty() && !taken.insert(name).second) {
+            // Only a hash collision in the capture can repeat a name; keep the file count anyway.
+            std::uint64_t seed = file.stemHash;
+            do {
+                name = shapeName(++seed, file.stemLength, file.unicode) + file.extension;
+            } while (!taken.insert(name).second);
+        }
+
+        fs::path path = paths[file.folder] / fs::u8path(name);
+        holdsFiles[file.folder] = true;
+        if (memory) {
+            memory->addFile(path);
+            continue;
+        }
+        std::ofstream output(path, std::ios::binary | std::ios::trunc);
+        output.close();
+        std::error_code ec;
+        if (!output || (fs::resize_file(path, file.size, ec), ec)) {
+            errorMessage = "Cannot create " + path.u8string() + (ec ? ": " + ec.message() : std::string());
+            return false;
+        }
+    }
+
+    for (std::size_t id = 0; id < shape.folders.size(); ++id) {
+        if (holdsFiles[id]) {
+            folders.push_back(paths[id]);
+        }
+    }
+    return true;
+}
+
+} // namespace bench
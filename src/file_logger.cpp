@@ -0,0 +1,70 @@
+#include "file_logger.h"
+
+#include <chrono>
+#include <ctime>
+#include <iostream>
+#include <system_error>
+#include <utility>
+
+namespace pushtofolders {
+
+std::string timestampForLog() {
+    using clock = std::chrono::system_clock;
+    auto now = clock::now();
+    auto tt = clock::to_time_t(now);
+    std::tm tm {};
+#ifdef _WIN32
+    localtime_s(&tm, &tt);
+#else
+    localtime_r(&tt, &tm);
+#endif
+    char buffer[32];
+    std::strftime(buffer, sizeof(buffer), "%Y-%m-%d %H:%M:%S", &tm);
+    return std::string(buffer);
+}
+
+FileLogger::FileLogger(fs::path path)
+    : logFilePath_(std::move(path))
+{
+}
+
+bool FileLogger::ensureOpen() {
+    if (openAttempted_) {
+        return static_cast<bool>(stream_);
+    }
+    openAttempted_ = true;
+    stream_.open(logFilePath_, std::ios::app);
+    if (!stream_ && logFilePath_.has_parent_path()) {
+        // The log folder normally exists, so it is only created once opening the file has failed.
+        std::error_code ec;
+        fs::create_directories(logFilePath_.parent_path(), ec);
+        stream_.clear();
+        stream_.open(logFilePath_, std::ios::app);
+    }
+    if (!stream_) {
+        std::cerr << "Warning: Unable to open log file at " << displayPath(logFilePath_) << "\n";
+        return false;
+    }
+    stream_ << "--- Run started at " << timestampForLog() << " ---\n";
+    return true;
+}
+
+void FileLogger::logError(const fs::path &target, std::string_view message) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (ensureOpen()) {
+        stream_ << "[" << timestampForLog() << "] ERROR: " << message;
+        if (!target.empty()) {
+            stream_ << " | Target: " << displayPath(target);
+        }
+        stream_ << "\n";
+    }
+}
+
+void FileLogger::logInfo(std::string_view message) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (ensureOpen()) {
+        stream_ << "[" << timestampForLog() << "] INFO: " << message << "\n";
+    }
+}
+
+} // namespace pushtofolders
@@ -0,0 +1,44 @@
+#pragma once
+
+#include <filesystem>
+#include <fstream>
+#include <mutex>
+#include <string>
+#include <string_view>
+
+#include "push_engine.h"
+
+namespace pushtofolders {
+
+// Local time as "YYYY-MM-DD HH:MM:SS", the stamp on every log record.
+std::string timestampForLog();
+
+// Appends the engine's log, and the command line's own failures, to a log file. Safe to call from
+// several threads; each record is written whole. The file, and the run header in it, are only
+// created by the first record, so a run that has nothing to log never touches it.
+class FileLogger : public Logger {
+public:
+    explicit FileLogger(fs::path path);
+
+    void logError(const fs::path &target, std::string_view message) override;
+    void logInfo(std::string_view message) override;
+
+    void logExecutionFailure(std::string_view message) {
+        logError({}, message);
+    }
+
+    const fs::path &path() const {
+        return logFilePath_;
+    }
+
+private:
+    // Called with mutex_ held. False when the file cannot be opened; records are then dropped.
+    bool ensureOpen();
+
+    fs::path logFilePath_;
+    std::ofstream stream_;
+    bool openAttempted_ = false;
+    std::mutex mutex_;
+};
+
+} // namespace pushtofolders
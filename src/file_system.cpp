@@ -0,0 +1,1081 @@
+#include "file_system.h"
+#include "native_text.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <set>
+#include <thread>
+#include <utility>
+
+#ifdef _WIN32
+#define NOMINMAX
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#ifdef __linux__
+#include <linux/fs.h>
+#include <sys/vfs.h>
+#endif
+
+namespace pushtofolders {
+
+namespace {
+
+std::string errorText(std::errc error) {
+    return std::make_error_code(error).message();
+}
+
+#ifdef _WIN32
+std::wstring toExtendedPath(const fs::path &path) {
+    std::error_code ec;
+    fs::path absolutePath = fs::absolute(path, ec);
+    const std::wstring native = (ec ? path : absolutePath).native();
+
+    if (native.rfind(L"\\\\?\\", 0) == 0) {
+        return native;
+    }
+
+    if (native.rfind(L"\\\\", 0) == 0) {
+        return L"\\\\?\\UNC\\" + native.substr(2);
+    }
+
+    return L"\\\\?\\" + native;
+}
+
+bool createDirectoriesWin32(const fs::path &dir, std::string &errorMessage) {
+    std::error_code ec;
+    if (fs::exists(dir, ec)) {
+        return true;
+    }
+
+    fs::path absoluteTarget = fs::absolute(dir, ec);
+    if (ec) {
+        absoluteTarget = dir;
+    }
+
+    std::vector<fs::path> pending;
+    fs::path current = absoluteTarget;
+    while (!current.empty()) {
+        if (fs::exists(current, ec)) {
+            break;
+        }
+        pending.push_back(current);
+        current = current.parent_path();
+    }
+
+    for (auto it = pending.rbegin(); it != pending.rend(); ++it) {
+        std::wstring extended = toExtendedPath(*it);
+        if (!CreateDirectoryW(extended.c_str(), nullptr)) {
+            DWORD lastError = GetLastError();
+            if (lastError != ERROR_ALREADY_EXISTS) {
+                errorMessage = windowsErrorMessage(lastError);
+                return false;
+            }
+        }
+    }
+
+    return true;
+}
+
+std::time_t fileTimeToUnix(const FILETIME &fileTime) {
+    ULARGE_INTEGER ticks {};
+    ticks.LowPart = fileTime.dwLowDateTime;
+    ticks.HighPart = fileTime.dwHighDateTime;
+    constexpr unsigned long long kTicksPerSecond = 10000000ull;
+    constexpr unsigned long long kUnixEpochInTicks = 116444736000000000ull;
+    return static_cast<std::time_t>((ticks.QuadPart - kUnixEpochInTicks) / kTicksPerSecond);
+}
+#else
+FileType fileTypeOf(unsigned mode) {
+    if (S_ISREG(mode)) {
+        return FileType::Regular;
+    }
+    if (S_ISDIR(mode)) {
+        return FileType::Directory;
+    }
+    if (S_ISLNK(mode)) {
+        return FileType::Symlink;
+    }
+    return FileType::Other;
+}
+#endif
+
+class NativeFileSystem final : public FileSystem {
+public:
+    bool listDirectory(const fs::path &directory, std::vector<DirectoryEntry> &entries, std::string &errorMessage) override {
+#ifdef _WIN32
+        std::wstring pattern = toExtendedPath(directory) + L"\\*";
+        WIN32_FIND_DATAW data;
+        HANDLE find = FindFirstFileExW(pattern.c_str(), FindExInfoBasic, &data, FindExSearchNameMatch, nullptr, FIND_FIRST_EX_LARGE_FETCH);
+        if (find == INVALID_HANDLE_VALUE) {
+            DWORD error = GetLastError();
+            if (error == ERROR_FILE_NOT_FOUND) {
+                return true;
+            }
+            errorMessage = windowsErrorMessage(error);
+            return false;
+        }
+
+        do {
+            std::wstring_view name(data.cFileName);
+            if (name == L"." || name == L"..") {
+                continue;
+            }
+            DirectoryEntry entry;
+            entry.name = PathString(name);
+            if ((data.dwFileAttributes & FILE_ATTRIBUTE_REPARSE_POINT) != 0) {
+                entry.type = FileType::Symlink;
+            } else if ((data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) != 0) {
+                entry.type = FileType::Directory;
+            } else {
+                entry.type = FileType::Regular;
+                FileMetadata metadata;
+                metadata.size = (static_cast<std::uintmax_t>(data.nFileSizeHigh) << 32) | data.nFileSizeLow;
+                metadata.modifiedTime = fileTimeToUnix(data.ftLastWriteTime);
+                entry.metadata = metadata;
+            }
+            entries.push_back(std::move(entry));
+        } while (FindNextFileW(find, &data));
+
+        DWORD error = GetLastError();
+        FindClose(find);
+        if (error != ERROR_NO_MORE_FILES) {
+            errorMessage = windowsErrorMessage(error);
+            return false;
+        }
+        return true;
+#else
+        DIR *stream = ::opendir(directory.c_str());
+        if (stream == nullptr) {
+            errorMessage = std::generic_category().message(errno);
+            return false;
+        }
+
+        for (;;) {
+            errno = 0;
+            const dirent *entry = ::readdir(stream);
+            if (entry == nullptr) {
+                if (errno != 0) {
+                    errorMessage = std::generic_category().message(errno);
+                    ::closedir(stream);
+                    return false;
+                }
+                break;
+            }
+
+            std::string_view name(entry->d_name);
+            if (name == "." || name == "..") {
+                continue;
+            }
+            FileType type = FileType::Other;
+            switch (entry->d_type) {
+            case DT_REG:
+                type = FileType::Regular;
+                break;
+            case DT_DIR:
+                type = FileType::Directory;
+                break;
+            case DT_LNK:
+                type = FileType::Symlink;
+                break;
+            case DT_UNKNOWN: {
+                // Some file systems leave the type out of the listing.
+                struct stat attributes {};
+                if (::fstatat(::dirfd(stream), entry->d_name, &attributes, AT_SYMLINK_NOFOLLOW) != 0) {
+                    continue;
+                }
+                type = fileTypeOf(attributes.st_mode);
+                break;
+            }
+            default:
+                break;
+            }
+            entries.push_back({PathString(name), type, std::nullopt});
+        }
+        ::closedir(stream);
+        return true;
+#endif
+    }
+
+    bool readMetadata(const fs::path &path, unsigned fields, FileMetadata &metadata, std::string &errorMessage) override {
+#ifdef _WIN32
+        (void)fields;
+        WIN32_FILE_ATTRIBUTE_DATA attributes {};
+        std::wstring extended = toExtendedPath(path);
+        if (!GetFileAttributesExW(extended.c_str(), GetFileExInfoStandard, &attributes)) {
+            DWORD error = GetLastError();
+            if (error == ERROR_FILE_NOT_FOUND || error == ERROR_PATH_NOT_FOUND) {
+                metadata = FileMetadata {FileType::NotFound, 0, 0};
+                return true;
+            }
+            errorMessage = windowsErrorMessage(error);
+            return false;
+        }
+        metadata.type = (attributes.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) != 0 ? FileType::Directory : FileType::Regular;
+        metadata.size = (static_cast<std::uintmax_t>(attributes.nFileSizeHigh) << 32) | attributes.nFileSizeLow;
+        metadata.modifiedTime = fileTimeToUnix(attributes.ftLastWriteTime);
+        return true;
+#else
+#if defined(__linux__) && defined(STATX_MTIME)
+        // Only the requested statx fields are asked for.
+        unsigned mask = STATX_TYPE | ((fields & kMetadataModifiedTime) ? STATX_MTIME : 0) | ((fields & kMetadataSize) ? STATX_SIZE : 0);
+        struct statx attributes {};
+        if (::statx(AT_FDCWD, path.c_str(), AT_STATX_SYNC_AS_STAT, mask, &attributes) != 0) {
+#else
+        (void)fields;
+        struct stat attributes {};
+        if (::stat(path.c_str(), &attributes) != 0) {
+#endif
+            if (errno == ENOENT || errno == ENOTDIR) {
+                metadata = FileMetadata {FileType::NotFound, 0, 0};
+                return true;
+            }
+            errorMessage = std::generic_category().message(errno);
+            return false;
+        }
+#if defined(__linux__) && defined(STATX_MTIME)
+        metadata.type = fileTypeOf(attributes.stx_mode);
+        metadata.size = attributes.stx_size;
+        metadata.modifiedTime = static_cast<std::time_t>(attributes.stx_mtime.tv_sec);
+#else
+        metadata.type = fileTypeOf(attributes.st_mode);
+        metadata.size = static_cast<std::uintmax_t>(attributes.st_size);
+        metadata.modifiedTime = attributes.st_mtime;
+#endif
+        return true;
+#endif
+    }
+
+    bool readPrefix(const fs::path &file, std::string &buffer, std::size_t &bytesRead, std::string &errorMessage) override {
+#ifdef _WIN32
+        std::wstring extended = toExtendedPath(file);
+        HANDLE handle = CreateFileW(extended.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+                                    nullptr, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+        if (handle == INVALID_HANDLE_VALUE) {
+            errorMessage = windowsErrorMessage(GetLastError());
+            return false;
+        }
+
+        DWORD count = 0;
+        BOOL readOk = ReadFile(handle, buffer.data(), static_cast<DWORD>(buffer.size()), &count, nullptr);
+        DWORD readError = GetLastError();
+        CloseHandle(handle);
+        if (!readOk) {
+            errorMessage = windowsErrorMessage(readError);
+            return false;
+        }
+        bytesRead = static_cast<std::size_t>(count);
+        return true;
+#else
+        int fd = ::open(file.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            errorMessage = std::generic_category().message(errno);
+            return false;
+        }
+
+        std::size_t total = 0;
+        while (total < buffer.size()) {
+            ssize_t count = ::read(fd, buffer.data() + total, buffer.size() - total);
+            if (count < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                errorMessage = std::generic_category().message(errno);
+                ::close(fd);
+                return false;
+            }
+            if (count == 0) {
+                break;
+            }
+            total += static_cast<std::size_t>(count);
+        }
+        ::close(fd);
+        bytesRead = total;
+        return true;
+#endif
+    }
+
+    bool createDirectories(const fs::path &directory, std::string &errorMessage) override {
+#ifdef _WIN32
+        return createDirectoriesWin32(directory, errorMessage);
+#else
+        std::error_code ec;
+        fs::create_directories(directory, ec);
+        if (ec) {
+            errorMessage = ec.message();
+            return false;
+        }
+        return true;
+#endif
+    }
+
+    bool renameNoReplace(const fs::path &source, const fs::path &destination, std::string &errorMessage) override {
+#ifdef _WIN32
+        std::wstring sourceExtended = toExtendedPath(source);
+        std::wstring destinationExtended = toExtendedPath(destination);
+        if (!MoveFileExW(sourceExtended.c_str(), destinationExtended.c_str(), 0)) {
+            errorMessage = windowsErrorMessage(GetLastError());
+            return false;
+        }
+        return true;
+#else
+#if defined(__linux__) && defined(RENAME_NOREPLACE)
+        if (::renameat2(AT_FDCWD, source.c_str(), AT_FDCWD, destination.c_str(), RENAME_NOREPLACE) == 0) {
+            return true;
+        }
+        if (errno != EINVAL && errno != ENOSYS) {
+            errorMessage = std::generic_category().message(errno);
+            return false;
+        }
+#endif
+        // Without kernel support, check first; the remaining window is the same as the stem-folder check.
+        std::error_code ec;
+        if (fs::exists(fs::symlink_status(destination, ec))) {
+            errorMessage = std::generic_category().message(EEXIST);
+            return false;
+        }
+        fs::rename(source, destination, ec);
+        if (ec) {
+            errorMessage = ec.message();
+            return false;
+        }
+        return true;
+#endif
+    }
+
+    bool linkNoReplace(const fs::path &source, const fs::path &destination, LinkKind kind, std::string &errorMessage) override {
+        if (kind == LinkKind::Symbolic) {
+            std::error_code ec;
+            fs::path absoluteSource = fs::absolute(source, ec);
+            fs::path target = ec ? source : absoluteSource.lexically_relative(fs::absolute(destination.parent_path(), ec));
+            if (ec || target.empty()) {
+                target = ec ? source : absoluteSource;
+            }
+#ifdef _WIN32
+            std::wstring destinationExtended = toExtendedPath(destination);
+            if (!CreateSymbolicLinkW(destinationExtended.c_str(), target.c_str(), SYMBOLIC_LINK_FLAG_ALLOW_UNPRIVILEGED_CREATE)) {
+                errorMessage = windowsErrorMessage(GetLastError());
+                return false;
+            }
+#else
+            if (::symlink(target.c_str(), destination.c_str()) != 0) {
+                errorMessage = std::generic_category().message(errno);
+                return false;
+            }
+#endif
+            return true;
+        }
+
+#ifdef _WIN32
+        if (kind == LinkKind::Reflink) {
+            errorMessage = "Reflinks are not supported on Windows.";
+            return false;
+        }
+        std::wstring sourceExtended = toExtendedPath(source);
+        std::wstring destinationExtended = toExtendedPath(destination);
+        if (!CreateHardLinkW(destinationExtended.c_str(), sourceExtended.c_str(), nullptr)) {
+            errorMessage = windowsErrorMessage(GetLastError());
+            return false;
+        }
+        return true;
+#else
+        if (kind == LinkKind::Hard) {
+            if (::link(source.c_str(), destination.c_str()) != 0) {
+                errorMessage = std::generic_category().message(errno);
+                return false;
+            }
+            return true;
+        }
+
+#if defined(__linux__) && defined(FICLONE)
+        int sourceFd = ::open(source.c_str(), O_RDONLY | O_CLOEXEC);
+        if (sourceFd < 0) {
+            errorMessage = std::generic_category().message(errno);
+            return false;
+        }
+        struct stat sourceStat {};
+        ::fstat(sourceFd, &sourceStat);
+        int destinationFd = ::open(destination.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, sourceStat.st_mode & 07777);
+        if (destinationFd < 0) {
+            errorMessage = std::generic_category().message(errno);
+            ::close(sourceFd);
+            return false;
+        }
+        bool cloned = ::ioctl(destinationFd, FICLONE, sourceFd) == 0;
+        if (!cloned) {
+            errorMessage = std::generic_category().message(errno);
+        }
+        ::close(destinationFd);
+        ::close(sourceFd);
+        if (!cloned) {
+            ::unlink(destination.c_str());
+        }
+        return cloned;
+#else
+        errorMessage = "Reflinks are not supported on this platform.";
+        return false;
+#endif
+#endif
+    }
+
+    bool isLinkTo(const fs::path &link, const fs::path &source, LinkKind kind) override {
+        if (kind == LinkKind::Symbolic) {
+            std::error_code ec;
+            fs::path target = fs::read_symlink(link, ec);
+            if (ec) {
+                return false;
+            }
+            fs::path resolved = target.is_absolute() ? target : link.parent_path() / target;
+            fs::path absoluteResolved = fs::absolute(resolved, ec).lexically_normal();
+            fs::path absoluteSource = fs::absolute(source, ec).lexically_normal();
+            return !ec && absoluteResolved == absoluteSource;
+        }
+        if (kind != LinkKind::Hard) {
+            return false;
+        }
+#ifdef _WIN32
+        const auto identify = [](const fs::path &path, BY_HANDLE_FILE_INFORMATION &identity) {
+            std::wstring extended = toExtendedPath(path);
+            HANDLE handle = CreateFileW(extended.c_str(), FILE_READ_ATTRIBUTES, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, nullptr,
+                                        OPEN_EXISTING, FILE_FLAG_BACKUP_SEMANTICS | FILE_FLAG_OPEN_REPARSE_POINT, nullptr);
+            if (handle == INVALID_HANDLE_VALUE) {
+                return false;
+            }
+            bool ok = GetFileInformationByHandle(handle, &identity) != 0;
+            CloseHandle(handle);
+            return ok;
+        };
+        BY_HANDLE_FILE_INFORMATION linkIdentity {};
+        BY_HANDLE_FILE_INFORMATION sourceIdentity {};
+        return identify(link, linkIdentity) && identify(source, sourceIdentity) &&
+               linkIdentity.dwVolumeSerialNumber == sourceIdentity.dwVolumeSerialNumber &&
+               linkIdentity.nFileIndexHigh == sourceIdentity.nFileIndexHigh && linkIdentity.nFileIndexLow == sourceIdentity.nFileIndexLow;
+#else
+        struct stat linkAttributes {};
+        struct stat sourceAttributes {};
+        return ::lstat(link.c_str(), &linkAttributes) == 0 && ::lstat(source.c_str(), &sourceAttributes) == 0 &&
+               S_ISREG(linkAttributes.st_mode) && linkAttributes.st_dev == sourceAttributes.st_dev &&
+               linkAttributes.st_ino == sourceAttributes.st_ino;
+#endif
+    }
+
+    bool removeEmptyDirectory(const fs::path &directory, std::string &errorMessage) override {
+#ifdef _WIN32
+        std::wstring extended = toExtendedPath(directory);
+        if (!RemoveDirectoryW(extended.c_str())) {
+            errorMessage = windowsErrorMessage(GetLastError());
+            return false;
+        }
+        return true;
+#else
+        if (::rmdir(directory.c_str()) != 0) {
+            errorMessage = std::generic_category().message(errno);
+            return false;
+        }
+        return true;
+#endif
+    }
+
+    std::optional<DirectoryStamp> readDirectoryStamp(const fs::path &directory) override {
+        DirectoryStamp stamp;
+#ifdef _WIN32
+        std::wstring extended = toExtendedPath(directory);
+        HANDLE handle = CreateFileW(extended.c_str(), FILE_READ_ATTRIBUTES, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, nullptr,
+                                    OPEN_EXISTING, FILE_FLAG_BACKUP_SEMANTICS, nullptr);
+        if (handle == INVALID_HANDLE_VALUE) {
+            return std::nullopt;
+        }
+        BY_HANDLE_FILE_INFORMATION identity {};
+        FILE_BASIC_INFO times {};
+        bool ok = GetFileInformationByHandle(handle, &identity) && GetFileInformationByHandleEx(handle, FileBasicInfo, &times, sizeof(times));
+        CloseHandle(handle);
+        if (!ok || (identity.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) == 0) {
+            return std::nullopt;
+        }
+        // FILETIME counts 100 ns ticks from 1601.
+        constexpr std::int64_t kUnixEpochTicks = 116444736000000000LL;
+        stamp.device = identity.dwVolumeSerialNumber;
+        stamp.inode = (static_cast<std::uint64_t>(identity.nFileIndexHigh) << 32) | identity.nFileIndexLow;
+        stamp.modifiedNs = (times.LastWriteTime.QuadPart - kUnixEpochTicks) * 100;
+        stamp.changedNs = (times.ChangeTime.QuadPart - kUnixEpochTicks) * 100;
+#else
+        struct stat attributes {};
+        if (::stat(directory.c_str(), &attributes) != 0 || !S_ISDIR(attributes.st_mode)) {
+            return std::nullopt;
+        }
+        stamp.device = static_cast<std::uint64_t>(attributes.st_dev);
+        stamp.inode = static_cast<std::uint64_t>(attributes.st_ino);
+#ifdef __APPLE__
+        stamp.modifiedNs = static_cast<std::int64_t>(attributes.st_mtimespec.tv_sec) * 1000000000 + attributes.st_mtimespec.tv_nsec;
+        stamp.changedNs = static_cast<std::int64_t>(attributes.st_ctimespec.tv_sec) * 1000000000 + attributes.st_ctimespec.tv_nsec;
+#else
+        stamp.modifiedNs = static_cast<std::int64_t>(attributes.st_mtim.tv_sec) * 1000000000 + attributes.st_mtim.tv_nsec;
+        stamp.changedNs = static_cast<std::int64_t>(attributes.st_ctim.tv_sec) * 1000000000 + attributes.st_ctim.tv_nsec;
+#endif
+#endif
+        return stamp;
+    }
+
+    bool isCaseInsensitive(const fs::path &directory) override {
+#ifdef _WIN32
+        std::wstring extended = toExtendedPath(directory);
+        HANDLE handle = CreateFileW(extended.c_str(), FILE_READ_ATTRIBUTES, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+                                    nullptr, OPEN_EXISTING, FILE_FLAG_BACKUP_SEMANTICS, nullptr);
+        if (handle == INVALID_HANDLE_VALUE) {
+            return true;
+        }
+        FILE_CASE_SENSITIVE_INFO info {};
+        BOOL queried = GetFileInformationByHandleEx(handle, FileCaseSensitiveInfo, &info, sizeof(info));
+        CloseHandle(handle);
+        return !queried || (info.Flags & FILE_CS_FLAG_CASE_SENSITIVE_DIR) == 0;
+#elif defined(__APPLE__)
+        return ::pathconf(directory.c_str(), _PC_CASE_SENSITIVE) == 0;
+#elif defined(__linux__)
+        constexpr unsigned long kMsdosMagic = 0x4d44;
+        constexpr unsigned long kExfatMagic = 0x2011BAB0;
+        constexpr unsigned long kCifsMagic = 0xFF534D42;
+        constexpr unsigned long kSmb2Magic = 0xFE534D42;
+        struct statfs fileSystem {};
+        if (::statfs(directory.c_str(), &fileSystem) == 0) {
+            auto type = static_cast<unsigned long>(fileSystem.f_type);
+            if (type == kMsdosMagic || type == kExfatMagic || type == kCifsMagic || type == kSmb2Magic) {
+                return true;
+            }
+        }
+
+        // ext4 and f2fs can fold case per directory (chattr +F).
+        constexpr int kCasefoldFlag = 0x40000000;
+        int fd = ::open(directory.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (fd < 0) {
+            return false;
+        }
+        int flags = 0;
+        bool casefold = ::ioctl(fd, FS_IOC_GETFLAGS, &flags) == 0 && (flags & kCasefoldFlag) != 0;
+        ::close(fd);
+        return casefold;
+#else
+        (void)directory;
+        return false;
+#endif
+    }
+};
+
+// The lexical form MemoryFileSystem stores paths in: normalised, without a trailing separator, and
+// "." for the empty path.
+fs::path normalisedPath(const fs::path &path) {
+    fs::path normal = path.lexically_normal();
+    if (!normal.has_filename() && normal.has_relative_path()) {
+        normal = normal.parent_path();
+    }
+    return normal.empty() ? fs::path(".") : normal;
+}
+
+} // namespace
+
+FileSystem &nativeFileSystem() {
+    static NativeFileSystem fileSystem;
+    return fileSystem;
+}
+
+struct MemoryFileSystem::Node {
+    FileType type = FileType::Regular;
+    // The name as created, which listings report.
+    PathString name;
+    // Shared between hard links.
+    std::shared_ptr<std::string> contents;
+    std::time_t modifiedTime = 0;
+    std::uint64_t inode = 0;
+    // Value of the change clock when a directory's listing last changed.
+    std::uint64_t changed = 0;
+    // Key of the entry a symbolic link points at.
+    PathString target;
+    std::set<PathString> children;
+};
+
+MemoryFileSystem::MemoryFileSystem(bool caseInsensitive) : caseInsensitive_(caseInsensitive) {}
+
+MemoryFileSystem::~MemoryFileSystem() = default;
+
+PathString MemoryFileSystem::keyOf(const fs::path &path) const {
+    PathString key = normalisedPath(path).native();
+    if (caseInsensitive_) {
+        for (auto &c : key) {
+            if (c >= 'A' && c <= 'Z') {
+                c = static_cast<PathString::value_type>(c - 'A' + 'a');
+            }
+        }
+    }
+    return key;
+}
+
+MemoryFileSystem::Node *MemoryFileSystem::find(const PathString &key) {
+    auto it = nodes_.find(key);
+    return it == nodes_.end() ? nullptr : &it->second;
+}
+
+// Follows symbolic links, giving up on loops the way the kernel does.
+const MemoryFileSystem::Node *MemoryFileSystem::resolve(const PathString &key) const {
+    constexpr int kMaxLinks = 40;
+    PathString current = key;
+    for (int hop = 0; hop <= kMaxLinks; ++hop) {
+        auto it = nodes_.find(current);
+        if (it == nodes_.end()) {
+            return nullptr;
+        }
+        if (it->second.type != FileType::Symlink) {
+            return &it->second;
+        }
+        current = it->second.target;
+    }
+    return nullptr;
+}
+
+MemoryFileSystem::Node *MemoryFileSystem::ensureDirectory(const fs::path &directory, std::string &errorMessage) {
+    const fs::path normal = normalisedPath(directory);
+    const PathString key = keyOf(normal);
+    if (Node *node = find(key)) {
+        if (node->type != FileType::Directory) {
+            errorMessage = errorText(std::errc::not_a_directory);
+            return nullptr;
+        }
+        return node;
+    }
+
+    const fs::path parent = normalisedPath(normal.parent_path());
+    Node directoryNode;
+    directoryNode.type = FileType::Directory;
+    directoryNode.name = normal.filename().native();
+    directoryNode.inode = ++clock_;
+    directoryNode.changed = clock_;
+    if (keyOf(parent) == key) {
+        return &nodes_.emplace(key, std::move(directoryNode)).first->second;
+    }
+    Node *parentNode = ensureDirectory(parent, errorMessage);
+    if (parentNode == nullptr) {
+        return nullptr;
+    }
+    parentNode->children.insert(key);
+    parentNode->changed = ++clock_;
+    return &nodes_.emplace(key, std::move(directoryNode)).first->second;
+}
+
+MemoryFileSystem::Node *MemoryFileSystem::parentOf(const fs::path &path, std::string &errorMessage) {
+    Node *parent = find(keyOf(normalisedPath(normalisedPath(path).parent_path())));
+    if (parent == nullptr) {
+        errorMessage = errorText(std::errc::no_such_file_or_directory);
+        return nullptr;
+    }
+    if (parent->type != FileType::Directory) {
+        errorMessage = errorText(std::errc::not_a_directory);
+        return nullptr;
+    }
+    return parent;
+}
+
+// Adds `node` under `path`, whose parent must exist and whose name must be free.
+void MemoryFileSystem::attach(const fs::path &path, Node node) {
+    const fs::path normal = normalisedPath(path);
+    std::string ignored;
+    Node *parent = parentOf(normal, ignored);
+    const PathString key = keyOf(normal);
+    node.name = normal.filename().native();
+    parent->children.insert(key);
+    parent->changed = ++clock_;
+    nodes_[key] = std::move(node);
+}
+
+void MemoryFileSystem::addFile(const fs::path &file, std::string contents, std::time_t modifiedTime) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    std::string ignored;
+    const PathString key = keyOf(file);
+    if (ensureDirectory(normalisedPath(file).parent_path(), ignored) == nullptr) {
+        return;
+    }
+    if (Node *existing = find(key)) {
+        if (existing->type == FileType::Directory) {
+            return;
+        }
+        existing->type = FileType::Regular;
+        existing->contents = std::make_shared<std::string>(std::move(contents));
+        existing->modifiedTime = modifiedTime;
+        return;
+    }
+    Node node;
+    node.contents = std::make_shared<std::string>(std::move(contents));
+    node.modifiedTime = modifiedTime;
+    node.inode = ++clock_;
+    attach(file, std::move(node));
+}
+
+void MemoryFileSystem::addDirectory(const fs::path &directory) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    std::string ignored;
+    ensureDirectory(directory, ignored);
+}
+
+std::vector<fs::path> MemoryFileSystem::listFiles(const fs::path &directory) const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    std::vector<fs::path> files;
+    std::vector<std::pair<fs::path, PathString>> pending {{normalisedPath(directory), keyOf(directory)}};
+    while (!pending.empty()) {
+        auto [path, key] = std::move(pending.back());
+        pending.pop_back();
+        auto it = nodes_.find(key);
+        if (it == nodes_.end() || it->second.type != FileType::Directory) {
+            continue;
+        }
+        for (const auto &childKey : it->second.children) {
+            const Node &child = nodes_.at(childKey);
+            if (child.type == FileType::Directory) {
+                pending.emplace_back(path / child.name, childKey);
+            } else {
+                files.push_back(path / child.name);
+            }
+        }
+    }
+    std::sort(files.begin(), files.end());
+    return files;
+}
+
+bool MemoryFileSystem::listDirectory(const fs::path &directory, std::vector<DirectoryEntry> &entries, std::string &errorMessage) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    const Node *node = resolve(keyOf(directory));
+    if (node == nullptr) {
+        errorMessage = errorText(std::errc::no_such_file_or_directory);
+        return false;
+    }
+    if (node->type != FileType::Directory) {
+        errorMessage = errorText(std::errc::not_a_directory);
+        return false;
+    }
+    entries.reserve(entries.size() + node->children.size());
+    for (const auto &childKey : node->children) {
+        const Node &child = nodes_.at(childKey);
+        DirectoryEntry entry {child.name, child.type, std::nullopt};
+        if (child.type == FileType::Regular) {
+            entry.metadata = FileMetadata {FileType::Regular, child.contents->size(), child.modifiedTime};
+        }
+        entries.push_back(std::move(entry));
+    }
+    return true;
+}
+
+bool MemoryFileSystem::readMetadata(const fs::path &path, unsigned, FileMetadata &metadata, std::string &) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    const Node *node = resolve(keyOf(path));
+    if (node == nullptr) {
+        metadata = FileMetadata {FileType::NotFound, 0, 0};
+        return true;
+    }
+    metadata.type = node->type;
+    metadata.size = node->type == FileType::Regular ? node->contents->size() : 0;
+    metadata.modifiedTime = node->type == FileType::Directory ? static_cast<std::time_t>(node->changed) : node->modifiedTime;
+    return true;
+}
+
+bool MemoryFileSystem::readPrefix(const fs::path &file, std::string &buffer, std::size_t &bytesRead, std::string &errorMessage) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    const Node *node = resolve(keyOf(file));
+    if (node == nullptr) {
+        errorMessage = errorText(std::errc::no_such_file_or_directory);
+        return false;
+    }
+    if (node->type != FileType::Regular) {
+        errorMessage = errorText(std::errc::is_a_directory);
+        return false;
+    }
+    bytesRead = std::min(buffer.size(), node->contents->size());
+    std::memcpy(buffer.data(), node->contents->data(), bytesRead);
+    return true;
+}
+
+bool MemoryFileSystem::createDirectories(const fs::path &directory, std::string &errorMessage) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return ensureDirectory(directory, errorMessage) != nullptr;
+}
+
+bool MemoryFileSystem::renameNoReplace(const fs::path &source, const fs::path &destination, std::string &errorMessage) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    const PathString sourceKey = keyOf(source);
+    const PathString destinationKey = keyOf(destination);
+    auto sourceIt = nodes_.find(sourceKey);
+    if (sourceIt == nodes_.end()) {
+        errorMessage = errorText(std::errc::no_such_file_or_directory);
+        return false;
+    }
+    if (nodes_.count(destinationKey) != 0) {
+        errorMessage = errorText(std::errc::file_exists);
+        return false;
+    }
+    const PathString sourcePrefix = sourceKey + fs::path::preferred_separator;
+    if (destinationKey.compare(0, sourcePrefix.size(), sourcePrefix) == 0) {
+        errorMessage = errorText(std::errc::invalid_argument);
+        return false;
+    }
+    Node *destinationParent = parentOf(destination, errorMessage);
+    Node *sourceParent = parentOf(source, errorMessage);
+    if (destinationParent == nullptr || sourceParent == nullptr) {
+        return false;
+    }
+
+    // A directory takes its whole subtree along, so every key below it is rewritten.
+    std::vector<std::pair<PathString, Node>> moved;
+    moved.emplace_back(destinationKey, std::move(sourceIt->second));
+    nodes_.erase(sourceIt);
+    if (moved.front().second.type == FileType::Directory) {
+        for (auto it = nodes_.lower_bound(sourcePrefix); it != nodes_.end() && it->first.compare(0, sourcePrefix.size(), sourcePrefix) == 0;) {
+            moved.emplace_back(destinationKey + it->first.substr(sourceKey.size()), std::move(it->second));
+            it = nodes_.erase(it);
+        }
+    }
+    for (auto &[key, node] : moved) {
+        if (node.type == FileType::Directory) {
+            std::set<PathString> children;
+            for (const auto &child : node.children) {
+                children.insert(destinationKey + child.substr(sourceKey.size()));
+            }
+            node.children = std::move(children);
+        }
+        nodes_[key] = std::move(node);
+    }
+
+    nodes_[destinationKey].name = normalisedPath(destination).filename().native();
+    sourceParent->children.erase(sourceKey);
+    sourceParent->changed = ++clock_;
+    destinationParent->children.insert(destinationKey);
+    destinationParent->changed = clock_;
+    return true;
+}
+
+bool MemoryFileSystem::linkNoReplace(const fs::path &source, const fs::path &destination, LinkKind kind, std::string &errorMessage) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (nodes_.count(keyOf(destination)) != 0) {
+        errorMessage = errorText(std::errc::file_exists);
+        return false;
+    }
+    if (parentOf(destination, errorMessage) == nullptr) {
+        return false;
+    }
+
+    Node link;
+    if (kind == LinkKind::Symbolic) {
+        link.type = FileType::Symlink;
+        link.target = keyOf(source);
+        link.inode = ++clock_;
+        attach(destination, std::move(link));
+        return true;
+    }
+
+    const Node *original = kind == LinkKind::Hard ? find(keyOf(source)) : resolve(keyOf(source));
+    if (original == nullptr) {
+        errorMessage = errorText(std::errc::no_such_file_or_directory);
+        return false;
+    }
+    if (original->type == FileType::Directory) {
+        errorMessage = errorText(std::errc::operation_not_permitted);
+        return false;
+    }
+    link = *original;
+    if (kind == LinkKind::Reflink) {
+        link.contents = std::make_shared<std::string>(*original->contents);
+        link.inode = ++clock_;
+    }
+    attach(destination, std::move(link));
+    return true;
+}
+
+bool MemoryFileSystem::removeEmptyDirectory(const fs::path &directory, std::string &errorMessage) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    const PathString key = keyOf(directory);
+    Node *node = find(key);
+    if (node == nullptr) {
+        errorMessage = errorText(std::errc::no_such_file_or_directory);
+        return false;
+    }
+    if (node->type != FileType::Directory) {
+        errorMessage = errorText(std::errc::not_a_directory);
+        return false;
+    }
+    if (!node->children.empty()) {
+        errorMessage = errorText(std::errc::directory_not_empty);
+        return false;
+    }
+    Node *parent = parentOf(directory, errorMessage);
+    if (parent == nullptr || parent == node) {
+        errorMessage = errorText(std::errc::device_or_resource_busy);
+        return false;
+    }
+    parent->children.erase(key);
+    parent->changed = ++clock_;
+    nodes_.erase(key);
+    return true;
+}
+
+bool MemoryFileSystem::isLinkTo(const fs::path &link, const fs::path &source, LinkKind kind) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    const Node *linkNode = find(keyOf(link));
+    if (linkNode == nullptr) {
+        return false;
+    }
+    if (kind == LinkKind::Symbolic) {
+        return linkNode->type == FileType::Symlink && linkNode->target == keyOf(source);
+    }
+    const Node *sourceNode = find(keyOf(source));
+    return kind == LinkKind::Hard && sourceNode != nullptr && linkNode->type == FileType::Regular && linkNode->contents == sourceNode->contents;
+}
+
+std::optional<DirectoryStamp> MemoryFileSystem::readDirectoryStamp(const fs::path &directory) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    const Node *node = resolve(keyOf(directory));
+    if (node == nullptr || node->type != FileType::Directory) {
+        return std::nullopt;
+    }
+    DirectoryStamp stamp;
+    stamp.device = 1;
+    stamp.inode = node->inode;
+    stamp.modifiedNs = static_cast<std::int64_t>(node->changed);
+    stamp.changedNs = stamp.modifiedNs;
+    return stamp;
+}
+
+bool MemoryFileSystem::isCaseInsensitive(const fs::path &) {
+    return caseInsensitive_;
+}
+
+LatencyFileSystem::LatencyFileSystem(FileSystem &inner, FileSystemLatency latency) : inner_(inner), latency_(latency) {}
+
+bool LatencyFileSystem::listDirectory(const fs::path &directory, std::vector<DirectoryEntry> &entries, std::string &errorMessage) {
+    std::this_thread::sleep_for(latency_.listDirectory);
+    return inner_.listDirectory(directory, entries, errorMessage);
+}
+
+bool LatencyFileSystem::readMetadata(const fs::path &path, unsigned fields, FileMetadata &metadata, std::string &errorMessage) {
+    std::this_thread::sleep_for(latency_.readMetadata);
+    return inner_.readMetadata(path, fields, metadata, errorMessage);
+}
+
+bool LatencyFileSystem::readPrefix(const fs::path &file, std::string &buffer, std::size_t &bytesRead, std::string &errorMessage) {
+    std::this_thread::sleep_for(latency_.readPrefix);
+    return inner_.readPrefix(file, buffer, bytesRead, errorMessage);
+}
+
+bool LatencyFileSystem::createDirectories(const fs::path &directory, std::string &errorMessage) {
+    std::this_thread::sleep_for(latency_.createDirectories);
+    return inner_.createDirectories(directory, errorMessage);
+}
+
+bool LatencyFileSystem::renameNoReplace(const fs::path &source, const fs::path &destination, std::string &errorMessage) {
+    std::this_thread::sleep_for(latency_.rename);
+    return inner_.renameNoReplace(source, destination, errorMessage);
+}
+
+bool LatencyFileSystem::linkNoReplace(const fs::path &source, const fs::path &destination, LinkKind kind, std::string &errorMessage) {
+    std::this_thread::sleep_for(latency_.link);
+    return inner_.linkNoReplace(source, destination, kind, errorMessage);
+}
+
+bool LatencyFileSystem::removeEmptyDirectory(const fs::path &directory, std::string &errorMessage) {
+    std::this_thread::sleep_for(latency_.removeDirectory);
+    return inner_.removeEmptyDirectory(directory, errorMessage);
+}
+
+bool LatencyFileSystem::isLinkTo(const fs::path &link, const fs::path &source, LinkKind kind) {
+    std::this_thread::sleep_for(latency_.readMetadata);
+    return inner_.isLinkTo(link, source, kind);
+}
+
+std::optional<DirectoryStamp> LatencyFileSystem::readDirectoryStamp(const fs::path &directory) {
+    std::this_thread::sleep_for(latency_.readMetadata);
+    return inner_.readDirectoryStamp(directory);
+}
+
+bool LatencyFileSystem::isCaseInsensitive(const fs::path &directory) {
+    std::this_thread::sleep_for(latency_.readMetadata);
+    return inner_.isCaseInsensitive(directory);
+}
+
+FaultFileSystem::FaultFileSystem(FileSystem &inner, std::vector<InjectedFault> faults, std::uint64_t seed)
+    : inner_(inner), faults_(std::move(faults)), seed_(seed) {}
+
+std::size_t FaultFileSystem::injectedCount() const {
+    return injected_.load();
+}
+
+// Each fault draws a number from a hash of (seed, operation, path, fault index), which makes the
+// outcome of a call independent of everything else the run does.
+bool FaultFileSystem::inject(FileOperation operation, const fs::path &path, std::string &errorMessage) {
+    const std::uint64_t pathHash = hashNativeText(path.native());
+    for (std::size_t index = 0; index < faults_.size(); ++index) {
+        const InjectedFault &fault = faults_[index];
+        if ((fault.operations & operation) == 0 || fault.probability <= 0) {
+            continue;
+        }
+        // splitmix64 finaliser.
+        std::uint64_t x = seed_ ^ pathHash ^ (static_cast<std::uint64_t>(operation) << 32) ^ (index * 0x9E3779B97F4A7C15ull);
+        x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ull;
+        x = (x ^ (x >> 27)) * 0x94D049BB133111EBull;
+        x ^= x >> 31;
+        double draw = static_cast<double>(x >> 11) * (1.0 / 9007199254740992.0);
+        if (draw < fault.probability) {
+            injected_.fetch_add(1, std::memory_order_relaxed);
+            errorMessage = errorText(fault.error);
+            return true;
+        }
+    }
+    return false;
+}
+
+bool FaultFileSystem::listDirectory(const fs::path &directory, std::vector<DirectoryEntry> &entries, std::string &errorMessage) {
+    return !inject(kOperationListDirectory, directory, errorMessage) && inner_.listDirectory(directory, entries, errorMessage);
+}
+
+bool FaultFileSystem::readMetadata(const fs::path &path, unsigned fields, FileMetadata &metadata, std::string &errorMessage) {
+    return !inject(kOperationReadMetadata, path, errorMessage) && inner_.readMetadata(path, fields, metadata, errorMessage);
+}
+
+bool FaultFileSystem::readPrefix(const fs::path &file, std::string &buffer, std::size_t &bytesRead, std::string &errorMessage) {
+    return !inject(kOperationReadPrefix, file, errorMessage) && inner_.readPrefix(file, buffer, bytesRead, errorMessage);
+}
+
+bool FaultFileSystem::createDirectories(const fs::path &directory, std::string &errorMessage) {
+    return !inject(kOperationCreateDirectories, directory, errorMessage) && inner_.createDirectories(directory, errorMessage);
+}
+
+bool FaultFileSystem::renameNoReplace(const fs::path &source, const fs::path &destination, std::string &errorMessage) {
+    return !inject(kOperationRename, source, errorMessage) && inner_.renameNoReplace(source, destination, errorMessage);
+}
+
+bool FaultFileSystem::linkNoReplace(const fs::path &source, const fs::path &destination, LinkKind kind, std::string &errorMessage) {
+    return !inject(kOperationLink, source, errorMessage) && inner_.linkNoReplace(source, destination, kind, errorMessage);
+}
+
+bool FaultFileSystem::removeEmptyDirectory(const fs::path &directory, std::string &errorMessage) {
+    return !inject(kOperationRemoveDirectory, directory, errorMessage) && inner_.removeEmptyDirectory(directory, errorMessage);
+}
+
+bool FaultFileSystem::isLinkTo(const fs::path &link, const fs::path &source, LinkKind kind) {
+    std::string ignored;
+    return !inject(kOperationReadMetadata, link, ignored) && inner_.isLinkTo(link, source, kind);
+}
+
+std::optional<DirectoryStamp> FaultFileSystem::readDirectoryStamp(const fs::path &directory) {
+    std::string ignored;
+    if (inject(kOperationReadMetadata, directory, ignored)) {
+        return std::nullopt;
+    }
+    return inner_.readDirectoryStamp(directory);
+}
+
+bool FaultFileSystem::isCaseInsensitive(const fs::path &directory) {
+    return inner_.isCaseInsensitive(directory);
+}
+
+} // namespace pushtofolders
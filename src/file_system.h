@@ -0,0 +1,227 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <ctime>
+#include <filesystem>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <vector>
+
+// The file operations PushToFolders performs, behind an interface so that a run can work on an
+// in-memory tree, or on a wrapper that slows down or fails operations on purpose.
+namespace pushtofolders {
+
+namespace fs = std::filesystem;
+
+using PathString = fs::path::string_type;
+using PathStringView = std::basic_string_view<PathString::value_type>;
+
+enum class FileType {
+    NotFound,
+    Regular,
+    Directory,
+    // Only reported by listings; metadata reads follow the link.
+    Symlink,
+    Other,
+};
+
+// Bits naming the FileMetadata fields a caller reads, so a backend only fetches what is used.
+enum MetadataField : unsigned {
+    kMetadataNone = 0,
+    kMetadataModifiedTime = 1u << 0,
+    kMetadataSize = 1u << 1,
+    kMetadataType = 1u << 2,
+};
+
+struct FileMetadata {
+    FileType type = FileType::Regular;
+    std::uintmax_t size = 0;
+    std::time_t modifiedTime = 0;
+};
+
+struct DirectoryEntry {
+    PathString name;
+    FileType type = FileType::Other;
+    // Set when the listing already carries size and time (Windows), sparing a metadata read.
+    std::optional<FileMetadata> metadata;
+};
+
+// Identity and change times of a directory. Creating, removing or renaming an entry updates them.
+struct DirectoryStamp {
+    std::uint64_t device = 0;
+    std::uint64_t inode = 0;
+    std::int64_t modifiedNs = 0;
+    std::int64_t changedNs = 0;
+};
+
+enum class LinkKind {
+    Hard,
+    Symbolic,
+    // A copy-on-write clone.
+    Reflink,
+};
+
+// Failing calls return false and explain why in errorMessage. Implementations must allow calls from
+// several threads at once.
+class FileSystem {
+public:
+    virtual ~FileSystem() = default;
+
+    // Lists every entry except "." and "..", in no particular order.
+    virtual bool listDirectory(const fs::path &directory, std::vector<DirectoryEntry> &entries, std::string &errorMessage) = 0;
+    // Follows symbolic links. A missing path is not an error; it reads as FileType::NotFound.
+    virtual bool readMetadata(const fs::path &path, unsigned fields, FileMetadata &metadata, std::string &errorMessage) = 0;
+    // Reads up to buffer.size() bytes from the start of the file; bytesRead says how many arrived.
+    virtual bool readPrefix(const fs::path &file, std::string &buffer, std::size_t &bytesRead, std::string &errorMessage) = 0;
+    // Creates the directory and any missing parents. Succeeds if it already exists.
+    virtual bool createDirectories(const fs::path &directory, std::string &errorMessage) = 0;
+    // Neither call ever replaces an existing destination.
+    virtual bool renameNoReplace(const fs::path &source, const fs::path &destination, std::string &errorMessage) = 0;
+    virtual bool linkNoReplace(const fs::path &source, const fs::path &destination, LinkKind kind, std::string &errorMessage) = 0;
+    // Whether `link` is already the `kind` link to `source` that linkNoReplace would make: the same
+    // file for hard links, the same target for symbolic links. Always false for reflinks, which
+    // cannot be told apart from copies.
+    virtual bool isLinkTo(const fs::path &link, const fs::path &source, LinkKind kind) = 0;
+    virtual bool removeEmptyDirectory(const fs::path &directory, std::string &errorMessage) = 0;
+    // nullopt when the path cannot be read or is not a directory.
+    virtual std::optional<DirectoryStamp> readDirectoryStamp(const fs::path &directory) = 0;
+    // Whether names that differ only in case name the same entry of `directory`.
+    virtual bool isCaseInsensitive(const fs::path &directory) = 0;
+};
+
+// The operating system's file system.
+FileSystem &nativeFileSystem();
+
+// A file tree held in memory, for tests and benchmarks that must not depend on a disk. Paths are
+// compared after lexical normalisation, and relative paths do not depend on the working directory.
+// Modification times of folders come from a counter that every change advances.
+class MemoryFileSystem final : public FileSystem {
+public:
+    explicit MemoryFileSystem(bool caseInsensitive = false);
+    ~MemoryFileSystem() override;
+
+    // Creates missing parent folders. An existing file is replaced.
+    void addFile(const fs::path &file, std::string contents = {}, std::time_t modifiedTime = 0);
+    void addDirectory(const fs::path &directory);
+    // Every regular file and symbolic link below `directory`, sorted.
+    std::vector<fs::path> listFiles(const fs::path &directory) const;
+
+    bool listDirectory(const fs::path &directory, std::vector<DirectoryEntry> &entries, std::string &errorMessage) override;
+    bool readMetadata(const fs::path &path, unsigned fields, FileMetadata &metadata, std::string &errorMessage) override;
+    bool readPrefix(const fs::path &file, std::string &buffer, std::size_t &bytesRead, std::string &errorMessage) override;
+    bool createDirectories(const fs::path &directory, std::string &errorMessage) override;
+    bool renameNoReplace(const fs::path &source, const fs::path &destination, std::string &errorMessage) override;
+    bool linkNoReplace(const fs::path &source, const fs::path &destination, LinkKind kind, std::string &errorMessage) override;
+    bool isLinkTo(const fs::path &link, const fs::path &source, LinkKind kind) override;
+    bool removeEmptyDirectory(const fs::path &directory, std::string &errorMessage) override;
+    std::optional<DirectoryStamp> readDirectoryStamp(const fs::path &directory) override;
+    bool isCaseInsensitive(const fs::path &directory) override;
+
+private:
+    struct Node;
+
+    PathString keyOf(const fs::path &path) const;
+    Node *find(const PathString &key);
+    const Node *resolve(const PathString &key) const;
+    Node *ensureDirectory(const fs::path &directory, std::string &errorMessage);
+    Node *parentOf(const fs::path &path, std::string &errorMessage);
+    void attach(const fs::path &path, Node node);
+
+    const bool caseInsensitive_;
+    mutable std::mutex mutex_;
+    std::map<PathString, Node> nodes_;
+    std::uint64_t clock_ = 0;
+};
+
+// Per-operation delays, for reproducing slow disks and network shares.
+struct FileSystemLatency {
+    std::chrono::microseconds listDirectory {0};
+    // Also covers readDirectoryStamp, isLinkTo and isCaseInsensitive.
+    std::chrono::microseconds readMetadata {0};
+    std::chrono::microseconds readPrefix {0};
+    std::chrono::microseconds createDirectories {0};
+    std::chrono::microseconds rename {0};
+    std::chrono::microseconds link {0};
+    std::chrono::microseconds removeDirectory {0};
+};
+
+// Sleeps for the configured time before passing each call on to `inner`.
+class LatencyFileSystem final : public FileSystem {
+public:
+    LatencyFileSystem(FileSystem &inner, FileSystemLatency latency);
+
+    bool listDirectory(const fs::path &directory, std::vector<DirectoryEntry> &entries, std::string &errorMessage) override;
+    bool readMetadata(const fs::path &path, unsigned fields, FileMetadata &metadata, std::string &errorMessage) override;
+    bool readPrefix(const fs::path &file, std::string &buffer, std::size_t &bytesRead, std::string &errorMessage) override;
+    bool createDirectories(const fs::path &directory, std::string &errorMessage) override;
+    bool renameNoReplace(const fs::path &source, const fs::path &destination, std::string &errorMessage) override;
+    bool linkNoReplace(const fs::path &source, const fs::path &destination, LinkKind kind, std::string &errorMessage) override;
+    bool isLinkTo(const fs::path &link, const fs::path &source, LinkKind kind) override;
+    bool removeEmptyDirectory(const fs::path &directory, std::string &errorMessage) override;
+    std::optional<DirectoryStamp> readDirectoryStamp(const fs::path &directory) override;
+    bool isCaseInsensitive(const fs::path &directory) override;
+
+private:
+    FileSystem &inner_;
+    FileSystemLatency latency_;
+};
+
+// Operation bits that a fault applies to.
+enum FileOperation : unsigned {
+    kOperationListDirectory = 1u << 0,
+    // Also covers readDirectoryStamp and isLinkTo.
+    kOperationReadMetadata = 1u << 1,
+    kOperationReadPrefix = 1u << 2,
+    kOperationCreateDirectories = 1u << 3,
+    kOperationRename = 1u << 4,
+    kOperationLink = 1u << 5,
+    kOperationRemoveDirectory = 1u << 6,
+    kOperationAll = (1u << 7) - 1,
+};
+
+struct InjectedFault {
+    // For example no_space_on_device, permission_denied, cross_device_link or device_or_resource_busy.
+    std::errc error;
+    double probability = 0;
+    unsigned operations = kOperationAll;
+};
+
+// Fails calls with the configured errors before they reach `inner`. Whether a call fails depends
+// only on the seed, the operation and the path, never on timing or thread order, so a run can be
+// reproduced exactly; the same call on the same path fails the same way every time. The faults are
+// drawn independently and the first one that hits is reported.
+class FaultFileSystem final : public FileSystem {
+public:
+    FaultFileSystem(FileSystem &inner, std::vector<InjectedFault> faults, std::uint64_t seed = 0);
+
+    // How many calls have been failed so far.
+    std::size_t injectedCount() const;
+
+    bool listDirectory(const fs::path &directory, std::vector<DirectoryEntry> &entries, std::string &errorMessage) override;
+    bool readMetadata(const fs::path &path, unsigned fields, FileMetadata &metadata, std::string &errorMessage) override;
+    bool readPrefix(const fs::path &file, std::string &buffer, std::size_t &bytesRead, std::string &errorMessage) override;
+    bool createDirectories(const fs::path &directory, std::string &errorMessage) override;
+    bool renameNoReplace(const fs::path &source, const fs::path &destination, std::string &errorMessage) override;
+    bool linkNoReplace(const fs::path &source, const fs::path &destination, LinkKind kind, std::string &errorMessage) override;
+    bool isLinkTo(const fs::path &link, const fs::path &source, LinkKind kind) override;
+    bool removeEmptyDirectory(const fs::path &directory, std::string &errorMessage) override;
+    std::optional<DirectoryStamp> readDirectoryStamp(const fs::path &directory) override;
+    bool isCaseInsensitive(const fs::path &directory) override;
+
+private:
+    bool inject(FileOperation operation, const fs::path &path, std::string &errorMessage);
+
+    FileSystem &inner_;
+    std::vector<InjectedFault> faults_;
+    std::uint64_t seed_;
+    std::atomic<std::size_t> injected_ {0};
+};
+
+} // namespace pushtofolders
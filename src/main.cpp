@@ -1,12 +1,18 @@
+#include "file_logger.h"
+#include "native_text.h"
+#include "push_engine.h"
+
 #include <chrono>
-#include <cstdlib>
+#include <cstdint>
+#include <cstdio>
+#include <ctime>
 #include <filesystem>
 #include <fstream>
 #include <iostream>
-#include <mutex>
 #include <optional>
 #include <string>
 #include <string_view>
+#include <utility>
 #include <vector>
 
 #ifdef _WIN32
@@ -21,120 +27,18 @@ namespace fs = std::filesystem;
 
 namespace {
 
-using PathString = fs::path::string_type;
+using pushtofolders::displayPath;
+using pushtofolders::FileLogger;
+using pushtofolders::hashNativeText;
+using pushtofolders::PathString;
+using pushtofolders::PathStringView;
 
 #ifdef _WIN32
 #define PATH_LITERAL(str) L##str
-
-std::string wideToUtf8(std::wstring_view wide) {
-    if (wide.empty()) {
-        return {};
-    }
-
-    int required = WideCharToMultiByte(CP_UTF8, 0, wide.data(), static_cast<int>(wide.size()), nullptr, 0, nullptr, nullptr);
-    if (required <= 0) {
-        return {};
-    }
-
-    std::string utf8(static_cast<size_t>(required), '\0');
-    WideCharToMultiByte(CP_UTF8, 0, wide.data(), static_cast<int>(wide.size()), utf8.data(), required, nullptr, nullptr);
-    return utf8;
-}
-
-std::string windowsErrorMessage(DWORD errorCode) {
-    LPWSTR buffer = nullptr;
-    DWORD length = FormatMessageW(
-        FORMAT_MESSAGE_ALLOCATE_BUFFER | FORMAT_MESSAGE_FROM_SYSTEM | FORMAT_MESSAGE_IGNORE_INSERTS,
-        nullptr,
-        errorCode,
-        0,
-        reinterpret_cast<LPWSTR>(&buffer),
-        0,
-        nullptr);
-
-    if (length == 0 || buffer == nullptr) {
-        return "Error code: " + std::to_string(static_cast<unsigned long>(errorCode));
-    }
-
-    std::wstring message(buffer, length);
-    LocalFree(buffer);
-
-    while (!message.empty() && (message.back() == L'\r' || message.back() == L'\n')) {
-        message.pop_back();
-    }
-
-    return wideToUtf8(message);
-}
-
-std::wstring toExtendedPath(const fs::path &path) {
-    std::error_code ec;
-    fs::path absolutePath = fs::absolute(path, ec);
-    const std::wstring native = (ec ? path : absolutePath).native();
-
-    if (native.rfind(L"\\\\?\\", 0) == 0) {
-        return native;
-    }
-
-    if (native.rfind(L"\\\\", 0) == 0) {
-        return L"\\\\?\\UNC\\" + native.substr(2);
-    }
-
-    return L"\\\\?\\" + native;
-}
-
-bool createDirectoriesWin32(const fs::path &dir, std::string &errorMessage) {
-    std::error_code ec;
-    if (fs::exists(dir, ec)) {
-        return true;
-    }
-
-    fs::path absoluteTarget = fs::absolute(dir, ec);
-    if (ec) {
-        absoluteTarget = dir;
-    }
-
-    std::vector<fs::path> pending;
-    fs::path current = absoluteTarget;
-    while (!current.empty()) {
-        if (fs::exists(current, ec)) {
-            break;
-        }
-        pending.push_back(current);
-        current = current.parent_path();
-    }
-
-    for (auto it = pending.rbegin(); it != pending.rend(); ++it) {
-        std::wstring extended = toExtendedPath(*it);
-        if (!CreateDirectoryW(extended.c_str(), nullptr)) {
-            DWORD lastError = GetLastError();
-            if (lastError != ERROR_ALREADY_EXISTS) {
-                errorMessage = "CreateDirectoryW failed: " + windowsErrorMessage(lastError);
-                return false;
-            }
-        }
-    }
-
-    return true;
-}
 #else
 #define PATH_LITERAL(str) str
 #endif
 
-std::string timestampForLog() {
-    using clock = std::chrono::system_clock;
-    auto now = clock::now();
-    auto tt = clock::to_time_t(now);
-    std::tm tm {};
-#ifdef _WIN32
-    localtime_s(&tm, &tt);
-#else
-    localtime_r(&tt, &tm);
-#endif
-    char buffer[32];
-    std::strftime(buffer, sizeof(buffer), "%Y-%m-%d %H:%M:%S", &tm);
-    return std::string(buffer);
-}
-
 fs::path detectLogFilePath() {
 #ifdef _WIN32
     const auto readWideEnvPath = [](const wchar_t *name) -> std::optional<fs::path> {
@@ -153,11 +57,10 @@ fs::path detectLogFilePath() {
         return fs::path(buffer);
     };
 
+    // The folder is created by FileLogger and the state file when they first write, not here, so a
+    // launch that writes nothing does not touch the disk.
     if (auto localAppData = readWideEnvPath(L"LOCALAPPDATA")) {
-        fs::path candidate = *localAppData / "PushToFolders";
-        std::error_code ec;
-        fs::create_directories(candidate, ec);
-        return candidate / "PushToFolders.log";
+        return *localAppData / "PushToFolders" / "PushToFolders.log";
     }
     if (auto userProfile = readWideEnvPath(L"USERPROFILE")) {
         return *userProfile / "PushToFolders.log";
@@ -171,186 +74,63 @@ fs::path detectLogFilePath() {
     return fallback / "PushToFolders.log";
 }
 
-class Logger {
-public:
-    Logger()
-        : logFilePath_(detectLogFilePath()), stream_(logFilePath_, std::ios::app)
-    {
-        if (!stream_) {
-            std::cerr << "Warning: Unable to open log file at " << logFilePath_.u8string() << "\n";
-        } else {
-            stream_ << "--- Run started at " << timestampForLog() << " ---\n";
-        }
-    }
-
-    void logError(const fs::path &target, std::string_view message) {
-        std::lock_guard<std::mutex> lock(mutex_);
-        if (stream_) {
-            stream_ << "[" << timestampForLog() << "] ERROR: " << message;
-            if (!target.empty()) {
-                stream_ << " | Target: " << target.u8string();
-            }
-            stream_ << "\n";
-        }
-    }
-
-    void logExecutionFailure(std::string_view message) {
-        logError({}, message);
-    }
-
-    void logInfo(std::string_view message) {
-        std::lock_guard<std::mutex> lock(mutex_);
-        if (stream_) {
-            stream_ << "[" << timestampForLog() << "] INFO: " << message << "\n";
-        }
-    }
-
-    const fs::path &path() const {
-        return logFilePath_;
-    }
+fs::path stateFilePath(const fs::path &logPath) {
+    return logPath.parent_path() / "PushToFolders.state";
+}
 
-private:
-    fs::path logFilePath_;
-    std::ofstream stream_;
-    std::mutex mutex_;
-};
+// The engine serialises events, so whole lines reach the console even from worker threads.
+void printEvent(const pushtofolders::Event &event) {
+    (event.kind == pushtofolders::EventKind::Error ? std::cerr : std::cout) << event.message << "\n";
+}
 
 void printUsage(const fs::path &logPath) {
     std::cout << "PushToFolders - Organise files into same-named folders\n\n"
               << "Usage:\n"
               << "  PushToFolders \"C:/path/to/folder\"  (command line folder mode)\n"
               << "  PushToFolders <file1> <file2> ...      (Explorer selection mode)\n"
+              << "  PushToFolders <folder> <file> ...      (any mix of folders and files)\n"
+              << "  PushToFolders --flatten \"C:/folder\"    (move files back out of their folders; one level deep,\n"
+              << "                                         so multi-level templates such as {ext}/{stem} are not undone)\n"
               << "  PushToFolders --show-log               (display error log)\n"
               << "  PushToFolders --clear-log              (clear error log)\n\n"
-              << "Log file: " << logPath.u8string() << "\n";
+              << "Options:\n"
+              << "  --group stem|content|sequence|prefix   (folder naming rule, default: stem)\n"
+              << "  --prefix-delimiters CHARS              (separators used by --group prefix, default: \"_-. \")\n"
+              << "  --sidecars EXT,EXT,...                 (move sidecars such as xmp,srt,aae with their master file)\n"
+              << "  --strip-copies                         (group \"Report (1)\" and \"Report - Copy\" with \"Report\")\n"
+              << "  --copy-markers WORD,WORD,...           (copy words recognised by --strip-copies)\n"
+              << "  --compound-ext EXT,EXT,...             (extra multi-part extensions such as tar.zst)\n"
+              << "  --folder-template TEMPLATE             (e.g. \"{ext}/{stem}\" or \"{mtime:%Y}/{stem}\")\n"
+              << "  --fold-names auto|on|off               (match names ignoring case and Unicode form)\n"
+              << "  --include PATTERN / --exclude PATTERN  (only move matching names, e.g. \"*.mp4\"; repeatable)\n"
+              << "  --min-size SIZE                        (only move files of at least SIZE, e.g. 10M)\n"
+              << "  --newer-than DATE|AGE                  (only move files changed after 2024-05-31 or within 7d)\n"
+              << "  --incremental                          (skip folders that have not changed since the last run)\n"
+              << "  --time-budget DURATION                 (stop starting new folders after e.g. 10m; the next run resumes)\n"
+              << "  --max-files N                          (move at most about N files per run; the next run resumes)\n"
+              << "  --exec-batch \"CMD {}+\"                 (run CMD once per batch of new folders; {file}+ passes files)\n"
+              << "  --link hard|sym|reflink                (link files into the folders instead of moving them)\n"
+              << "  --shard I/N                            (handle only the I-th of N slices of the folders, e.g. 2/4)\n"
+              << "  --capture-shape FILE                   (save the anonymised layout of the given folders to FILE; moves nothing)\n"
+              << "  --self-benchmark DIR                   (time folder and move operations inside DIR and suggest --jobs)\n"
+              << "  --jobs N                               (number of worker threads)\n\n"
+              << "Log file: " << displayPath(logPath) << "\n";
 }
 
-bool ensureDirectory(const fs::path &dir, Logger &logger) {
-    std::error_code ec;
-    if (fs::exists(dir, ec)) {
-        if (!fs::is_directory(dir, ec)) {
-            logger.logError(dir, "A non-directory with the desired folder name already exists.");
-            std::cerr << "Cannot create folder '" << dir.u8string() << "' because a file exists with that name.\n";
-            return false;
-        }
-        return true;
-    }
-
-#ifdef _WIN32
-    std::string windowsError;
-    if (!createDirectoriesWin32(dir, windowsError)) {
-        std::string message = windowsError.empty() ? "Failed to create folder." : windowsError;
-        logger.logError(dir, message);
-        std::cerr << "Failed to create folder '" << dir.u8string() << "': " << message << "\n";
-        return false;
+// A fixed-width table that can be pasted into a support ticket as it is.
+void printSelfBenchmarkReport(const fs::path &directory, const pushtofolders::SelfBenchmarkReport &report) {
+    if (report.timings.empty()) {
+        return;
     }
-    return true;
-#else
-    fs::create_directories(dir, ec);
-    if (ec) {
-        logger.logError(dir, std::string("Failed to create folder: ") + ec.message());
-        std::cerr << "Failed to create folder '" << dir.u8string() << "': " << ec.message() << "\n";
-        return false;
+    std::cout << "Self-benchmark of " << displayPath(directory) << " (" << report.operationsPerStep << " operations per step)\n"
+              << "threads  step        ops/s   p50 us   p90 us   p99 us   max us  failed\n";
+    char line[128];
+    for (const auto &timing : report.timings) {
+        std::snprintf(line, sizeof(line), "%7u  %-6s %10.0f %8.1f %8.1f %8.1f %8.1f %7zu\n", timing.threads, timing.operation.c_str(),
+                      timing.operationsPerSecond, timing.p50, timing.p90, timing.p99, timing.max, timing.failures);
+        std::cout << line;
     }
-    return true;
-#endif
-}
-
-bool moveFileToFolder(const fs::path &filePath, Logger &logger) {
-    std::error_code ec;
-    if (!fs::exists(filePath, ec)) {
-        logger.logError(filePath, "File does not exist.");
-        std::cerr << "File not found: " << filePath.u8string() << "\n";
-        return false;
-    }
-
-    if (!fs::is_regular_file(filePath, ec)) {
-        logger.logError(filePath, "Path is not a regular file.");
-        std::cerr << "Not a file: " << filePath.u8string() << "\n";
-        return false;
-    }
-
-    fs::path destinationFolder = filePath.parent_path() / filePath.stem();
-    if (!ensureDirectory(destinationFolder, logger)) {
-        return false;
-    }
-
-    fs::path destinationFile = destinationFolder / filePath.filename();
-    if (fs::exists(destinationFile, ec)) {
-        logger.logError(destinationFile, "Destination file already exists.");
-        std::cerr << "Destination already exists: " << destinationFile.u8string() << "\n";
-        return false;
-    }
-
-#ifdef _WIN32
-    std::wstring sourceExtended = toExtendedPath(filePath);
-    std::wstring destinationExtended = toExtendedPath(destinationFile);
-    if (!MoveFileExW(sourceExtended.c_str(), destinationExtended.c_str(), 0)) {
-        DWORD error = GetLastError();
-        std::string message = "Failed to move file: " + windowsErrorMessage(error);
-        logger.logError(destinationFile, message);
-        std::cerr << "Failed to move '" << filePath.u8string() << "': " << message << "\n";
-        return false;
-    }
-#else
-    fs::rename(filePath, destinationFile, ec);
-    if (ec) {
-        logger.logError(destinationFile, std::string("Failed to move file: ") + ec.message());
-        std::cerr << "Failed to move '" << filePath.u8string() << "': " << ec.message() << "\n";
-        return false;
-    }
-#endif
-
-    logger.logInfo(std::string("Moved ") + filePath.u8string() + " to " + destinationFolder.u8string());
-    std::cout << "Moved '" << filePath.filename().u8string() << "' into '" << destinationFolder.filename().u8string() << "'\n";
-    return true;
-}
-
-bool processDirectory(const fs::path &directoryPath, Logger &logger) {
-    std::error_code ec;
-    if (!fs::exists(directoryPath, ec) || !fs::is_directory(directoryPath, ec)) {
-        logger.logError(directoryPath, "The supplied path is not a directory.");
-        std::cerr << "The path is not a folder: " << directoryPath.u8string() << "\n";
-        return false;
-    }
-
-    bool anyProcessed = false;
-    for (const auto &entry : fs::directory_iterator(directoryPath, ec)) {
-        if (ec) {
-            logger.logError(directoryPath, std::string("Failed to scan directory: ") + ec.message());
-            std::cerr << "Failed to scan directory '" << directoryPath.u8string() << "': " << ec.message() << "\n";
-            return false;
-        }
-
-        if (!entry.is_regular_file()) {
-            continue;
-        }
-
-        if (moveFileToFolder(entry.path(), logger)) {
-            anyProcessed = true;
-        }
-    }
-
-    if (!anyProcessed) {
-        std::cout << "No files found to process in " << directoryPath.u8string() << "\n";
-    }
-
-    return anyProcessed;
-}
-
-bool processFiles(const std::vector<fs::path> &files, Logger &logger) {
-    bool anyProcessed = false;
-    for (const auto &file : files) {
-        if (moveFileToFolder(file, logger)) {
-            anyProcessed = true;
-        }
-    }
-
-    if (!anyProcessed) {
-        std::cout << "No files were processed.\n";
-    }
-
-    return anyProcessed;
+    std::cout << "Recommended: --jobs " << report.recommendedJobs << "\n";
 }
 
 std::optional<std::string> readFileContents(const fs::path &path) {
@@ -400,50 +180,577 @@ std::vector<PathString> normaliseArguments(std::vector<PathString> args) {
 }
 #endif
 
-int runApplication(std::vector<PathString> args) {
-    args = normaliseArguments(std::move(args));
+#ifdef _WIN32
+std::string argumentToUtf8(const PathString &arg) {
+    return fs::path(arg).u8string();
+}
+#else
+std::string argumentToUtf8(const PathString &arg) {
+    return arg;
+}
+#endif
 
-    Logger logger;
-    if (args.empty()) {
-        logger.logExecutionFailure("Execution failed: No input was provided.");
-        printUsage(logger.path());
-        return 1;
+struct CommandLine {
+    bool showLogRequested = false;
+    bool clearLogRequested = false;
+    std::optional<PathString> flattenDirectory;
+    std::optional<PathString> captureShapeFile;
+    std::optional<PathString> selfBenchmarkDirectory;
+    pushtofolders::Options options;
+    std::vector<PathString> positional;
+};
+
+std::optional<pushtofolders::GroupingMode> parseGroupingMode(std::string_view value) {
+    if (value == "stem") {
+        return pushtofolders::GroupingMode::Stem;
+    }
+    if (value == "content") {
+        return pushtofolders::GroupingMode::Content;
+    }
+    if (value == "sequence") {
+        return pushtofolders::GroupingMode::Sequence;
+    }
+    if (value == "prefix") {
+        return pushtofolders::GroupingMode::Prefix;
     }
+    return std::nullopt;
+}
+
+std::optional<pushtofolders::PlacementMode> parseLinkMode(std::string_view value) {
+    if (value == "hard") {
+        return pushtofolders::PlacementMode::HardLink;
+    }
+    if (value == "sym") {
+        return pushtofolders::PlacementMode::SymbolicLink;
+    }
+    if (value == "reflink") {
+        return pushtofolders::PlacementMode::Reflink;
+    }
+    return std::nullopt;
+}
 
+std::optional<pushtofolders::NameFolding> parseNameFolding(std::string_view value) {
+    if (value == "auto") {
+        return pushtofolders::NameFolding::Auto;
+    }
+    if (value == "on") {
+        return pushtofolders::NameFolding::On;
+    }
+    if (value == "off") {
+        return pushtofolders::NameFolding::Off;
+    }
+    return std::nullopt;
+}
+
+// Accepts a byte count with an optional binary suffix: "500", "64k", "10M", "2G".
+std::optional<std::uintmax_t> parseSize(std::string_view value) {
+    std::uintmax_t multiplier = 1;
+    if (!value.empty()) {
+        switch (value.back()) {
+        case 'k':
+        case 'K':
+            multiplier = std::uintmax_t {1} << 10;
+            break;
+        case 'm':
+        case 'M':
+            multiplier = std::uintmax_t {1} << 20;
+            break;
+        case 'g':
+        case 'G':
+            multiplier = std::uintmax_t {1} << 30;
+            break;
+        case 't':
+        case 'T':
+            multiplier = std::uintmax_t {1} << 40;
+            break;
+        default:
+            break;
+        }
+        if (multiplier != 1) {
+            value.remove_suffix(1);
+        }
+    }
+    if (value.empty() || value.size() > 15) {
+        return std::nullopt;
+    }
+    std::uintmax_t size = 0;
+    for (char c : value) {
+        if (c < '0' || c > '9') {
+            return std::nullopt;
+        }
+        size = size * 10 + static_cast<std::uintmax_t>(c - '0');
+    }
+    return size * multiplier;
+}
+
+// Accepts an amount of seconds, minutes, hours, days or weeks ("90s", "30m", "12h", "7d", "2w").
+std::optional<std::time_t> parseDuration(std::string_view value) {
+    if (value.size() < 2) {
+        return std::nullopt;
+    }
+    std::time_t unit = 0;
+    switch (value.back()) {
+    case 's':
+        unit = 1;
+        break;
+    case 'm':
+        unit = 60;
+        break;
+    case 'h':
+        unit = 60 * 60;
+        break;
+    case 'd':
+        unit = 24 * 60 * 60;
+        break;
+    case 'w':
+        unit = 7 * 24 * 60 * 60;
+        break;
+    default:
+        return std::nullopt;
+    }
+    auto amount = parseSize(value.substr(0, value.size() - 1));
+    if (!amount || *amount > 100000000) {
+        return std::nullopt;
+    }
+    return static_cast<std::time_t>(*amount) * unit;
+}
+
+// Accepts a date ("2024-05-31", local midnight) or an age relative to now ("90s", "30m", "12h", "7d", "2w").
+std::optional<std::time_t> parseTimeThreshold(std::string_view value) {
+    int year = 0;
+    int month = 0;
+    int day = 0;
+    char trailing = 0;
+    if (value.size() == 10 && std::sscanf(std::string(value).c_str(), "%4d-%2d-%2d%c", &year, &month, &day, &trailing) == 3) {
+        std::tm tm {};
+        tm.tm_year = year - 1900;
+        tm.tm_mon = month - 1;
+        tm.tm_mday = day;
+        tm.tm_isdst = -1;
+        std::time_t threshold = std::mktime(&tm);
+        if (month < 1 || month > 12 || day < 1 || day > 31 || threshold == static_cast<std::time_t>(-1)) {
+            return std::nullopt;
+        }
+        return threshold;
+    }
+
+    auto age = parseDuration(value);
+    if (!age) {
+        return std::nullopt;
+    }
+    return std::time(nullptr) - *age;
+}
+
+// Splits an --exec-batch command into words at unquoted white space. Single or double quotes group
+// words containing spaces.
+std::optional<std::vector<PathString>> splitCommandWords(PathStringView text, std::string &errorMessage) {
+    std::vector<PathString> words;
+    PathString word;
+    bool inWord = false;
+    PathString::value_type quote = 0;
+    for (auto c : text) {
+        if (quote != 0) {
+            if (c == quote) {
+                quote = 0;
+            } else {
+                word.push_back(c);
+            }
+        } else if (c == '"' || c == '\'') {
+            quote = c;
+            inWord = true;
+        } else if (c == ' ' || c == '\t') {
+            if (inWord) {
+                words.push_back(std::move(word));
+                word.clear();
+                inWord = false;
+            }
+        } else {
+            word.push_back(c);
+            inWord = true;
+        }
+    }
+    if (quote != 0) {
+        errorMessage = "--exec-batch has an unterminated quote.";
+        return std::nullopt;
+    }
+    if (inWord) {
+        words.push_back(std::move(word));
+    }
+    return words;
+}
+
+std::optional<unsigned> parseJobCount(std::string_view value) {
+    if (value.empty() || value.size() > 4) {
+        return std::nullopt;
+    }
+    unsigned count = 0;
+    for (char c : value) {
+        if (c < '0' || c > '9') {
+            return std::nullopt;
+        }
+        count = count * 10 + static_cast<unsigned>(c - '0');
+    }
+    if (count == 0) {
+        return std::nullopt;
+    }
+    return count;
+}
+
+// "i/N" with 1 <= i <= N, as {i - 1, N}.
+std::optional<std::pair<unsigned, unsigned>> parseShard(std::string_view value) {
+    std::size_t slash = value.find('/');
+    if (slash == std::string_view::npos) {
+        return std::nullopt;
+    }
+    auto index = parseJobCount(value.substr(0, slash));
+    auto count = parseJobCount(value.substr(slash + 1));
+    if (!index || !count || *index > *count) {
+        return std::nullopt;
+    }
+    return std::make_pair(*index - 1, *count);
+}
+
+// Splits a comma-separated list into items, ignoring surrounding spaces and empty items.
+std::vector<PathString> parseWordList(PathStringView value) {
+    std::vector<PathString> words;
+    std::size_t start = 0;
+    while (start <= value.size()) {
+        std::size_t end = value.find(',', start);
+        if (end == PathStringView::npos) {
+            end = value.size();
+        }
+
+        PathStringView item = value.substr(start, end - start);
+        while (!item.empty() && item.front() == ' ') {
+            item.remove_prefix(1);
+        }
+        while (!item.empty() && item.back() == ' ') {
+            item.remove_suffix(1);
+        }
+        if (!item.empty()) {
+            words.emplace_back(item);
+        }
+        start = end + 1;
+    }
+    return words;
+}
+
+bool parseArguments(std::vector<PathString> args, CommandLine &commandLine, std::string &errorMessage) {
     const PathString showLogLong = PATH_LITERAL("--show-log");
     const PathString showLogShort = PATH_LITERAL("/showlog");
     const PathString clearLogLong = PATH_LITERAL("--clear-log");
     const PathString clearLogShort = PATH_LITERAL("/clearlog");
-
-    bool showLogRequested = false;
-    bool clearLogRequested = false;
-    std::vector<PathString> positional;
-    positional.reserve(args.size());
-
-    for (auto &arg : args) {
+    const PathString groupOption = PATH_LITERAL("--group");
+    const PathString jobsOption = PATH_LITERAL("--jobs");
+    const PathString prefixDelimitersOption = PATH_LITERAL("--prefix-delimiters");
+    const PathString sidecarsOption = PATH_LITERAL("--sidecars");
+    const PathString stripCopiesOption = PATH_LITERAL("--strip-copies");
+    const PathString copyMarkersOption = PATH_LITERAL("--copy-markers");
+    const PathString compoundExtOption = PATH_LITERAL("--compound-ext");
+    const PathString folderTemplateOption = PATH_LITERAL("--folder-template");
+    const PathString foldNamesOption = PATH_LITERAL("--fold-names");
+    const PathString linkOption = PATH_LITERAL("--link");
+    const PathString flattenOption = PATH_LITERAL("--flatten");
+    const PathString captureShapeOption = PATH_LITERAL("--capture-shape");
+    const PathString selfBenchmarkOption = PATH_LITERAL("--self-benchmark");
+    const PathString shardOption = PATH_LITERAL("--shard");
+    const PathString includeOption = PATH_LITERAL("--include");
+    const PathString excludeOption = PATH_LITERAL("--exclude");
+    const PathString minSizeOption = PATH_LITERAL("--min-size");
+    const PathString newerThanOption = PATH_LITERAL("--newer-than");
+    const PathString incrementalOption = PATH_LITERAL("--incremental");
+    const PathString timeBudgetOption = PATH_LITERAL("--time-budget");
+    const PathString maxFilesOption = PATH_LITERAL("--max-files");
+    const PathString execBatchOption = PATH_LITERAL("--exec-batch");
+
+    commandLine.positional.reserve(args.size());
+
+    for (std::size_t i = 0; i < args.size(); ++i) {
+        PathString &arg = args[i];
         if (arg == showLogLong || arg == showLogShort) {
-            showLogRequested = true;
+            commandLine.showLogRequested = true;
             continue;
         }
         if (arg == clearLogLong || arg == clearLogShort) {
-            clearLogRequested = true;
+            commandLine.clearLogRequested = true;
+            continue;
+        }
+
+        if (arg == prefixDelimitersOption) {
+            if (i + 1 >= args.size() || args[i + 1].empty()) {
+                errorMessage = "--prefix-delimiters requires at least one character.";
+                return false;
+            }
+            commandLine.options.prefixDelimiters = std::move(args[++i]);
+            continue;
+        }
+
+        if (arg == incrementalOption) {
+            commandLine.options.incremental = true;
+            continue;
+        }
+
+        if (arg == stripCopiesOption) {
+            commandLine.options.stripCopySuffixes = true;
+            continue;
+        }
+
+        if (arg == copyMarkersOption) {
+            if (i + 1 >= args.size()) {
+                errorMessage = "--copy-markers requires a comma-separated list of words.";
+                return false;
+            }
+            commandLine.options.copyMarkers = parseWordList(args[++i]);
+            if (commandLine.options.copyMarkers.empty()) {
+                errorMessage = "--copy-markers requires a comma-separated list of words.";
+                return false;
+            }
+            commandLine.options.stripCopySuffixes = true;
+            continue;
+        }
+
+        if (arg == flattenOption) {
+            if (i + 1 >= args.size()) {
+                errorMessage = "--flatten requires a folder.";
+                return false;
+            }
+            commandLine.flattenDirectory = std::move(args[++i]);
+            continue;
+        }
+
+        if (arg == captureShapeOption) {
+            if (i + 1 >= args.size()) {
+                errorMessage = "--capture-shape requires a file name.";
+                return false;
+            }
+            commandLine.captureShapeFile = std::move(args[++i]);
+            continue;
+        }
+
+        if (arg == shardOption) {
+            if (i + 1 >= args.size()) {
+                errorMessage = "--shard requires a value such as 1/4.";
+                return false;
+            }
+            std::string value = argumentToUtf8(args[++i]);
+            auto shard = parseShard(value);
+            if (!shard) {
+                errorMessage = "Invalid shard: " + value + " (expected i/N with i from 1 to N)";
+                return false;
+            }
+            commandLine.options.shardIndex = shard->first;
+            commandLine.options.shardCount = shard->second;
+            continue;
+        }
+
+        if (arg == selfBenchmarkOption) {
+            if (i + 1 >= args.size()) {
+                errorMessage = "--self-benchmark requires a folder.";
+                return false;
+            }
+            commandLine.selfBenchmarkDirectory = std::move(args[++i]);
+            continue;
+        }
+
+        if (arg == includeOption || arg == excludeOption) {
+            if (i + 1 >= args.size() || args[i + 1].empty()) {
+                errorMessage = argumentToUtf8(arg) + " requires a file name pattern.";
+                return false;
+            }
+            auto &patterns = arg == includeOption ? commandLine.options.include : commandLine.options.exclude;
+            patterns.push_back(std::move(args[++i]));
+            continue;
+        }
+
+        if (arg == execBatchOption) {
+            if (i + 1 >= args.size()) {
+                errorMessage = "--exec-batch requires a command.";
+                return false;
+            }
+            auto words = splitCommandWords(args[++i], errorMessage);
+            if (!words) {
+                return false;
+            }
+            commandLine.options.execBatch = std::move(*words);
+            continue;
+        }
+
+        if (arg == timeBudgetOption || arg == maxFilesOption) {
+            if (i + 1 >= args.size()) {
+                errorMessage = argumentToUtf8(arg) + " requires a value.";
+                return false;
+            }
+            std::string value = argumentToUtf8(args[++i]);
+            if (arg == timeBudgetOption) {
+                auto budget = parseDuration(value);
+                if (!budget || *budget == 0) {
+                    errorMessage = "Invalid time budget: " + value;
+                    return false;
+                }
+                commandLine.options.deadline = std::chrono::steady_clock::now() + std::chrono::seconds(*budget);
+            } else {
+                auto count = parseSize(value);
+                if (!count || *count == 0) {
+                    errorMessage = "Invalid file count: " + value;
+                    return false;
+                }
+                commandLine.options.maxFiles = static_cast<std::size_t>(*count);
+            }
+            continue;
+        }
+
+        if (arg == minSizeOption || arg == newerThanOption) {
+            if (i + 1 >= args.size()) {
+                errorMessage = argumentToUtf8(arg) + " requires a value.";
+                return false;
+            }
+            std::string value = argumentToUtf8(args[++i]);
+            if (arg == minSizeOption) {
+                commandLine.options.minSize = parseSize(value);
+                if (!commandLine.options.minSize) {
+                    errorMessage = "Invalid size: " + value;
+                    return false;
+                }
+            } else {
+                // The engine only sees the resolved time, which moves with every run for an age.
+                commandLine.options.settingsDigest = hashNativeText(args[i]);
+                commandLine.options.newerThan = parseTimeThreshold(value);
+                if (!commandLine.options.newerThan) {
+                    errorMessage = "Invalid date or age: " + value;
+                    return false;
+                }
+            }
+            continue;
+        }
+
+        if (arg == folderTemplateOption) {
+            if (i + 1 >= args.size()) {
+                errorMessage = "--folder-template requires a template.";
+                return false;
+            }
+            commandLine.options.folderTemplate = std::move(args[++i]);
+            continue;
+        }
+
+        if (arg == compoundExtOption) {
+            if (i + 1 >= args.size()) {
+                errorMessage = "--compound-ext requires a comma-separated list of extensions.";
+                return false;
+            }
+            commandLine.options.compoundExtensions = parseWordList(args[++i]);
             continue;
         }
-        positional.emplace_back(std::move(arg));
+
+        if (arg == sidecarsOption) {
+            if (i + 1 >= args.size()) {
+                errorMessage = "--sidecars requires a comma-separated list of extensions.";
+                return false;
+            }
+            commandLine.options.sidecarExtensions = parseWordList(args[++i]);
+            if (commandLine.options.sidecarExtensions.empty()) {
+                errorMessage = "--sidecars requires a comma-separated list of extensions.";
+                return false;
+            }
+            continue;
+        }
+
+        if (arg == groupOption || arg == jobsOption || arg == foldNamesOption || arg == linkOption) {
+            if (i + 1 >= args.size()) {
+                errorMessage = argumentToUtf8(arg) + " requires a value.";
+                return false;
+            }
+            std::string value = argumentToUtf8(args[++i]);
+
+            if (arg == groupOption) {
+                auto mode = parseGroupingMode(value);
+                if (!mode) {
+                    errorMessage = "Unknown grouping mode: " + value;
+                    return false;
+                }
+                commandLine.options.grouping = *mode;
+            } else if (arg == linkOption) {
+                auto placement = parseLinkMode(value);
+                if (!placement) {
+                    errorMessage = "Unknown link type: " + value;
+                    return false;
+                }
+                commandLine.options.placement = *placement;
+            } else if (arg == foldNamesOption) {
+                auto folding = parseNameFolding(value);
+                if (!folding) {
+                    errorMessage = "Unknown --fold-names value: " + value;
+                    return false;
+                }
+                commandLine.options.nameFolding = *folding;
+            } else {
+                auto jobs = parseJobCount(value);
+                if (!jobs) {
+                    errorMessage = "Invalid job count: " + value;
+                    return false;
+                }
+                commandLine.options.jobs = *jobs;
+            }
+            continue;
+        }
+
+        commandLine.positional.emplace_back(std::move(arg));
+    }
+
+    if (commandLine.captureShapeFile && commandLine.positional.empty()) {
+        errorMessage = "--capture-shape requires a folder.";
+        return false;
     }
+    return true;
+}
+
+int runApplication(std::vector<PathString> args) {
+    args = normaliseArguments(std::move(args));
+
+    FileLogger logger(detectLogFilePath());
+    if (args.empty()) {
+        logger.logExecutionFailure("Execution failed: No input was provided.");
+        printUsage(logger.path());
+        return 1;
+    }
+
+    CommandLine commandLine;
+    std::string parseError;
+    if (!parseArguments(std::move(args), commandLine, parseError)) {
+        logger.logExecutionFailure("Execution failed: " + parseError);
+        std::cerr << parseError << "\n";
+        printUsage(logger.path());
+        return 1;
+    }
+
+    commandLine.options.stateFile = stateFilePath(logger.path());
+    auto engine = pushtofolders::PushEngine::create(commandLine.options, &logger, printEvent, parseError);
+    if (!engine) {
+        logger.logExecutionFailure("Execution failed: " + parseError);
+        std::cerr << parseError << "\n";
+        printUsage(logger.path());
+        return 1;
+    }
+
+    const bool showLogRequested = commandLine.showLogRequested;
+    const bool clearLogRequested = commandLine.clearLogRequested;
+    std::vector<PathString> &positional = commandLine.positional;
 
     bool anyActionPerformed = false;
     int cumulativeStatus = 0;
 
     if (showLogRequested) {
         anyActionPerformed = true;
-        auto contents = readFileContents(logger.path());
-        if (!contents) {
+        std::error_code ec;
+        // The log is only created when there is something to write, so a missing one is an empty log.
+        auto contents = fs::exists(logger.path(), ec) || ec ? readFileContents(logger.path()) : std::optional<std::string>(std::string());
+        if (contents && contents->empty()) {
+            std::cout << "No log entries yet. The log will be written to " << displayPath(logger.path()) << "\n";
+        } else if (!contents) {
             logger.logExecutionFailure("Execution failed: Unable to read the log file.");
-            std::cerr << "No log file found at " << logger.path().u8string() << "\n";
+            std::cerr << "No log file found at " << displayPath(logger.path()) << "\n";
             cumulativeStatus = 1;
         } else {
-            std::cout << "Log file: " << logger.path().u8string() << "\n" << *contents;
+            std::cout << "Log file: " << displayPath(logger.path()) << "\n" << *contents;
             if (!contents->empty() && contents->back() != '\n') {
                 std::cout << '\n';
             }
@@ -453,14 +760,45 @@ int runApplication(std::vector<PathString> args) {
     if (clearLogRequested) {
         anyActionPerformed = true;
         if (clearLogFile(logger.path())) {
-            std::cout << "Log file cleared: " << logger.path().u8string() << "\n";
+            std::cout << "Log file cleared: " << displayPath(logger.path()) << "\n";
         } else {
             logger.logExecutionFailure("Execution failed: Unable to clear the log file.");
-            std::cerr << "Unable to clear log file at " << logger.path().u8string() << "\n";
+            std::cerr << "Unable to clear log file at " << displayPath(logger.path()) << "\n";
+            cumulativeStatus = 1;
+        }
+    }
+
+    if (commandLine.flattenDirectory) {
+        anyActionPerformed = true;
+        bool success = engine->flatten(fs::path(*commandLine.flattenDirectory));
+        std::cout << "Finished flattening folder. Check the log for any errors: " << displayPath(logger.path()) << "\n";
+        if (!success) {
+            logger.logExecutionFailure("Execution failed while flattening a folder. See previous log entries for details.");
+            cumulativeStatus = 1;
+        }
+    }
+
+    if (commandLine.selfBenchmarkDirectory) {
+        anyActionPerformed = true;
+        fs::path directory(*commandLine.selfBenchmarkDirectory);
+        pushtofolders::SelfBenchmarkReport report;
+        bool success = engine->selfBenchmark(directory, report);
+        printSelfBenchmarkReport(directory, report);
+        if (!success) {
+            logger.logExecutionFailure("Execution failed during the self-benchmark. See previous log entries for details.");
             cumulativeStatus = 1;
         }
     }
 
+    if (commandLine.captureShapeFile) {
+        std::vector<fs::path> folders(positional.begin(), positional.end());
+        bool success = engine->captureShape(folders, fs::path(*commandLine.captureShapeFile));
+        if (!success) {
+            logger.logExecutionFailure("Execution failed while capturing a folder shape. See previous log entries for details.");
+        }
+        return (cumulativeStatus == 0 && success) ? 0 : 1;
+    }
+
     if (positional.empty()) {
         if (anyActionPerformed) {
             return cumulativeStatus == 0 ? 0 : 1;
@@ -470,33 +808,19 @@ int runApplication(std::vector<PathString> args) {
         return 1;
     }
 
-    if (positional.size() == 1) {
-        fs::path potentialDirectory(positional[0]);
-        std::error_code ec;
-        if (fs::exists(potentialDirectory, ec) && fs::is_directory(potentialDirectory, ec)) {
-            bool success = processDirectory(potentialDirectory, logger);
-            std::cout << "Finished processing folder." << std::endl;
-            std::cout << "Check the log for any errors: " << logger.path().u8string() << "\n";
-            if (!success) {
-                logger.logExecutionFailure("Execution failed while processing a folder. See previous log entries for details.");
-            }
-            cumulativeStatus = (cumulativeStatus == 0 && success) ? 0 : 1;
-            return cumulativeStatus == 0 ? 0 : 1;
-        }
-        // Not a directory: treat as single file
-    }
+    std::vector<fs::path> inputs(positional.begin(), positional.end());
+    pushtofolders::RunSummary summary = engine->process(inputs);
+    bool success = summary.success;
 
-    std::vector<fs::path> filePaths;
-    filePaths.reserve(positional.size());
-    for (const auto &arg : positional) {
-        filePaths.emplace_back(arg);
+    if (summary.folders > 0 && summary.fileGroups == 0) {
+        std::cout << (summary.folders == 1 ? "Finished processing folder." : "Finished processing folders.") << std::endl;
+        std::cout << "Check the log for any errors: " << displayPath(logger.path()) << "\n";
+    } else {
+        std::cout << "Finished processing files. Check the log for any errors: "
+                  << displayPath(logger.path()) << "\n";
     }
-
-    bool success = processFiles(filePaths, logger);
-    std::cout << "Finished processing files. Check the log for any errors: "
-              << logger.path().u8string() << "\n";
     if (!success) {
-        logger.logExecutionFailure("Execution failed while processing files. See previous log entries for details.");
+        logger.logExecutionFailure("Execution failed while processing the input. See previous log entries for details.");
     }
     cumulativeStatus = (cumulativeStatus == 0 && success) ? 0 : 1;
     return cumulativeStatus == 0 ? 0 : 1;
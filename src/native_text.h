@@ -0,0 +1,85 @@
+#pragma once
+
+#include "file_system.h"
+
+#include <cstdint>
+#include <string>
+#include <string_view>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include <windows.h>
+#endif
+
+// Helpers for native strings that several translation units of the tool need: the hash used for
+// state keys, fault decisions and shards, and the Windows text conversions. Internal to the tool;
+// not part of the engine's interface.
+namespace pushtofolders {
+
+constexpr std::uint64_t kFnvOffsetBasis = 0xCBF29CE484222325ull;
+constexpr std::uint64_t kFnvPrime = 0x100000001B3ull;
+
+// 64-bit FNV-1a over the code units of a native string, continuing from `hash`.
+inline std::uint64_t hashNativeText(PathStringView text, std::uint64_t hash = kFnvOffsetBasis) {
+    for (auto c : text) {
+        hash = (hash ^ static_cast<std::uint64_t>(c)) * kFnvPrime;
+    }
+    return hash;
+}
+
+// 64-bit FNV-1a over the bytes of UTF-8 text, which is the same on every platform.
+inline std::uint64_t hashUtf8(std::string_view text, std::uint64_t hash = kFnvOffsetBasis) {
+    for (char c : text) {
+        hash = (hash ^ static_cast<unsigned char>(c)) * kFnvPrime;
+    }
+    return hash;
+}
+
+#ifdef _WIN32
+inline std::string wideToUtf8(std::wstring_view wide) {
+    if (wide.empty()) {
+        return {};
+    }
+
+    int required = WideCharToMultiByte(CP_UTF8, 0, wide.data(), static_cast<int>(wide.size()), nullptr, 0, nullptr, nullptr);
+    if (required <= 0) {
+        return {};
+    }
+
+    std::string utf8(static_cast<size_t>(required), '\0');
+    WideCharToMultiByte(CP_UTF8, 0, wide.data(), static_cast<int>(wide.size()), utf8.data(), required, nullptr, nullptr);
+    return utf8;
+}
+
+inline std::string windowsErrorMessage(DWORD errorCode) {
+    LPWSTR buffer = nullptr;
+    DWORD length = FormatMessageW(
+        FORMAT_MESSAGE_ALLOCATE_BUFFER | FORMAT_MESSAGE_FROM_SYSTEM | FORMAT_MESSAGE_IGNORE_INSERTS,
+        nullptr,
+        errorCode,
+        0,
+        reinterpret_cast<LPWSTR>(&buffer),
+        0,
+        nullptr);
+
+    if (length == 0 || buffer == nullptr) {
+        return "Error code: " + std::to_string(static_cast<unsigned long>(errorCode));
+    }
+
+    std::wstring message(buffer, length);
+    LocalFree(buffer);
+
+    while (!message.empty() && (message.back() == L'\r' || message.back() == L'\n')) {
+        message.pop_back();
+    }
+
+    return wideToUtf8(message);
+}
+#endif
+
+} // namespace pushtofolders
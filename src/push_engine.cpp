@@ -0,0 +1,3335 @@
+#include "push_engine.h"
+
+#include "file_system.h"
+#include "native_text.h"
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <filesystem>
+#include <fstream>
+#include <iomanip>
+#include <mutex>
+#include <optional>
+#include <random>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <type_traits>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#ifdef _WIN32
+#define NOMINMAX
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#include <cstdio>
+#else
+#include <spawn.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+extern char **environ;
+#endif
+
+#if defined(__SSE2__) || defined(_M_X64) || defined(_M_AMD64)
+#include <emmintrin.h>
+#endif
+
+namespace pushtofolders {
+
+namespace {
+
+bool isAsciiDigit(PathString::value_type c) {
+    return c >= '0' && c <= '9';
+}
+
+PathString asciiLower(PathString text) {
+    for (auto &c : text) {
+        if (c >= 'A' && c <= 'Z') {
+            c = static_cast<PathString::value_type>(c - 'A' + 'a');
+        }
+    }
+    return text;
+}
+
+#ifdef _WIN32
+#define PATH_LITERAL(str) L##str
+#else
+#define PATH_LITERAL(str) str
+#endif
+
+#if defined(_MSC_VER)
+unsigned lowestSetBit(unsigned mask) {
+    unsigned long index = 0;
+    _BitScanForward(&index, mask);
+    return static_cast<unsigned>(index);
+}
+#else
+unsigned lowestSetBit(unsigned mask) {
+    return static_cast<unsigned>(__builtin_ctz(mask));
+}
+#endif
+
+void appendEscapedUnit(std::string &out, char prefix, unsigned value, int digits) {
+    static constexpr char kHex[] = "0123456789ABCDEF";
+    out.push_back('\\');
+    out.push_back(prefix);
+    for (int shift = (digits - 1) * 4; shift >= 0; shift -= 4) {
+        out.push_back(kHex[(value >> shift) & 0xF]);
+    }
+}
+
+#ifdef _WIN32
+void appendUtf8(std::string &out, char32_t c) {
+    if (c < 0x800) {
+        out.push_back(static_cast<char>(0xC0 | (c >> 6)));
+    } else if (c < 0x10000) {
+        out.push_back(static_cast<char>(0xE0 | (c >> 12)));
+        out.push_back(static_cast<char>(0x80 | ((c >> 6) & 0x3F)));
+    } else {
+        out.push_back(static_cast<char>(0xF0 | (c >> 18)));
+        out.push_back(static_cast<char>(0x80 | ((c >> 12) & 0x3F)));
+        out.push_back(static_cast<char>(0x80 | ((c >> 6) & 0x3F)));
+    }
+    out.push_back(static_cast<char>(0x80 | (c & 0x3F)));
+}
+
+// Renders a path as UTF-8 for the log and the console. Unpaired surrogates become \uXXXX and control
+// characters \xNN; Windows names cannot contain '\', so separators are left as they are.
+std::string displayName(PathStringView name) {
+    std::string out;
+    out.reserve(name.size());
+    for (std::size_t i = 0; i < name.size(); ++i) {
+        char32_t unit = static_cast<char16_t>(name[i]);
+        if (unit < 0x80) {
+            if (unit < 0x20 || unit == 0x7F) {
+                appendEscapedUnit(out, 'x', unit, 2);
+            } else {
+                out.push_back(static_cast<char>(unit));
+            }
+            continue;
+        }
+
+        char32_t codePoint = unit;
+        if (unit >= 0xD800 && unit <= 0xDBFF && i + 1 < name.size() && name[i + 1] >= 0xDC00 && name[i + 1] <= 0xDFFF) {
+            codePoint = 0x10000 + ((unit - 0xD800) << 10) + (static_cast<char16_t>(name[++i]) - 0xDC00);
+        } else if (unit >= 0xD800 && unit <= 0xDFFF) {
+            appendEscapedUnit(out, 'u', unit, 4);
+            continue;
+        }
+        appendUtf8(out, codePoint);
+    }
+    return out;
+}
+#else
+// Length of the valid UTF-8 sequence starting at text[i], or 0 if it is malformed (truncated,
+// overlong, surrogate or above U+10FFFF).
+std::size_t validUtf8Length(std::string_view text, std::size_t i) {
+    auto byte = [&](std::size_t k) { return static_cast<unsigned char>(text[i + k]); };
+    auto continuation = [&](std::size_t k) { return i + k < text.size() && (byte(k) & 0xC0) == 0x80; };
+    unsigned char lead = byte(0);
+    if (lead >= 0xC2 && lead <= 0xDF) {
+        return continuation(1) ? 2 : 0;
+    }
+    if (lead >= 0xE0 && lead <= 0xEF) {
+        if (!continuation(1) || !continuation(2)) {
+            return 0;
+        }
+        if ((lead == 0xE0 && byte(1) < 0xA0) || (lead == 0xED && byte(1) >= 0xA0)) {
+            return 0;
+        }
+        return 3;
+    }
+    if (lead >= 0xF0 && lead <= 0xF4) {
+        if (!continuation(1) || !continuation(2) || !continuation(3)) {
+            return 0;
+        }
+        if ((lead == 0xF0 && byte(1) < 0x90) || (lead == 0xF4 && byte(1) >= 0x90)) {
+            return 0;
+        }
+        return 4;
+    }
+    return 0;
+}
+
+// Renders a file name (any bytes) as well-formed UTF-8 for the log and the console. Bytes that are
+// not valid UTF-8 and control characters become \xNN and a literal backslash becomes \\, so the
+// original name can always be recovered. Printable ASCII is copied 16 bytes at a time, so a name that
+// needs no escaping costs little more than a memcpy.
+std::string displayName(std::string_view name) {
+    std::string out;
+    out.reserve(name.size());
+    std::size_t i = 0;
+    while (i < name.size()) {
+#if defined(__SSE2__) || defined(_M_X64) || defined(_M_AMD64)
+        if (i + 16 <= name.size()) {
+            __m128i block = _mm_loadu_si128(reinterpret_cast<const __m128i *>(name.data() + i));
+            // Signed compare: bytes >= 0x80 are negative, so one test catches them and the C0 controls.
+            __m128i special = _mm_or_si128(_mm_cmplt_epi8(block, _mm_set1_epi8(0x20)),
+                                           _mm_or_si128(_mm_cmpeq_epi8(block, _mm_set1_epi8(0x7F)),
+                                                        _mm_cmpeq_epi8(block, _mm_set1_epi8('\\'))));
+            auto mask = static_cast<unsigned>(_mm_movemask_epi8(special));
+            if (mask == 0) {
+                out.append(name.data() + i, 16);
+                i += 16;
+                continue;
+            }
+            unsigned clean = lowestSetBit(mask);
+            out.append(name.data() + i, clean);
+            i += clean;
+        }
+#endif
+        auto c = static_cast<unsigned char>(name[i]);
+        if (c >= 0x20 && c < 0x7F && c != '\\') {
+            out.push_back(static_cast<char>(c));
+            ++i;
+        } else if (c == '\\') {
+            out += "\\\\";
+            ++i;
+        } else if (c < 0x80) {
+            appendEscapedUnit(out, 'x', c, 2);
+            ++i;
+        } else if (std::size_t length = validUtf8Length(name, i)) {
+            out.append(name.data() + i, length);
+            i += length;
+        } else {
+            appendEscapedUnit(out, 'x', c, 2);
+            ++i;
+        }
+    }
+    return out;
+}
+#endif
+
+} // namespace
+
+std::string displayPath(const fs::path &path) {
+    return displayName(path.native());
+}
+
+namespace {
+
+unsigned defaultJobCount() {
+    unsigned hardwareThreads = std::thread::hardware_concurrency();
+    return hardwareThreads == 0 ? 1 : hardwareThreads;
+}
+
+// Runs function(i) for every i in [0, count) on up to `jobs` threads, handing out indices dynamically.
+template <typename Function>
+void parallelFor(std::size_t count, unsigned jobs, Function &&function) {
+    std::size_t workerCount = std::min<std::size_t>(jobs, count);
+    if (workerCount <= 1) {
+        for (std::size_t i = 0; i < count; ++i) {
+            function(i);
+        }
+        return;
+    }
+
+    std::atomic<std::size_t> next {0};
+    auto worker = [&]() {
+        for (std::size_t i = next.fetch_add(1); i < count; i = next.fetch_add(1)) {
+            function(i);
+        }
+    };
+
+    std::vector<std::thread> threads;
+    threads.reserve(workerCount - 1);
+    for (std::size_t i = 1; i < workerCount; ++i) {
+        threads.emplace_back(worker);
+    }
+    worker();
+    for (auto &thread : threads) {
+        thread.join();
+    }
+}
+
+// Hands log lines to the injected Logger and events to the callback. Both come from worker threads,
+// so every call is made under one lock and neither needs to be thread-safe itself.
+class Reporter {
+public:
+    Reporter(Logger *logger, EventCallback events)
+        : logger_(logger), events_(std::move(events))
+    {
+    }
+
+    void logError(const fs::path &target, std::string_view message) {
+        if (logger_) {
+            std::lock_guard<std::mutex> lock(mutex_);
+            logger_->logError(target, message);
+        }
+    }
+
+    void logInfo(std::string_view message) {
+        if (logger_) {
+            std::lock_guard<std::mutex> lock(mutex_);
+            logger_->logInfo(message);
+        }
+    }
+
+    void emit(EventKind kind, std::string message, const fs::path &path = {}, const fs::path &folder = {}) {
+        if (events_) {
+            Event event {kind, std::move(message), path, folder};
+            std::lock_guard<std::mutex> lock(mutex_);
+            events_(event);
+        }
+    }
+
+private:
+    Logger *logger_;
+    EventCallback events_;
+    std::mutex mutex_;
+};
+
+// Localised words Explorer, Finder and common file managers use when naming a duplicate.
+std::vector<PathString> defaultCopyMarkers() {
+    return {PATH_LITERAL("copy"), PATH_LITERAL("kopie"), PATH_LITERAL("copie"), PATH_LITERAL("copia"),
+            PATH_LITERAL("kopia"), PATH_LITERAL("c\u00f3pia"), PATH_LITERAL("kopio"), PATH_LITERAL("kopya")};
+}
+
+enum class TemplateField {
+    Literal,
+    Stem,
+    Extension,
+    ModifiedTime,
+};
+
+struct TemplateInstruction {
+    TemplateField field;
+    PathString literal;
+    std::string timeFormat;
+};
+
+// Built-in templates skip the instruction interpreter; anything else runs the compiled list.
+enum class TemplateShape {
+    Stem,
+    ExtensionThenStem,
+    Compiled,
+};
+
+struct FolderTemplate {
+    TemplateShape shape = TemplateShape::Stem;
+    std::vector<TemplateInstruction> instructions;
+    unsigned metadata = kMetadataNone;
+};
+
+bool sameCharacter(PathString::value_type lhs, PathString::value_type rhs, bool ignoreCase) {
+    if (ignoreCase) {
+        if (lhs >= 'A' && lhs <= 'Z') {
+            lhs = static_cast<PathString::value_type>(lhs + 0x20);
+        }
+        if (rhs >= 'A' && rhs <= 'Z') {
+            rhs = static_cast<PathString::value_type>(rhs + 0x20);
+        }
+    }
+    return lhs == rhs;
+}
+
+// Glob match supporting '*' and '?'. Backtracks only to the most recent '*', so typical patterns run
+// in linear time.
+bool wildcardMatch(PathStringView pattern, PathStringView text, bool ignoreCase) {
+    std::size_t p = 0;
+    std::size_t t = 0;
+    std::size_t star = PathStringView::npos;
+    std::size_t mark = 0;
+    while (t < text.size()) {
+        if (p < pattern.size() && (pattern[p] == '?' || sameCharacter(pattern[p], text[t], ignoreCase))) {
+            ++p;
+            ++t;
+        } else if (p < pattern.size() && pattern[p] == '*') {
+            star = p++;
+            mark = t;
+        } else if (star != PathStringView::npos) {
+            p = star + 1;
+            t = ++mark;
+        } else {
+            return false;
+        }
+    }
+    while (p < pattern.size() && pattern[p] == '*') {
+        ++p;
+    }
+    return p == pattern.size();
+}
+
+// A set of glob patterns compiled into one matcher. "*.ext" patterns, by far the most common, become
+// hash lookups on the name's dotted suffixes and plain names become exact lookups; only the remaining
+// patterns run the wildcard matcher.
+class GlobSet {
+public:
+    void add(PathStringView pattern) {
+        bool hasWildcard = pattern.find_first_of(PATH_LITERAL("*?")) != PathStringView::npos;
+        if (pattern == PATH_LITERAL("*")) {
+            matchAll_ = true;
+        } else if (!hasWildcard) {
+            names_.emplace(pattern);
+            foldedNames_.insert(asciiLower(PathString(pattern)));
+        } else if (pattern.size() > 2 && pattern.substr(0, 2) == PATH_LITERAL("*.")
+                   && pattern.find_first_of(PATH_LITERAL("*?"), 2) == PathStringView::npos) {
+            extensions_.emplace(pattern.substr(2));
+            foldedExtensions_.insert(asciiLower(PathString(pattern.substr(2))));
+        } else {
+            wildcards_.emplace_back(pattern);
+        }
+        empty_ = false;
+    }
+
+    bool empty() const {
+        return empty_;
+    }
+
+    bool matches(PathStringView name, bool ignoreCase) const {
+        if (matchAll_) {
+            return true;
+        }
+
+        PathString folded;
+        if (ignoreCase && (!names_.empty() || !extensions_.empty())) {
+            folded = asciiLower(PathString(name));
+        }
+        PathStringView key = ignoreCase ? PathStringView(folded) : name;
+        const auto &names = ignoreCase ? foldedNames_ : names_;
+        const auto &extensions = ignoreCase ? foldedExtensions_ : extensions_;
+
+        if (!names.empty() && names.count(PathString(key)) != 0) {
+            return true;
+        }
+        if (!extensions.empty()) {
+            for (std::size_t dot = key.rfind('.'); dot != PathStringView::npos && dot > 0; dot = key.rfind('.', dot - 1)) {
+                if (extensions.count(PathString(key.substr(dot + 1))) != 0) {
+                    return true;
+                }
+            }
+        }
+        for (const auto &pattern : wildcards_) {
+            if (wildcardMatch(pattern, name, ignoreCase)) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+private:
+    bool empty_ = true;
+    bool matchAll_ = false;
+    std::unordered_set<PathString> names_;
+    std::unordered_set<PathString> foldedNames_;
+    std::unordered_set<PathString> extensions_;
+    std::unordered_set<PathString> foldedExtensions_;
+    std::vector<PathString> wildcards_;
+};
+
+// Which directory entries get processed. Name patterns are checked on the raw entry name; the size
+// and time limits need metadata and are only looked at for names that passed.
+struct FileFilter {
+    GlobSet include;
+    GlobSet exclude;
+    std::optional<std::uintmax_t> minSize;
+    std::optional<std::time_t> newerThan;
+    // Names ordered before this one were handled by an earlier slice of a budgeted run.
+    PathString resumeFrom;
+
+    bool acceptsName(PathStringView name, bool ignoreCase) const {
+        return (resumeFrom.empty() || name >= PathStringView(resumeFrom)) && (include.empty() || include.matches(name, ignoreCase)) &&
+               (exclude.empty() || !exclude.matches(name, ignoreCase));
+    }
+
+    unsigned metadataNeeded() const {
+        return (minSize ? kMetadataSize : kMetadataNone) | (newerThan ? kMetadataModifiedTime : kMetadataNone);
+    }
+
+    bool acceptsMetadata(const FileMetadata &metadata) const {
+        return (!minSize || metadata.size >= *minSize) && (!newerThan || metadata.modifiedTime > *newerThan);
+    }
+};
+
+// A parsed --exec-batch command. The words around the "{}+" (or "{file}+") placeholder are passed
+// unchanged, and the folders (or files) of the run are inserted in its place.
+struct CommandTemplate {
+    std::vector<PathString> before;
+    std::vector<PathString> after;
+    bool passFiles = false;
+};
+
+struct Settings {
+    GroupingMode grouping = GroupingMode::Stem;
+    unsigned jobs = defaultJobCount();
+    PathString prefixDelimiters = PATH_LITERAL("_-. ");
+    std::vector<PathString> sidecarExtensions;
+    bool stripCopySuffixes = false;
+    std::vector<PathString> copyMarkers = defaultCopyMarkers();
+    std::vector<PathString> compoundExtensions;
+    FolderTemplate folderTemplate;
+    FileFilter filter;
+    PlacementMode placement = PlacementMode::Move;
+    NameFolding nameFolding = NameFolding::Auto;
+    // Resolved from nameFolding for the directory being processed.
+    bool composeUnicode = false;
+    bool foldCase = false;
+    // --incremental skips folders whose recorded state still matches.
+    bool incremental = false;
+    // --time-budget and --max-files: no new batch is started once either is used up.
+    std::optional<std::chrono::steady_clock::time_point> deadline;
+    std::optional<std::size_t> maxFiles;
+    std::optional<CommandTemplate> execBatch;
+    // --shard: only folders that hash to shardIndex (of shardCount) are handled.
+    unsigned shardIndex = 0;
+    unsigned shardCount = 1;
+    FileSystem *fileSystem = &nativeFileSystem();
+    // Digest of the settings that change the result, so that state recorded under others is not reused.
+    std::uint64_t settingsDigest = 0;
+};
+
+enum class ContentCategory {
+    Image,
+    Video,
+    Audio,
+    Archive,
+    Document,
+    Text,
+    Other,
+};
+
+std::string_view contentCategoryFolderName(ContentCategory category) {
+    switch (category) {
+    case ContentCategory::Image:
+        return "image";
+    case ContentCategory::Video:
+        return "video";
+    case ContentCategory::Audio:
+        return "audio";
+    case ContentCategory::Archive:
+        return "archive";
+    case ContentCategory::Document:
+        return "document";
+    case ContentCategory::Text:
+        return "text";
+    case ContentCategory::Other:
+        break;
+    }
+    return "other";
+}
+
+// A magic-byte signature. When secondaryMagic is set it must match as well (RIFF/WAVE, zip-based documents).
+struct ContentSignature {
+    ContentCategory category;
+    std::size_t offset;
+    std::string_view magic;
+    std::size_t secondaryOffset;
+    std::string_view secondaryMagic;
+};
+
+constexpr ContentSignature signature(ContentCategory category, std::size_t offset, std::string_view magic,
+                                     std::size_t secondaryOffset = 0, std::string_view secondaryMagic = {}) {
+    return ContentSignature {category, offset, magic, secondaryOffset, secondaryMagic};
+}
+
+// Signatures are tried in table order, so more specific entries must precede the generic ones they refine.
+constexpr std::array<ContentSignature, 44> kContentSignatures = {{
+    signature(ContentCategory::Document, 0, "PK\x03\x04", 30, "[Content_Types].xml"),
+    signature(ContentCategory::Document, 0, "PK\x03\x04", 30, "mimetypeapplication/vnd.oasis"),
+    signature(ContentCategory::Document, 0, "PK\x03\x04", 30, "mimetypeapplication/epub+zip"),
+    signature(ContentCategory::Document, 0, "%PDF-"),
+    signature(ContentCategory::Document, 0, std::string_view("\xD0\xCF\x11\xE0\xA1\xB1\x1A\xE1", 8)),
+    signature(ContentCategory::Document, 0, "{\\rtf"),
+
+    signature(ContentCategory::Image, 0, "\xFF\xD8\xFF"),
+    signature(ContentCategory::Image, 0, "\x89PNG\r\n\x1A\n"),
+    signature(ContentCategory::Image, 0, "GIF87a"),
+    signature(ContentCategory::Image, 0, "GIF89a"),
+    signature(ContentCategory::Image, 0, std::string_view("II*\0", 4)),
+    signature(ContentCategory::Image, 0, std::string_view("MM\0*", 4)),
+    signature(ContentCategory::Image, 0, "RIFF", 8, "WEBP"),
+    signature(ContentCategory::Image, 0, std::string_view("\0\0\1\0", 4)),
+    signature(ContentCategory::Image, 0, "8BPS"),
+    signature(ContentCategory::Image, 0, "v/1\x01"),
+    signature(ContentCategory::Image, 4, "ftypheic"),
+    signature(ContentCategory::Image, 4, "ftypheix"),
+    signature(ContentCategory::Image, 4, "ftypmif1"),
+    signature(ContentCategory::Image, 4, "ftypavif"),
+
+    signature(ContentCategory::Audio, 4, "ftypM4A "),
+    signature(ContentCategory::Audio, 0, "ID3"),
+    signature(ContentCategory::Audio, 0, "fLaC"),
+    signature(ContentCategory::Audio, 0, "OggS"),
+    signature(ContentCategory::Audio, 0, "RIFF", 8, "WAVE"),
+    signature(ContentCategory::Audio, 0, "FORM", 8, "AIFF"),
+    signature(ContentCategory::Audio, 0, "MThd"),
+    signature(ContentCategory::Audio, 0, "\xFF\xFB"),
+    signature(ContentCategory::Audio, 0, "\xFF\xF3"),
+
+    signature(ContentCategory::Video, 4, "ftyp"),
+    signature(ContentCategory::Video, 0, "\x1A\x45\xDF\xA3"),
+    signature(ContentCategory::Video, 0, "RIFF", 8, "AVI "),
+    signature(ContentCategory::Video, 0, std::string_view("\0\0\1\xBA", 4)),
+    signature(ContentCategory::Video, 0, "FLV\x01"),
+    signature(ContentCategory::Video, 0, "\x30\x26\xB2\x75\x8E\x66\xCF\x11"),
+
+    signature(ContentCategory::Archive, 0, "PK\x03\x04"),
+    signature(ContentCategory::Archive, 0, "PK\x05\x06"),
+    signature(ContentCategory::Archive, 0, "\x1F\x8B"),
+    signature(ContentCategory::Archive, 0, "BZh"),
+    signature(ContentCategory::Archive, 0, std::string_view("\xFD" "7zXZ\0", 6)),
+    signature(ContentCategory::Archive, 0, "7z\xBC\xAF\x27\x1C"),
+    signature(ContentCategory::Archive, 0, "Rar!\x1A\x07"),
+    signature(ContentCategory::Archive, 0, "\x28\xB5\x2F\xFD"),
+    signature(ContentCategory::Archive, 257, "ustar"),
+}};
+
+static_assert(kContentSignatures.size() <= 64, "Signature candidates are tracked in a 64-bit mask.");
+
+// For every possible first byte, the set of signatures worth testing. Signatures anchored past offset 0
+// are candidates for every byte.
+constexpr std::array<std::uint64_t, 256> buildSignatureIndex() {
+    std::array<std::uint64_t, 256> index {};
+    for (std::size_t i = 0; i < kContentSignatures.size(); ++i) {
+        const ContentSignature &entry = kContentSignatures[i];
+        for (std::size_t byte = 0; byte < index.size(); ++byte) {
+            if (entry.offset != 0 || static_cast<unsigned char>(entry.magic[0]) == byte) {
+                index[byte] |= std::uint64_t {1} << i;
+            }
+        }
+    }
+    return index;
+}
+
+constexpr std::array<std::uint64_t, 256> kSignatureIndex = buildSignatureIndex();
+
+constexpr std::size_t kContentHeaderSize = 512;
+
+bool headerMatches(std::string_view header, std::size_t offset, std::string_view magic) {
+    return header.size() >= offset + magic.size() && header.compare(offset, magic.size(), magic) == 0;
+}
+
+bool looksLikeText(std::string_view header) {
+    if (headerMatches(header, 0, "\xEF\xBB\xBF") || headerMatches(header, 0, "\xFF\xFE") || headerMatches(header, 0, "\xFE\xFF")) {
+        return true;
+    }
+
+    for (unsigned char byte : header) {
+        if (byte == 0 || (byte < 0x20 && byte != '\t' && byte != '\n' && byte != '\r' && byte != '\f')) {
+            return false;
+        }
+    }
+    return true;
+}
+
+ContentCategory classifyContent(std::string_view header) {
+    if (header.empty()) {
+        return ContentCategory::Other;
+    }
+
+    std::uint64_t candidates = kSignatureIndex[static_cast<unsigned char>(header[0])];
+    for (std::size_t i = 0; candidates != 0; ++i, candidates >>= 1) {
+        if ((candidates & 1) == 0) {
+            continue;
+        }
+        const ContentSignature &entry = kContentSignatures[i];
+        if (headerMatches(header, entry.offset, entry.magic)
+            && (entry.secondaryMagic.empty() || headerMatches(header, entry.secondaryOffset, entry.secondaryMagic))) {
+            return entry.category;
+        }
+    }
+
+    return looksLikeText(header) ? ContentCategory::Text : ContentCategory::Other;
+}
+
+// Classifies every file by its leading bytes. Files are split into fixed-size batches that worker
+// threads claim one at a time, each reusing a single header buffer. Unreadable files yield nullopt.
+std::vector<std::optional<ContentCategory>> classifyFiles(const std::vector<fs::path> &files, FileSystem &fileSystem, unsigned jobs,
+                                                         Reporter &logger) {
+    constexpr std::size_t kBatchSize = 64;
+    std::vector<std::optional<ContentCategory>> categories(files.size());
+    std::size_t batchCount = (files.size() + kBatchSize - 1) / kBatchSize;
+
+    parallelFor(batchCount, jobs, [&](std::size_t batch) {
+        std::string header(kContentHeaderSize, '\0');
+        std::string errorMessage;
+        std::size_t end = std::min(files.size(), (batch + 1) * kBatchSize);
+        for (std::size_t i = batch * kBatchSize; i < end; ++i) {
+            std::size_t bytesRead = 0;
+            if (!fileSystem.readPrefix(files[i], header, bytesRead, errorMessage)) {
+                std::string message = "Failed to read file: " + errorMessage;
+                logger.logError(files[i], message);
+                logger.emit(EventKind::Error, "Failed to classify '" + displayPath(files[i]) + "': " + message, files[i]);
+                continue;
+            }
+            categories[i] = classifyContent(std::string_view(header.data(), bytesRead));
+        }
+    });
+
+    return categories;
+}
+
+bool ensureDirectory(const fs::path &dir, FileSystem &fileSystem, Reporter &logger) {
+    FileMetadata metadata;
+    std::string errorMessage;
+    if (fileSystem.readMetadata(dir, kMetadataType, metadata, errorMessage) && metadata.type != FileType::NotFound) {
+        if (metadata.type != FileType::Directory) {
+            logger.logError(dir, "A non-directory with the desired folder name already exists.");
+            logger.emit(EventKind::Error, "Cannot create folder '" + displayPath(dir) + "' because a file exists with that name.", dir);
+            return false;
+        }
+        return true;
+    }
+
+    if (!fileSystem.createDirectories(dir, errorMessage)) {
+        logger.logError(dir, "Failed to create folder: " + errorMessage);
+        logger.emit(EventKind::Error, "Failed to create folder '" + displayPath(dir) + "': " + errorMessage, dir);
+        return false;
+    }
+    return true;
+}
+
+LinkKind linkKindOf(PlacementMode placement) {
+    switch (placement) {
+    case PlacementMode::SymbolicLink:
+        return LinkKind::Symbolic;
+    case PlacementMode::Reflink:
+        return LinkKind::Reflink;
+    default:
+        return LinkKind::Hard;
+    }
+}
+
+// Moves (or, with --link, links) filePath into destinationFolder. The folder is created on the first
+// successful check and folderReady remembers that, so a batch of files sharing a folder only probes it once.
+enum class PlacementOutcome {
+    Placed,
+    // --link found the same link already in place, as a re-run over a link farm does.
+    AlreadyLinked,
+    Failed,
+};
+
+PlacementOutcome moveFileToFolder(const fs::path &filePath, const fs::path &destinationFolder, const Settings &options, bool &folderReady,
+                                  Reporter &logger) {
+    FileSystem &fileSystem = *options.fileSystem;
+    FileMetadata metadata;
+    std::string errorMessage;
+    if (!fileSystem.readMetadata(filePath, kMetadataType, metadata, errorMessage)) {
+        logger.logError(filePath, "Failed to read file attributes: " + errorMessage);
+        logger.emit(EventKind::Error, "Failed to read '" + displayPath(filePath) + "': " + errorMessage, filePath);
+        return PlacementOutcome::Failed;
+    }
+
+    if (metadata.type == FileType::NotFound) {
+        logger.logError(filePath, "File does not exist.");
+        logger.emit(EventKind::Error, "File not found: " + displayPath(filePath), filePath);
+        return PlacementOutcome::Failed;
+    }
+
+    if (metadata.type != FileType::Regular) {
+        logger.logError(filePath, "Path is not a regular file.");
+        logger.emit(EventKind::Error, "Not a file: " + displayPath(filePath), filePath);
+        return PlacementOutcome::Failed;
+    }
+
+    if (!folderReady) {
+        if (!ensureDirectory(destinationFolder, fileSystem, logger)) {
+            return PlacementOutcome::Failed;
+        }
+        folderReady = true;
+    }
+
+    fs::path destinationFile = destinationFolder / filePath.filename();
+    if (fileSystem.readMetadata(destinationFile, kMetadataType, metadata, errorMessage) && metadata.type != FileType::NotFound) {
+        if (options.placement != PlacementMode::Move && fileSystem.isLinkTo(destinationFile, filePath, linkKindOf(options.placement))) {
+            return PlacementOutcome::AlreadyLinked;
+        }
+        logger.logError(destinationFile, "Destination file already exists.");
+        logger.emit(EventKind::Error, "Destination already exists: " + displayPath(destinationFile), destinationFile);
+        return PlacementOutcome::Failed;
+    }
+
+    if (options.placement != PlacementMode::Move) {
+        if (!fileSystem.linkNoReplace(filePath, destinationFile, linkKindOf(options.placement), errorMessage)) {
+            std::string message = "Failed to link file: " + errorMessage;
+            logger.logError(destinationFile, message);
+            logger.emit(EventKind::Error, "Failed to link '" + displayPath(filePath) + "': " + message, filePath);
+            return PlacementOutcome::Failed;
+        }
+        logger.logInfo(std::string("Linked ") + displayPath(filePath) + " into " + displayPath(destinationFolder));
+        logger.emit(EventKind::Placed, "Linked '" + displayPath(filePath.filename()) + "' into '" + displayPath(destinationFolder.filename()) + "'", filePath, destinationFolder);
+        return PlacementOutcome::Placed;
+    }
+
+    if (!fileSystem.renameNoReplace(filePath, destinationFile, errorMessage)) {
+        std::string message = "Failed to move file: " + errorMessage;
+        logger.logError(destinationFile, message);
+        logger.emit(EventKind::Error, "Failed to move '" + displayPath(filePath) + "': " + message, filePath);
+        return PlacementOutcome::Failed;
+    }
+
+    logger.logInfo(std::string("Moved ") + displayPath(filePath) + " to " + displayPath(destinationFolder));
+    logger.emit(EventKind::Placed, "Moved '" + displayPath(filePath.filename()) + "' into '" + displayPath(destinationFolder.filename()) + "'", filePath, destinationFolder);
+    return PlacementOutcome::Placed;
+}
+
+struct MoveRequest {
+    fs::path source;
+    fs::path destinationFolder;
+};
+
+bool endsWithIgnoringAsciiCase(PathStringView text, PathStringView lowerSuffix) {
+    if (text.size() < lowerSuffix.size()) {
+        return false;
+    }
+    std::size_t offset = text.size() - lowerSuffix.size();
+    for (std::size_t i = 0; i < lowerSuffix.size(); ++i) {
+        auto c = text[offset + i];
+        if (c >= 'A' && c <= 'Z') {
+            c = static_cast<PathString::value_type>(c - 'A' + 'a');
+        }
+        if (c != lowerSuffix[i]) {
+            return false;
+        }
+    }
+    return true;
+}
+
+PathStringView trimTrailing(PathStringView text, PathStringView characters) {
+    while (!text.empty() && characters.find(text.back()) != PathStringView::npos) {
+        text.remove_suffix(1);
+    }
+    return text;
+}
+
+// Strips the suffixes that browsers and file managers append to duplicates: "Report (1)",
+// "Report - Copy", "Report - Copy (2)", "Report copy 3" and their localised forms all become
+// "Report". A backwards scan over the stem, no allocation; markers must be lower case.
+PathStringView stripCopySuffixes(PathStringView stem, const std::vector<PathString> &markers) {
+    const PathStringView separators = PATH_LITERAL(" -_");
+    PathStringView text = stem;
+
+    for (;;) {
+        std::size_t before = text.size();
+
+        if (!text.empty() && text.back() == ')') {
+            std::size_t open = text.size() - 1;
+            while (open > 0 && isAsciiDigit(text[open - 1])) {
+                --open;
+            }
+            if (open > 0 && open < text.size() - 1 && text[open - 1] == '(') {
+                text = trimTrailing(text.substr(0, open - 1), PATH_LITERAL(" "));
+            }
+        }
+
+        PathStringView candidate = text;
+        std::size_t digits = candidate.size();
+        while (digits > 0 && isAsciiDigit(candidate[digits - 1])) {
+            --digits;
+        }
+        if (digits > 0 && digits < candidate.size() && candidate[digits - 1] == ' ') {
+            candidate = candidate.substr(0, digits - 1);
+        }
+        for (const auto &marker : markers) {
+            if (candidate.size() > marker.size() && endsWithIgnoringAsciiCase(candidate, marker)
+                && separators.find(candidate[candidate.size() - marker.size() - 1]) != PathStringView::npos) {
+                text = trimTrailing(candidate.substr(0, candidate.size() - marker.size()), separators);
+                break;
+            }
+        }
+
+        if (text.empty()) {
+            return stem;
+        }
+        if (text.size() == before) {
+            return text;
+        }
+    }
+}
+
+// Multi-part extensions that fs::path::stem() would split ("backup.tar.gz" must stem to "backup").
+constexpr std::array<std::string_view, 24> kCompoundExtensions = {{
+    "tar.gz", "tar.bz2", "tar.xz", "tar.zst", "tar.lz", "tar.lz4", "tar.lzma", "tar.z",
+    "tar.br", "tar.7z", "cpio.gz", "warc.gz", "nii.gz", "fits.gz", "fits.fz", "vcf.gz",
+    "fastq.gz", "fq.gz", "sam.gz", "bed.gz", "ps.gz", "svg.gz", "min.js", "d.ts",
+}};
+
+constexpr std::size_t kCompoundSlots = 64;
+
+// Case-insensitive FNV-1a, usable both at compile time on the table and at run time on native names.
+template <typename Char>
+constexpr std::uint32_t extensionHash(std::basic_string_view<Char> text, std::uint32_t seed) {
+    std::uint32_t hash = seed;
+    for (Char c : text) {
+        auto unit = static_cast<std::uint32_t>(c);
+        if (unit >= 'A' && unit <= 'Z') {
+            unit += 'a' - 'A';
+        }
+        hash = (hash ^ unit) * 16777619u;
+    }
+    return hash ^ (hash >> 15);
+}
+
+// Searches for a seed under which every table entry lands in its own slot.
+constexpr std::uint32_t findCompoundSeed() {
+    for (std::uint32_t seed = 2166136261u;; ++seed) {
+        std::array<bool, kCompoundSlots> used {};
+        bool collision = false;
+        for (std::string_view key : kCompoundExtensions) {
+            std::size_t slot = extensionHash(key, seed) % kCompoundSlots;
+            if (used[slot]) {
+                collision = true;
+                break;
+            }
+            used[slot] = true;
+        }
+        if (!collision) {
+            return seed;
+        }
+    }
+}
+
+constexpr std::uint32_t kCompoundSeed = findCompoundSeed();
+
+constexpr std::array<std::string_view, kCompoundSlots> buildCompoundTable() {
+    std::array<std::string_view, kCompoundSlots> table {};
+    for (std::string_view key : kCompoundExtensions) {
+        table[extensionHash(key, kCompoundSeed) % kCompoundSlots] = key;
+    }
+    return table;
+}
+
+constexpr std::array<std::string_view, kCompoundSlots> kCompoundTable = buildCompoundTable();
+
+template <typename Key>
+bool equalsIgnoringAsciiCase(PathStringView text, const Key &lowerKey) {
+    if (text.size() != lowerKey.size()) {
+        return false;
+    }
+    for (std::size_t i = 0; i < text.size(); ++i) {
+        auto c = static_cast<std::uint32_t>(static_cast<std::make_unsigned_t<PathString::value_type>>(text[i]));
+        if (c >= 'A' && c <= 'Z') {
+            c += 'a' - 'A';
+        }
+        if (c != static_cast<std::uint32_t>(static_cast<std::make_unsigned_t<typename Key::value_type>>(lowerKey[i]))) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool isCompoundExtension(PathStringView extension, const Settings &options) {
+    if (equalsIgnoringAsciiCase(extension, kCompoundTable[extensionHash(extension, kCompoundSeed) % kCompoundSlots])) {
+        return true;
+    }
+    for (const auto &extra : options.compoundExtensions) {
+        if (equalsIgnoringAsciiCase(extension, extra)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// The final path component, taken straight from the native string without building new paths.
+PathStringView filenameOf(const fs::path &file) {
+    PathStringView native = file.native();
+#ifdef _WIN32
+    std::size_t separator = native.find_last_of(L"\\/:");
+#else
+    std::size_t separator = native.rfind('/');
+#endif
+    return separator == PathStringView::npos ? native : native.substr(separator + 1);
+}
+
+// Same rules as fs::path::stem() ("name.ext" -> "name", ".profile" stays whole), except that a
+// known compound extension such as ".tar.gz" is removed as one unit.
+PathStringView stemOf(PathStringView filename, const Settings &options) {
+    std::size_t dot = filename.rfind('.');
+    if (dot == PathStringView::npos || dot == 0 || filename == PATH_LITERAL("..")) {
+        return filename;
+    }
+
+    std::size_t innerDot = filename.rfind('.', dot - 1);
+    if (innerDot != PathStringView::npos && innerDot > 0 && isCompoundExtension(filename.substr(innerDot + 1), options)) {
+        return filename.substr(0, innerDot);
+    }
+    return filename.substr(0, dot);
+}
+
+// Canonical compositions (base, combining mark) -> precomposed character for Latin, Greek, Cyrillic and
+// Vietnamese, sorted for binary search. Enough to turn the NFD names macOS clients write into NFC.
+struct UnicodeComposition {
+    char32_t first;
+    char32_t second;
+    char32_t composed;
+};
+
+constexpr UnicodeComposition kUnicodeCompositions[] = {
+    {0x41, 0x300, 0xC0}, {0x41, 0x301, 0xC1}, {0x41, 0x302, 0xC2}, {0x41, 0x303, 0xC3}, {0x41, 0x304, 0x100}, {0x41, 0x306, 0x102},
+    {0x41, 0x307, 0x226}, {0x41, 0x308, 0xC4}, {0x41, 0x309, 0x1EA2}, {0x41, 0x30A, 0xC5}, {0x41, 0x30C, 0x1CD}, {0x41, 0x30F, 0x200},
+    {0x41, 0x311, 0x202}, {0x41, 0x323, 0x1EA0}, {0x41, 0x325, 0x1E00}, {0x41, 0x328, 0x104}, {0x42, 0x307, 0x1E02}, {0x42, 0x323, 0x1E04},
+    {0x42, 0x331, 0x1E06}, {0x43, 0x301, 0x106}, {0x43, 0x302, 0x108}, {0x43, 0x307, 0x10A}, {0x43, 0x30C, 0x10C}, {0x43, 0x327, 0xC7},
+    {0x44, 0x307, 0x1E0A}, {0x44, 0x30C, 0x10E}, {0x44, 0x323, 0x1E0C}, {0x44, 0x327, 0x1E10}, {0x44, 0x32D, 0x1E12}, {0x44, 0x331, 0x1E0E},
+    {0x45, 0x300, 0xC8}, {0x45, 0x301, 0xC9}, {0x45, 0x302, 0xCA}, {0x45, 0x303, 0x1EBC}, {0x45, 0x304, 0x112}, {0x45, 0x306, 0x114},
+    {0x45, 0x307, 0x116}, {0x45, 0x308, 0xCB}, {0x45, 0x309, 0x1EBA}, {0x45, 0x30C, 0x11A}, {0x45, 0x30F, 0x204}, {0x45, 0x311, 0x206},
+    {0x45, 0x323, 0x1EB8}, {0x45, 0x327, 0x228}, {0x45, 0x328, 0x118}, {0x45, 0x32D, 0x1E18}, {0x45, 0x330, 0x1E1A}, {0x46, 0x307, 0x1E1E},
+    {0x47, 0x301, 0x1F4}, {0x47, 0x302, 0x11C}, {0x47, 0x304, 0x1E20}, {0x47, 0x306, 0x11E}, {0x47, 0x307, 0x120}, {0x47, 0x30C, 0x1E6},
+    {0x47, 0x327, 0x122}, {0x48, 0x302, 0x124}, {0x48, 0x307, 0x1E22}, {0x48, 0x308, 0x1E26}, {0x48, 0x30C, 0x21E}, {0x48, 0x323, 0x1E24},
+    {0x48, 0x327, 0x1E28}, {0x48, 0x32E, 0x1E2A}, {0x49, 0x300, 0xCC}, {0x49, 0x301, 0xCD}, {0x49, 0x302, 0xCE}, {0x49, 0x303, 0x128},
+    {0x49, 0x304, 0x12A}, {0x49, 0x306, 0x12C}, {0x49, 0x307, 0x130}, {0x49, 0x308, 0xCF}, {0x49, 0x309, 0x1EC8}, {0x49, 0x30C, 0x1CF},
+    {0x49, 0x30F, 0x208}, {0x49, 0x311, 0x20A}, {0x49, 0x323, 0x1ECA}, {0x49, 0x328, 0x12E}, {0x49, 0x330, 0x1E2C}, {0x4A, 0x302, 0x134},
+    {0x4B, 0x301, 0x1E30}, {0x4B, 0x30C, 0x1E8}, {0x4B, 0x323, 0x1E32}, {0x4B, 0x327, 0x136}, {0x4B, 0x331, 0x1E34}, {0x4C, 0x301, 0x139},
+    {0x4C, 0x30C, 0x13D}, {0x4C, 0x323, 0x1E36}, {0x4C, 0x327, 0x13B}, {0x4C, 0x32D, 0x1E3C}, {0x4C, 0x331, 0x1E3A}, {0x4D, 0x301, 0x1E3E},
+    {0x4D, 0x307, 0x1E40}, {0x4D, 0x323, 0x1E42}, {0x4E, 0x300, 0x1F8}, {0x4E, 0x301, 0x143}, {0x4E, 0x303, 0xD1}, {0x4E, 0x307, 0x1E44},
+    {0x4E, 0x30C, 0x147}, {0x4E, 0x323, 0x1E46}, {0x4E, 0x327, 0x145}, {0x4E, 0x32D, 0x1E4A}, {0x4E, 0x331, 0x1E48}, {0x4F, 0x300, 0xD2},
+    {0x4F, 0x301, 0xD3}, {0x4F, 0x302, 0xD4}, {0x4F, 0x303, 0xD5}, {0x4F, 0x304, 0x14C}, {0x4F, 0x306, 0x14E}, {0x4F, 0x307, 0x22E},
+    {0x4F, 0x308, 0xD6}, {0x4F, 0x309, 0x1ECE}, {0x4F, 0x30B, 0x150}, {0x4F, 0x30C, 0x1D1}, {0x4F, 0x30F, 0x20C}, {0x4F, 0x311, 0x20E},
+    {0x4F, 0x31B, 0x1A0}, {0x4F, 0x323, 0x1ECC}, {0x4F, 0x328, 0x1EA}, {0x50, 0x301, 0x1E54}, {0x50, 0x307, 0x1E56}, {0x52, 0x301, 0x154},
+    {0x52, 0x307, 0x1E58}, {0x52, 0x30C, 0x158}, {0x52, 0x30F, 0x210}, {0x52, 0x311, 0x212}, {0x52, 0x323, 0x1E5A}, {0x52, 0x327, 0x156},
+    {0x52, 0x331, 0x1E5E}, {0x53, 0x301, 0x15A}, {0x53, 0x302, 0x15C}, {0x53, 0x307, 0x1E60}, {0x53, 0x30C, 0x160}, {0x53, 0x323, 0x1E62},
+    {0x53, 0x326, 0x218}, {0x53, 0x327, 0x15E}, {0x54, 0x307, 0x1E6A}, {0x54, 0x30C, 0x164}, {0x54, 0x323, 0x1E6C}, {0x54, 0x326, 0x21A},
+    {0x54, 0x327, 0x162}, {0x54, 0x32D, 0x1E70}, {0x54, 0x331, 0x1E6E}, {0x55, 0x300, 0xD9}, {0x55, 0x301, 0xDA}, {0x55, 0x302, 0xDB},
+    {0x55, 0x303, 0x168}, {0x55, 0x304, 0x16A}, {0x55, 0x306, 0x16C}, {0x55, 0x308, 0xDC}, {0x55, 0x309, 0x1EE6}, {0x55, 0x30A, 0x16E},
+    {0x55, 0x30B, 0x170}, {0x55, 0x30C, 0x1D3}, {0x55, 0x30F, 0x214}, {0x55, 0x311, 0x216}, {0x55, 0x31B, 0x1AF}, {0x55, 0x323, 0x1EE4},
+    {0x55, 0x324, 0x1E72}, {0x55, 0x328, 0x172}, {0x55, 0x32D, 0x1E76}, {0x55, 0x330, 0x1E74}, {0x56, 0x303, 0x1E7C}, {0x56, 0x323, 0x1E7E},
+    {0x57, 0x300, 0x1E80}, {0x57, 0x301, 0x1E82}, {0x57, 0x302, 0x174}, {0x57, 0x307, 0x1E86}, {0x57, 0x308, 0x1E84}, {0x57, 0x323, 0x1E88},
+    {0x58, 0x307, 0x1E8A}, {0x58, 0x308, 0x1E8C}, {0x59, 0x300, 0x1EF2}, {0x59, 0x301, 0xDD}, {0x59, 0x302, 0x176}, {0x59, 0x303, 0x1EF8},
+    {0x59, 0x304, 0x232}, {0x59, 0x307, 0x1E8E}, {0x59, 0x308, 0x178}, {0x59, 0x309, 0x1EF6}, {0x59, 0x323, 0x1EF4}, {0x5A, 0x301, 0x179},
+    {0x5A, 0x302, 0x1E90}, {0x5A, 0x307, 0x17B}, {0x5A, 0x30C, 0x17D}, {0x5A, 0x323, 0x1E92}, {0x5A, 0x331, 0x1E94}, {0x61, 0x300, 0xE0},
+    {0x61, 0x301, 0xE1}, {0x61, 0x302, 0xE2}, {0x61, 0x303, 0xE3}, {0x61, 0x304, 0x101}, {0x61, 0x306, 0x103}, {0x61, 0x307, 0x227},
+    {0x61, 0x308, 0xE4}, {0x61, 0x309, 0x1EA3}, {0x61, 0x30A, 0xE5}, {0x61, 0x30C, 0x1CE}, {0x61, 0x30F, 0x201}, {0x61, 0x311, 0x203},
+    {0x61, 0x323, 0x1EA1}, {0x61, 0x325, 0x1E01}, {0x61, 0x328, 0x105}, {0x62, 0x307, 0x1E03}, {0x62, 0x323, 0x1E05}, {0x62, 0x331, 0x1E07},
+    {0x63, 0x301, 0x107}, {0x63, 0x302, 0x109}, {0x63, 0x307, 0x10B}, {0x63, 0x30C, 0x10D}, {0x63, 0x327, 0xE7}, {0x64, 0x307, 0x1E0B},
+    {0x64, 0x30C, 0x10F}, {0x64, 0x323, 0x1E0D}, {0x64, 0x327, 0x1E11}, {0x64, 0x32D, 0x1E13}, {0x64, 0x331, 0x1E0F}, {0x65, 0x300, 0xE8},
+    {0x65, 0x301, 0xE9}, {0x65, 0x302, 0xEA}, {0x65, 0x303, 0x1EBD}, {0x65, 0x304, 0x113}, {0x65, 0x306, 0x115}, {0x65, 0x307, 0x117},
+    {0x65, 0x308, 0xEB}, {0x65, 0x309, 0x1EBB}, {0x65, 0x30C, 0x11B}, {0x65, 0x30F, 0x205}, {0x65, 0x311, 0x207}, {0x65, 0x323, 0x1EB9},
+    {0x65, 0x327, 0x229}, {0x65, 0x328, 0x119}, {0x65, 0x32D, 0x1E19}, {0x65, 0x330, 0x1E1B}, {0x66, 0x307, 0x1E1F}, {0x67, 0x301, 0x1F5},
+    {0x67, 0x302, 0x11D}, {0x67, 0x304, 0x1E21}, {0x67, 0x306, 0x11F}, {0x67, 0x307, 0x121}, {0x67, 0x30C, 0x1E7}, {0x67, 0x327, 0x123},
+    {0x68, 0x302, 0x125}, {0x68, 0x307, 0x1E23}, {0x68, 0x308, 0x1E27}, {0x68, 0x30C, 0x21F}, {0x68, 0x323, 0x1E25}, {0x68, 0x327, 0x1E29},
+    {0x68, 0x32E, 0x1E2B}, {0x68, 0x331, 0x1E96}, {0x69, 0x300, 0xEC}, {0x69, 0x301, 0xED}, {0x69, 0x302, 0xEE}, {0x69, 0x303, 0x129},
+    {0x69, 0x304, 0x12B}, {0x69, 0x306, 0x12D}, {0x69, 0x308, 0xEF}, {0x69, 0x309, 0x1EC9}, {0x69, 0x30C, 0x1D0}, {0x69, 0x30F, 0x209},
+    {0x69, 0x311, 0x20B}, {0x69, 0x323, 0x1ECB}, {0x69, 0x328, 0x12F}, {0x69, 0x330, 0x1E2D}, {0x6A, 0x302, 0x135}, {0x6A, 0x30C, 0x1F0},
+    {0x6B, 0x301, 0x1E31}, {0x6B, 0x30C, 0x1E9}, {0x6B, 0x323, 0x1E33}, {0x6B, 0x327, 0x137}, {0x6B, 0x331, 0x1E35}, {0x6C, 0x301, 0x13A},
+    {0x6C, 0x30C, 0x13E}, {0x6C, 0x323, 0x1E37}, {0x6C, 0x327, 0x13C}, {0x6C, 0x32D, 0x1E3D}, {0x6C, 0x331, 0x1E3B}, {0x6D, 0x301, 0x1E3F},
+    {0x6D, 0x307, 0x1E41}, {0x6D, 0x323, 0x1E43}, {0x6E, 0x300, 0x1F9}, {0x6E, 0x301, 0x144}, {0x6E, 0x303, 0xF1}, {0x6E, 0x307, 0x1E45},
+    {0x6E, 0x30C, 0x148}, {0x6E, 0x323, 0x1E47}, {0x6E, 0x327, 0x146}, {0x6E, 0x32D, 0x1E4B}, {0x6E, 0x331, 0x1E49}, {0x6F, 0x300, 0xF2},
+    {0x6F, 0x301, 0xF3}, {0x6F, 0x302, 0xF4}, {0x6F, 0x303, 0xF5}, {0x6F, 0x304, 0x14D}, {0x6F, 0x306, 0x14F}, {0x6F, 0x307, 0x22F},
+    {0x6F, 0x308, 0xF6}, {0x6F, 0x309, 0x1ECF}, {0x6F, 0x30B, 0x151}, {0x6F, 0x30C, 0x1D2}, {0x6F, 0x30F, 0x20D}, {0x6F, 0x311, 0x20F},
+    {0x6F, 0x31B, 0x1A1}, {0x6F, 0x323, 0x1ECD}, {0x6F, 0x328, 0x1EB}, {0x70, 0x301, 0x1E55}, {0x70, 0x307, 0x1E57}, {0x72, 0x301, 0x155},
+    {0x72, 0x307, 0x1E59}, {0x72, 0x30C, 0x159}, {0x72, 0x30F, 0x211}, {0x72, 0x311, 0x213}, {0x72, 0x323, 0x1E5B}, {0x72, 0x327, 0x157},
+    {0x72, 0x331, 0x1E5F}, {0x73, 0x301, 0x15B}, {0x73, 0x302, 0x15D}, {0x73, 0x307, 0x1E61}, {0x73, 0x30C, 0x161}, {0x73, 0x323, 0x1E63},
+    {0x73, 0x326, 0x219}, {0x73, 0x327, 0x15F}, {0x74, 0x307, 0x1E6B}, {0x74, 0x308, 0x1E97}, {0x74, 0x30C, 0x165}, {0x74, 0x323, 0x1E6D},
+    {0x74, 0x326, 0x21B}, {0x74, 0x327, 0x163}, {0x74, 0x32D, 0x1E71}, {0x74, 0x331, 0x1E6F}, {0x75, 0x300, 0xF9}, {0x75, 0x301, 0xFA},
+    {0x75, 0x302, 0xFB}, {0x75, 0x303, 0x169}, {0x75, 0x304, 0x16B}, {0x75, 0x306, 0x16D}, {0x75, 0x308, 0xFC}, {0x75, 0x309, 0x1EE7},
+    {0x75, 0x30A, 0x16F}, {0x75, 0x30B, 0x171}, {0x75, 0x30C, 0x1D4}, {0x75, 0x30F, 0x215}, {0x75, 0x311, 0x217}, {0x75, 0x31B, 0x1B0},
+    {0x75, 0x323, 0x1EE5}, {0x75, 0x324, 0x1E73}, {0x75, 0x328, 0x173}, {0x75, 0x32D, 0x1E77}, {0x75, 0x330, 0x1E75}, {0x76, 0x303, 0x1E7D},
+    {0x76, 0x323, 0x1E7F}, {0x77, 0x300, 0x1E81}, {0x77, 0x301, 0x1E83}, {0x77, 0x302, 0x175}, {0x77, 0x307, 0x1E87}, {0x77, 0x308, 0x1E85},
+    {0x77, 0x30A, 0x1E98}, {0x77, 0x323, 0x1E89}, {0x78, 0x307, 0x1E8B}, {0x78, 0x308, 0x1E8D}, {0x79, 0x300, 0x1EF3}, {0x79, 0x301, 0xFD},
+    {0x79, 0x302, 0x177}, {0x79, 0x303, 0x1EF9}, {0x79, 0x304, 0x233}, {0x79, 0x307, 0x1E8F}, {0x79, 0x308, 0xFF}, {0x79, 0x309, 0x1EF7},
+    {0x79, 0x30A, 0x1E99}, {0x79, 0x323, 0x1EF5}, {0x7A, 0x301, 0x17A}, {0x7A, 0x302, 0x1E91}, {0x7A, 0x307, 0x17C}, {0x7A, 0x30C, 0x17E},
+    {0x7A, 0x323, 0x1E93}, {0x7A, 0x331, 0x1E95}, {0xA8, 0x301, 0x385}, {0xC2, 0x300, 0x1EA6}, {0xC2, 0x301, 0x1EA4}, {0xC2, 0x303, 0x1EAA},
+    {0xC2, 0x309, 0x1EA8}, {0xC4, 0x304, 0x1DE}, {0xC5, 0x301, 0x1FA}, {0xC6, 0x301, 0x1FC}, {0xC6, 0x304, 0x1E2}, {0xC7, 0x301, 0x1E08},
+    {0xCA, 0x300, 0x1EC0}, {0xCA, 0x301, 0x1EBE}, {0xCA, 0x303, 0x1EC4}, {0xCA, 0x309, 0x1EC2}, {0xCF, 0x301, 0x1E2E}, {0xD4, 0x300, 0x1ED2},
+    {0xD4, 0x301, 0x1ED0}, {0xD4, 0x303, 0x1ED6}, {0xD4, 0x309, 0x1ED4}, {0xD5, 0x301, 0x1E4C}, {0xD5, 0x304, 0x22C}, {0xD5, 0x308, 0x1E4E},
+    {0xD6, 0x304, 0x22A}, {0xD8, 0x301, 0x1FE}, {0xDC, 0x300, 0x1DB}, {0xDC, 0x301, 0x1D7}, {0xDC, 0x304, 0x1D5}, {0xDC, 0x30C, 0x1D9},
+    {0xE2, 0x300, 0x1EA7}, {0xE2, 0x301, 0x1EA5}, {0xE2, 0x303, 0x1EAB}, {0xE2, 0x309, 0x1EA9}, {0xE4, 0x304, 0x1DF}, {0xE5, 0x301, 0x1FB},
+    {0xE6, 0x301, 0x1FD}, {0xE6, 0x304, 0x1E3}, {0xE7, 0x301, 0x1E09}, {0xEA, 0x300, 0x1EC1}, {0xEA, 0x301, 0x1EBF}, {0xEA, 0x303, 0x1EC5},
+    {0xEA, 0x309, 0x1EC3}, {0xEF, 0x301, 0x1E2F}, {0xF4, 0x300, 0x1ED3}, {0xF4, 0x301, 0x1ED1}, {0xF4, 0x303, 0x1ED7}, {0xF4, 0x309, 0x1ED5},
+    {0xF5, 0x301, 0x1E4D}, {0xF5, 0x304, 0x22D}, {0xF5, 0x308, 0x1E4F}, {0xF6, 0x304, 0x22B}, {0xF8, 0x301, 0x1FF}, {0xFC, 0x300, 0x1DC},
+    {0xFC, 0x301, 0x1D8}, {0xFC, 0x304, 0x1D6}, {0xFC, 0x30C, 0x1DA}, {0x102, 0x300, 0x1EB0}, {0x102, 0x301, 0x1EAE}, {0x102, 0x303, 0x1EB4},
+    {0x102, 0x309, 0x1EB2}, {0x103, 0x300, 0x1EB1}, {0x103, 0x301, 0x1EAF}, {0x103, 0x303, 0x1EB5}, {0x103, 0x309, 0x1EB3}, {0x112, 0x300, 0x1E14},
+    {0x112, 0x301, 0x1E16}, {0x113, 0x300, 0x1E15}, {0x113, 0x301, 0x1E17}, {0x14C, 0x300, 0x1E50}, {0x14C, 0x301, 0x1E52}, {0x14D, 0x300, 0x1E51},
+    {0x14D, 0x301, 0x1E53}, {0x15A, 0x307, 0x1E64}, {0x15B, 0x307, 0x1E65}, {0x160, 0x307, 0x1E66}, {0x161, 0x307, 0x1E67}, {0x168, 0x301, 0x1E78},
+    {0x169, 0x301, 0x1E79}, {0x16A, 0x308, 0x1E7A}, {0x16B, 0x308, 0x1E7B}, {0x17F, 0x307, 0x1E9B}, {0x1A0, 0x300, 0x1EDC}, {0x1A0, 0x301, 0x1EDA},
+    {0x1A0, 0x303, 0x1EE0}, {0x1A0, 0x309, 0x1EDE}, {0x1A0, 0x323, 0x1EE2}, {0x1A1, 0x300, 0x1EDD}, {0x1A1, 0x301, 0x1EDB}, {0x1A1, 0x303, 0x1EE1},
+    {0x1A1, 0x309, 0x1EDF}, {0x1A1, 0x323, 0x1EE3}, {0x1AF, 0x300, 0x1EEA}, {0x1AF, 0x301, 0x1EE8}, {0x1AF, 0x303, 0x1EEE}, {0x1AF, 0x309, 0x1EEC},
+    {0x1AF, 0x323, 0x1EF0}, {0x1B0, 0x300, 0x1EEB}, {0x1B0, 0x301, 0x1EE9}, {0x1B0, 0x303, 0x1EEF}, {0x1B0, 0x309, 0x1EED}, {0x1B0, 0x323, 0x1EF1},
+    {0x1B7, 0x30C, 0x1EE}, {0x1EA, 0x304, 0x1EC}, {0x1EB, 0x304, 0x1ED}, {0x226, 0x304, 0x1E0}, {0x227, 0x304, 0x1E1}, {0x228, 0x306, 0x1E1C},
+    {0x229, 0x306, 0x1E1D}, {0x22E, 0x304, 0x230}, {0x22F, 0x304, 0x231}, {0x292, 0x30C, 0x1EF}, {0x391, 0x301, 0x386}, {0x395, 0x301, 0x388},
+    {0x397, 0x301, 0x389}, {0x399, 0x301, 0x38A}, {0x399, 0x308, 0x3AA}, {0x39F, 0x301, 0x38C}, {0x3A5, 0x301, 0x38E}, {0x3A5, 0x308, 0x3AB},
+    {0x3A9, 0x301, 0x38F}, {0x3B1, 0x301, 0x3AC}, {0x3B5, 0x301, 0x3AD}, {0x3B7, 0x301, 0x3AE}, {0x3B9, 0x301, 0x3AF}, {0x3B9, 0x308, 0x3CA},
+    {0x3BF, 0x301, 0x3CC}, {0x3C5, 0x301, 0x3CD}, {0x3C5, 0x308, 0x3CB}, {0x3C9, 0x301, 0x3CE}, {0x3CA, 0x301, 0x390}, {0x3CB, 0x301, 0x3B0},
+    {0x3D2, 0x301, 0x3D3}, {0x3D2, 0x308, 0x3D4}, {0x406, 0x308, 0x407}, {0x410, 0x306, 0x4D0}, {0x410, 0x308, 0x4D2}, {0x413, 0x301, 0x403},
+    {0x415, 0x300, 0x400}, {0x415, 0x306, 0x4D6}, {0x415, 0x308, 0x401}, {0x416, 0x306, 0x4C1}, {0x416, 0x308, 0x4DC}, {0x417, 0x308, 0x4DE},
+    {0x418, 0x300, 0x40D}, {0x418, 0x304, 0x4E2}, {0x418, 0x306, 0x419}, {0x418, 0x308, 0x4E4}, {0x41A, 0x301, 0x40C}, {0x41E, 0x308, 0x4E6},
+    {0x423, 0x304, 0x4EE}, {0x423, 0x306, 0x40E}, {0x423, 0x308, 0x4F0}, {0x423, 0x30B, 0x4F2}, {0x427, 0x308, 0x4F4}, {0x42B, 0x308, 0x4F8},
+    {0x42D, 0x308, 0x4EC}, {0x430, 0x306, 0x4D1}, {0x430, 0x308, 0x4D3}, {0x433, 0x301, 0x453}, {0x435, 0x300, 0x450}, {0x435, 0x306, 0x4D7},
+    {0x435, 0x308, 0x451}, {0x436, 0x306, 0x4C2}, {0x436, 0x308, 0x4DD}, {0x437, 0x308, 0x4DF}, {0x438, 0x300, 0x45D}, {0x438, 0x304, 0x4E3},
+    {0x438, 0x306, 0x439}, {0x438, 0x308, 0x4E5}, {0x43A, 0x301, 0x45C}, {0x43E, 0x308, 0x4E7}, {0x443, 0x304, 0x4EF}, {0x443, 0x306, 0x45E},
+    {0x443, 0x308, 0x4F1}, {0x443, 0x30B, 0x4F3}, {0x447, 0x308, 0x4F5}, {0x44B, 0x308, 0x4F9}, {0x44D, 0x308, 0x4ED}, {0x456, 0x308, 0x457},
+    {0x474, 0x30F, 0x476}, {0x475, 0x30F, 0x477}, {0x4D8, 0x308, 0x4DA}, {0x4D9, 0x308, 0x4DB}, {0x4E8, 0x308, 0x4EA}, {0x4E9, 0x308, 0x4EB},
+    {0x1E36, 0x304, 0x1E38}, {0x1E37, 0x304, 0x1E39}, {0x1E5A, 0x304, 0x1E5C}, {0x1E5B, 0x304, 0x1E5D}, {0x1E62, 0x307, 0x1E68}, {0x1E63, 0x307, 0x1E69},
+    {0x1EA0, 0x302, 0x1EAC}, {0x1EA0, 0x306, 0x1EB6}, {0x1EA1, 0x302, 0x1EAD}, {0x1EA1, 0x306, 0x1EB7}, {0x1EB8, 0x302, 0x1EC6}, {0x1EB9, 0x302, 0x1EC7},
+    {0x1ECC, 0x302, 0x1ED8}, {0x1ECD, 0x302, 0x1ED9},
+};
+
+char32_t composeCodePoints(char32_t first, char32_t second) {
+    constexpr char32_t kHangulBase = 0xAC00;
+    constexpr char32_t kLeadBase = 0x1100;
+    constexpr char32_t kVowelBase = 0x1161;
+    constexpr char32_t kTrailBase = 0x11A7;
+    if (first >= kLeadBase && first < kLeadBase + 19 && second >= kVowelBase && second < kVowelBase + 21) {
+        return kHangulBase + ((first - kLeadBase) * 21 + (second - kVowelBase)) * 28;
+    }
+    if (first >= kHangulBase && first < kHangulBase + 11172 && (first - kHangulBase) % 28 == 0
+        && second > kTrailBase && second < kTrailBase + 28) {
+        return first + (second - kTrailBase);
+    }
+
+    const auto *end = std::end(kUnicodeCompositions);
+    const auto *it = std::lower_bound(std::begin(kUnicodeCompositions), end, UnicodeComposition {first, second, 0},
+                                      [](const UnicodeComposition &lhs, const UnicodeComposition &rhs) {
+                                          return lhs.first != rhs.first ? lhs.first < rhs.first : lhs.second < rhs.second;
+                                      });
+    return (it != end && it->first == first && it->second == second) ? it->composed : 0;
+}
+
+// Canonical combining class of the combining diacritical marks (U+0300-U+036F) and the Cyrillic
+// titlo marks, which are the marks the composition table uses. Anything else counts as a starter.
+unsigned combiningClass(char32_t c) {
+    if (c >= 0x483 && c <= 0x487) {
+        return 230;
+    }
+    if (c < 0x300 || c > 0x36F) {
+        return 0;
+    }
+    struct ClassRange {
+        char32_t last;
+        unsigned combiningClass;
+    };
+    static constexpr ClassRange kRanges[] = {
+        {0x314, 230}, {0x315, 232}, {0x319, 220}, {0x31A, 232}, {0x31B, 216}, {0x320, 220}, {0x322, 202}, {0x326, 220},
+        {0x328, 202}, {0x333, 220}, {0x338, 1}, {0x33C, 220}, {0x344, 230}, {0x345, 240}, {0x346, 230}, {0x349, 220},
+        {0x34C, 230}, {0x34E, 220}, {0x34F, 0}, {0x352, 230}, {0x356, 220}, {0x357, 230}, {0x358, 232}, {0x35A, 220},
+        {0x35B, 230}, {0x35C, 233}, {0x35E, 234}, {0x35F, 233}, {0x361, 234}, {0x362, 233}, {0x36F, 230},
+    };
+    const auto *range = std::lower_bound(std::begin(kRanges), std::end(kRanges), c,
+                                         [](const ClassRange &lhs, char32_t value) { return lhs.last < value; });
+    return range->combiningClass;
+}
+
+// Appends the canonical decomposition of `c`: Hangul syllables arithmetically, everything else by
+// reading the composition table backwards, recursively, so that U+1EC7 becomes e, U+0323, U+0302.
+void appendDecomposed(char32_t c, std::u32string &codePoints) {
+    constexpr char32_t kHangulBase = 0xAC00;
+    if (c >= kHangulBase && c < kHangulBase + 11172) {
+        const char32_t index = c - kHangulBase;
+        codePoints.push_back(0x1100 + index / (21 * 28));
+        codePoints.push_back(0x1161 + (index % (21 * 28)) / 28);
+        if (index % 28 != 0) {
+            codePoints.push_back(0x11A7 + index % 28);
+        }
+        return;
+    }
+    if (c < 0xC0) {
+        codePoints.push_back(c);
+        return;
+    }
+
+    static const std::vector<UnicodeComposition> byComposed = [] {
+        std::vector<UnicodeComposition> table(std::begin(kUnicodeCompositions), std::end(kUnicodeCompositions));
+        std::sort(table.begin(), table.end(), [](const UnicodeComposition &lhs, const UnicodeComposition &rhs) {
+            return lhs.composed < rhs.composed;
+        });
+        return table;
+    }();
+    auto it = std::lower_bound(byComposed.begin(), byComposed.end(), c,
+                               [](const UnicodeComposition &lhs, char32_t value) { return lhs.composed < value; });
+    if (it == byComposed.end() || it->composed != c) {
+        codePoints.push_back(c);
+        return;
+    }
+    appendDecomposed(it->first, codePoints);
+    codePoints.push_back(it->second);
+}
+
+// Composes in place the way NFC does: decomposes, puts each run of combining marks in canonical order
+// and then lets every mark combine with the last starter unless a mark of the same or a higher class
+// sits between them. This makes "e, U+0302, U+0323" and "e, U+0323, U+0302" both come out as U+1EC7.
+void composeInPlace(std::u32string &codePoints) {
+    std::u32string decomposed;
+    decomposed.reserve(codePoints.size() + 4);
+    for (char32_t c : codePoints) {
+        appendDecomposed(c, decomposed);
+    }
+    for (std::size_t start = 0; start < decomposed.size();) {
+        if (combiningClass(decomposed[start]) == 0) {
+            ++start;
+            continue;
+        }
+        std::size_t end = start + 1;
+        while (end < decomposed.size() && combiningClass(decomposed[end]) != 0) {
+            ++end;
+        }
+        std::stable_sort(decomposed.begin() + static_cast<std::ptrdiff_t>(start), decomposed.begin() + static_cast<std::ptrdiff_t>(end),
+                         [](char32_t lhs, char32_t rhs) { return combiningClass(lhs) < combiningClass(rhs); });
+        start = end;
+    }
+
+    codePoints.clear();
+    std::size_t starter = std::u32string::npos;
+    // 0 while the previous code point is the starter itself; 256 before any starter has been seen.
+    unsigned lastClass = 256;
+    for (char32_t c : decomposed) {
+        const unsigned currentClass = combiningClass(c);
+        if (starter != std::u32string::npos && (lastClass == 0 || lastClass < currentClass)) {
+            char32_t composed = composeCodePoints(codePoints[starter], c);
+            if (composed != 0) {
+                codePoints[starter] = composed;
+                continue;
+            }
+        }
+        if (currentClass == 0) {
+            starter = codePoints.size();
+        }
+        lastClass = currentClass;
+        codePoints.push_back(c);
+    }
+}
+
+// Simple case folding for the Latin, Greek and Cyrillic blocks; other code points are returned as is.
+// U+0130 (capital I with dot above) folds to a plain i, as Windows and macOS treat it.
+char32_t foldCodePoint(char32_t c) {
+    if (c < 0x80) {
+        return (c >= 'A' && c <= 'Z') ? c + 0x20 : c;
+    }
+    if (c == 0x130) {
+        return 0x69;
+    }
+    if ((c >= 0xC0 && c <= 0xDE && c != 0xD7) || (c >= 0x391 && c <= 0x3AB && c != 0x3A2) || (c >= 0x410 && c <= 0x42F)) {
+        return c + 0x20;
+    }
+    if (c >= 0x400 && c <= 0x40F) {
+        return c + 0x50;
+    }
+    if (c == 0x178) {
+        return 0xFF;
+    }
+    if (c == 0x386) {
+        return 0x3AC;
+    }
+    if (c >= 0x388 && c <= 0x38A) {
+        return c + 0x25;
+    }
+    if (c == 0x38C) {
+        return 0x3CC;
+    }
+    if (c == 0x38E || c == 0x38F) {
+        return c + 0x3F;
+    }
+    bool evenUpper = (c >= 0x100 && c <= 0x137) || (c >= 0x14A && c <= 0x177) || (c >= 0x460 && c <= 0x481)
+                     || (c >= 0x48A && c <= 0x4BF) || (c >= 0x4D0 && c <= 0x4FF) || (c >= 0x1E00 && c <= 0x1E95)
+                     || (c >= 0x1EA0 && c <= 0x1EFF);
+    bool oddUpper = (c >= 0x139 && c <= 0x148) || (c >= 0x179 && c <= 0x17E);
+    if ((evenUpper && c % 2 == 0) || (oddUpper && c % 2 == 1)) {
+        return c + 1;
+    }
+    return c;
+}
+
+// True when every code unit is below 0x80; checks 16 bytes per step where SSE2 is available.
+bool isAsciiName(PathStringView name) {
+    std::size_t i = 0;
+#if defined(__SSE2__) || defined(_M_X64) || defined(_M_AMD64)
+    constexpr std::size_t kUnitsPerBlock = 16 / sizeof(PathString::value_type);
+    for (; i + kUnitsPerBlock <= name.size(); i += kUnitsPerBlock) {
+        __m128i block = _mm_loadu_si128(reinterpret_cast<const __m128i *>(name.data() + i));
+        if constexpr (sizeof(PathString::value_type) == 1) {
+            if (_mm_movemask_epi8(block) != 0) {
+                return false;
+            }
+        } else {
+            __m128i high = _mm_and_si128(block, _mm_set1_epi16(static_cast<short>(0xFF80)));
+            if (_mm_movemask_epi8(_mm_cmpeq_epi16(high, _mm_setzero_si128())) != 0xFFFF) {
+                return false;
+            }
+        }
+    }
+#endif
+    for (; i < name.size(); ++i) {
+        if (static_cast<std::make_unsigned_t<PathString::value_type>>(name[i]) >= 0x80) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Lower-cases ASCII letters in place, 16 bytes per step where SSE2 is available.
+void foldAsciiInPlace(PathString &name) {
+    std::size_t i = 0;
+#if defined(__SSE2__) || defined(_M_X64) || defined(_M_AMD64)
+    constexpr std::size_t kUnitsPerBlock = 16 / sizeof(PathString::value_type);
+    for (; i + kUnitsPerBlock <= name.size(); i += kUnitsPerBlock) {
+        auto *address = reinterpret_cast<__m128i *>(name.data() + i);
+        __m128i block = _mm_loadu_si128(address);
+        __m128i upper;
+        __m128i offset;
+        if constexpr (sizeof(PathString::value_type) == 1) {
+            upper = _mm_and_si128(_mm_cmpgt_epi8(block, _mm_set1_epi8('A' - 1)), _mm_cmplt_epi8(block, _mm_set1_epi8('Z' + 1)));
+            offset = _mm_set1_epi8(0x20);
+        } else {
+            upper = _mm_and_si128(_mm_cmpgt_epi16(block, _mm_set1_epi16('A' - 1)), _mm_cmplt_epi16(block, _mm_set1_epi16('Z' + 1)));
+            offset = _mm_set1_epi16(0x20);
+        }
+        _mm_storeu_si128(address, _mm_add_epi8(block, _mm_and_si128(upper, offset)));
+    }
+#endif
+    for (; i < name.size(); ++i) {
+        if (name[i] >= 'A' && name[i] <= 'Z') {
+            name[i] = static_cast<PathString::value_type>(name[i] + 0x20);
+        }
+    }
+}
+
+// Decodes the native encoding (UTF-16 on Windows, UTF-8 elsewhere). Returns false on malformed input,
+// including overlong UTF-8 forms such as C0 AF, which would otherwise decode to '/'.
+bool decodeName(PathStringView name, std::u32string &codePoints) {
+    codePoints.clear();
+    for (std::size_t i = 0; i < name.size();) {
+#ifdef _WIN32
+        char32_t unit = static_cast<char16_t>(name[i++]);
+        if (unit >= 0xD800 && unit <= 0xDBFF) {
+            if (i >= name.size() || name[i] < 0xDC00 || name[i] > 0xDFFF) {
+                return false;
+            }
+            unit = 0x10000 + ((unit - 0xD800) << 10) + (static_cast<char16_t>(name[i++]) - 0xDC00);
+        } else if (unit >= 0xDC00 && unit <= 0xDFFF) {
+            return false;
+        }
+        codePoints.push_back(unit);
+#else
+        auto lead = static_cast<unsigned char>(name[i]);
+        std::size_t length = lead < 0x80 ? 1 : validUtf8Length(name, i);
+        if (length == 0) {
+            return false;
+        }
+        char32_t value = length == 1 ? lead : (lead & (0x7F >> length));
+        for (std::size_t k = 1; k < length; ++k) {
+            value = (value << 6) | (static_cast<unsigned char>(name[i + k]) & 0x3F);
+        }
+        codePoints.push_back(value);
+        i += length;
+#endif
+    }
+    return true;
+}
+
+PathString encodeName(const std::u32string &codePoints) {
+    PathString name;
+    name.reserve(codePoints.size());
+    for (char32_t c : codePoints) {
+#ifdef _WIN32
+        if (c >= 0x10000) {
+            name.push_back(static_cast<wchar_t>(0xD800 + ((c - 0x10000) >> 10)));
+            name.push_back(static_cast<wchar_t>(0xDC00 + ((c - 0x10000) & 0x3FF)));
+        } else {
+            name.push_back(static_cast<wchar_t>(c));
+        }
+#else
+        if (c < 0x80) {
+            name.push_back(static_cast<char>(c));
+        } else if (c < 0x800) {
+            name.push_back(static_cast<char>(0xC0 | (c >> 6)));
+            name.push_back(static_cast<char>(0x80 | (c & 0x3F)));
+        } else if (c < 0x10000) {
+            name.push_back(static_cast<char>(0xE0 | (c >> 12)));
+            name.push_back(static_cast<char>(0x80 | ((c >> 6) & 0x3F)));
+            name.push_back(static_cast<char>(0x80 | (c & 0x3F)));
+        } else {
+            name.push_back(static_cast<char>(0xF0 | (c >> 18)));
+            name.push_back(static_cast<char>(0x80 | ((c >> 12) & 0x3F)));
+            name.push_back(static_cast<char>(0x80 | ((c >> 6) & 0x3F)));
+            name.push_back(static_cast<char>(0x80 | (c & 0x3F)));
+        }
+#endif
+    }
+    return name;
+}
+
+// Composes to NFC and/or case-folds a name. Pure ASCII names, by far the common case, never leave the
+// vectorised path; malformed names are only ASCII-folded.
+PathString normaliseName(PathStringView name, bool compose, bool foldCase) {
+    PathString result(name);
+    if (!compose && !foldCase) {
+        return result;
+    }
+    if (isAsciiName(name)) {
+        if (foldCase) {
+            foldAsciiInPlace(result);
+        }
+        return result;
+    }
+
+    std::u32string codePoints;
+    if (!decodeName(name, codePoints)) {
+        if (foldCase) {
+            foldAsciiInPlace(result);
+        }
+        return result;
+    }
+
+    if (compose) {
+        composeInPlace(codePoints);
+    }
+    if (foldCase) {
+        for (char32_t &c : codePoints) {
+            c = foldCodePoint(c);
+        }
+    }
+    return encodeName(codePoints);
+}
+
+// The string grouping decisions compare: the name itself, or its folded form when the volume
+// ignores case.
+PathString comparisonKey(PathStringView name, const Settings &options) {
+    return normaliseName(name, options.composeUnicode, options.foldCase);
+}
+
+// Turns the --fold-names setting into concrete switches for the directory being processed.
+Settings resolveNameFolding(Settings options, const fs::path &directory) {
+    switch (options.nameFolding) {
+    case NameFolding::Off:
+        break;
+    case NameFolding::On:
+        options.composeUnicode = true;
+        options.foldCase = true;
+        break;
+    case NameFolding::Auto:
+        options.composeUnicode = true;
+        options.foldCase = options.fileSystem->isCaseInsensitive(directory.empty() ? fs::path(".") : directory);
+        break;
+    }
+    return options;
+}
+
+// The stem every grouping mode works from, after the optional copy-suffix and NFC normalisation.
+PathString groupingStem(const fs::path &file, const Settings &options) {
+    PathStringView stem = stemOf(filenameOf(file), options);
+    if (options.stripCopySuffixes) {
+        stem = stripCopySuffixes(stem, options.copyMarkers);
+    }
+    return normaliseName(stem, options.composeUnicode, false);
+}
+
+bool isSequenceSeparator(PathString::value_type c) {
+    return c == '.' || c == '_' || c == '-' || c == ' ';
+}
+
+// Splits a stem such as "shot_010.0001" around its last run of digits (the frame number) and returns
+// the non-numeric remainder as a folder name ("shot_010"). Stems without a frame number, or with
+// nothing but separators around it, yield an empty string.
+PathString sequenceFolderName(PathStringView stem) {
+    std::size_t tokenEnd = stem.size();
+    while (tokenEnd > 0 && !isAsciiDigit(stem[tokenEnd - 1])) {
+        --tokenEnd;
+    }
+    std::size_t tokenBegin = tokenEnd;
+    while (tokenBegin > 0 && isAsciiDigit(stem[tokenBegin - 1])) {
+        --tokenBegin;
+    }
+    if (tokenBegin == tokenEnd) {
+        return {};
+    }
+
+    std::size_t prefixEnd = tokenBegin;
+    while (prefixEnd > 0 && isSequenceSeparator(stem[prefixEnd - 1])) {
+        --prefixEnd;
+    }
+    std::size_t suffixBegin = tokenEnd;
+    if (prefixEnd == 0) {
+        while (suffixBegin < stem.size() && isSequenceSeparator(stem[suffixBegin])) {
+            ++suffixBegin;
+        }
+    }
+
+    PathString folder(stem.substr(0, prefixEnd));
+    folder.append(stem.substr(suffixBegin));
+    return folder;
+}
+
+// Groups numbered frames by their non-numeric remainder. Each name is parsed exactly once; a remainder
+// only becomes a sequence folder when at least two files (with the same extension) share it, so a
+// lone "report2024.pdf" keeps its usual stem folder.
+std::vector<MoveRequest> planSequenceMoves(const std::vector<fs::path> &files, const Settings &options) {
+    struct ParsedName {
+        fs::path parent;
+        PathString stem;
+        PathString sequenceFolder;
+        PathString sequenceKey;
+    };
+
+    std::vector<ParsedName> parsed;
+    parsed.reserve(files.size());
+    std::unordered_map<PathString, std::size_t> frameCounts;
+    frameCounts.reserve(files.size());
+
+    for (const auto &file : files) {
+        ParsedName name {file.parent_path(), groupingStem(file, options), {}, {}};
+        name.sequenceFolder = sequenceFolderName(name.stem);
+        if (!name.sequenceFolder.empty()) {
+            name.sequenceKey = name.parent.native();
+            name.sequenceKey.push_back(fs::path::preferred_separator);
+            name.sequenceKey.append(name.sequenceFolder);
+            name.sequenceKey.push_back(fs::path::preferred_separator);
+            PathStringView filename = filenameOf(file);
+            name.sequenceKey.append(filename.substr(stemOf(filename, options).size()));
+            name.sequenceKey = comparisonKey(name.sequenceKey, options);
+            ++frameCounts[name.sequenceKey];
+        }
+        parsed.push_back(std::move(name));
+    }
+
+    std::vector<MoveRequest> plan;
+    plan.reserve(files.size());
+    for (std::size_t i = 0; i < files.size(); ++i) {
+        const ParsedName &name = parsed[i];
+        bool inSequence = !name.sequenceKey.empty() && frameCounts[name.sequenceKey] > 1;
+        plan.push_back({files[i], name.parent / (inSequence ? name.sequenceFolder : name.stem)});
+    }
+    return plan;
+}
+
+// Attaches names that extend another stem at a delimiter ("IMG_0001_edit", "IMG_0001-1") to the folder
+// of the shortest such base stem ("IMG_0001"). Stems are indexed by their FNV-1a hash, which is built
+// incrementally, so the hash of every prefix is available while walking a name once and the whole
+// grouping costs O(total name bytes).
+std::vector<MoveRequest> planPrefixMoves(const std::vector<fs::path> &files, const Settings &options) {
+    const PathStringView delimiters = options.prefixDelimiters;
+    struct StemEntry {
+        std::size_t parentIndex;
+        PathString stem;
+        PathString key;
+    };
+
+    const auto seed = [](std::size_t parentIndex) {
+        return kFnvOffsetBasis ^ (static_cast<std::uint64_t>(parentIndex) * 0x9E3779B97F4A7C15ull);
+    };
+
+    std::unordered_map<PathString, std::size_t> parentIndices;
+    std::vector<fs::path> parents;
+    std::vector<StemEntry> entries;
+    entries.reserve(files.size());
+    std::unordered_multimap<std::uint64_t, std::size_t> stemIndex;
+    stemIndex.reserve(files.size());
+
+    for (const auto &file : files) {
+        fs::path parent = file.parent_path();
+        auto [it, inserted] = parentIndices.emplace(parent.native(), parents.size());
+        if (inserted) {
+            parents.push_back(std::move(parent));
+        }
+
+        StemEntry entry {it->second, groupingStem(file, options), {}};
+        entry.key = comparisonKey(entry.stem, options);
+        std::uint64_t hash = seed(entry.parentIndex);
+        for (auto c : entry.key) {
+            hash = (hash ^ static_cast<std::uint64_t>(c)) * kFnvPrime;
+        }
+        stemIndex.emplace(hash, entries.size());
+        entries.push_back(std::move(entry));
+    }
+
+    std::vector<MoveRequest> plan;
+    plan.reserve(files.size());
+    for (std::size_t i = 0; i < entries.size(); ++i) {
+        const StemEntry &entry = entries[i];
+        std::size_t base = i;
+        std::uint64_t hash = seed(entry.parentIndex);
+
+        for (std::size_t length = 0; length < entry.key.size() && base == i; ++length) {
+            if (length > 0 && delimiters.find(entry.key[length]) != PathStringView::npos) {
+                PathStringView prefix(entry.key.data(), length);
+                auto range = stemIndex.equal_range(hash);
+                for (auto it = range.first; it != range.second; ++it) {
+                    const StemEntry &candidate = entries[it->second];
+                    if (candidate.parentIndex == entry.parentIndex && candidate.key == prefix) {
+                        base = it->second;
+                        break;
+                    }
+                }
+            }
+            hash = (hash ^ static_cast<std::uint64_t>(entry.key[length])) * kFnvPrime;
+        }
+
+        plan.push_back({files[i], parents[entry.parentIndex] / entries[base].stem});
+    }
+    return plan;
+}
+
+// Works out the destination folder of every file according to the grouping mode. Files that cannot
+// be classified are reported and left out of the plan.
+std::vector<MoveRequest> planGroupedMoves(const std::vector<fs::path> &files, const Settings &options, Reporter &logger) {
+    std::vector<MoveRequest> plan;
+    plan.reserve(files.size());
+
+    if (options.grouping == GroupingMode::Sequence) {
+        return planSequenceMoves(files, options);
+    }
+
+    if (options.grouping == GroupingMode::Prefix) {
+        return planPrefixMoves(files, options);
+    }
+
+    if (options.grouping == GroupingMode::Content) {
+        auto categories = classifyFiles(files, *options.fileSystem, options.jobs, logger);
+        for (std::size_t i = 0; i < files.size(); ++i) {
+            if (categories[i]) {
+                plan.push_back({files[i], files[i].parent_path() / fs::u8path(contentCategoryFolderName(*categories[i]))});
+            }
+        }
+        return plan;
+    }
+
+    for (const auto &file : files) {
+        plan.push_back({file, file.parent_path() / groupingStem(file, options)});
+    }
+    return plan;
+}
+
+constexpr std::string_view kStemTemplate = "{stem}";
+constexpr std::string_view kExtensionThenStemTemplate = "{ext}/{stem}";
+
+// Compiles a --folder-template such as "{mtime:%Y}/{stem}" into an instruction list. Placeholders are
+// {stem} (the folder name the grouping mode chose), {ext} (lower-case extension) and {mtime:FORMAT}
+// (modification time formatted with strftime, "%Y-%m-%d" when no format is given).
+std::optional<FolderTemplate> compileFolderTemplate(PathStringView source, std::string &errorMessage) {
+    FolderTemplate compiled;
+    if (equalsIgnoringAsciiCase(source, kStemTemplate)) {
+        return compiled;
+    }
+    if (equalsIgnoringAsciiCase(source, kExtensionThenStemTemplate)) {
+        compiled.shape = TemplateShape::ExtensionThenStem;
+        return compiled;
+    }
+
+    if (source.empty() || source.front() == '/' || source.front() == '\\' || source.find(':') < source.find('{')) {
+        errorMessage = "Folder templates must be relative paths.";
+        return std::nullopt;
+    }
+
+    compiled.shape = TemplateShape::Compiled;
+    std::size_t position = 0;
+    while (position < source.size()) {
+        std::size_t open = source.find('{', position);
+        if (open != position) {
+            std::size_t end = open == PathStringView::npos ? source.size() : open;
+            PathString literal(source.substr(position, end - position));
+            if (literal.find(PATH_LITERAL("..")) != PathString::npos) {
+                errorMessage = "Folder templates must not contain '..'.";
+                return std::nullopt;
+            }
+            compiled.instructions.push_back({TemplateField::Literal, std::move(literal), {}});
+            position = end;
+            continue;
+        }
+
+        std::size_t close = source.find('}', open);
+        if (close == PathStringView::npos) {
+            errorMessage = "Unterminated placeholder in folder template.";
+            return std::nullopt;
+        }
+
+        PathStringView placeholder = source.substr(open + 1, close - open - 1);
+        PathStringView name = placeholder.substr(0, placeholder.find(':'));
+        if (equalsIgnoringAsciiCase(name, std::string_view("stem"))) {
+            compiled.instructions.push_back({TemplateField::Stem, {}, {}});
+        } else if (equalsIgnoringAsciiCase(name, std::string_view("ext"))) {
+            compiled.instructions.push_back({TemplateField::Extension, {}, {}});
+        } else if (equalsIgnoringAsciiCase(name, std::string_view("mtime"))) {
+            std::string format = "%Y-%m-%d";
+            if (name.size() < placeholder.size()) {
+                format = fs::path(PathString(placeholder.substr(name.size() + 1))).u8string();
+            }
+            compiled.instructions.push_back({TemplateField::ModifiedTime, {}, std::move(format)});
+            compiled.metadata |= kMetadataModifiedTime;
+        } else {
+            errorMessage = "Unknown placeholder in folder template: {" + displayName(placeholder) + "}";
+            return std::nullopt;
+        }
+        position = close + 1;
+    }
+
+    return compiled;
+}
+
+void appendFormattedTime(PathString &buffer, std::time_t time, const std::string &format) {
+    std::tm tm {};
+#ifdef _WIN32
+    localtime_s(&tm, &time);
+#else
+    localtime_r(&time, &tm);
+#endif
+    char formatted[128];
+    std::size_t length = std::strftime(formatted, sizeof(formatted), format.c_str(), &tm);
+    buffer.append(fs::u8path(std::string_view(formatted, length)).native());
+}
+
+void appendExtension(PathString &buffer, const fs::path &source, const Settings &options) {
+    PathStringView filename = filenameOf(source);
+    PathStringView extension = filename.substr(stemOf(filename, options).size());
+    if (!extension.empty() && extension.front() == '.') {
+        extension.remove_prefix(1);
+    }
+    if (extension.empty()) {
+        buffer.append(PATH_LITERAL("noext"));
+        return;
+    }
+    buffer.append(asciiLower(PathString(extension)));
+}
+
+// Rewrites each planned folder through the --folder-template. Every file is rendered into the same
+// buffer; metadata is fetched in parallel batches, and only when the template references it.
+void applyFolderTemplate(std::vector<MoveRequest> &plan, const Settings &options, Reporter &logger) {
+    const FolderTemplate &folderTemplate = options.folderTemplate;
+    if (folderTemplate.shape == TemplateShape::Stem) {
+        return;
+    }
+
+    std::vector<std::optional<FileMetadata>> metadata;
+    if (folderTemplate.metadata != kMetadataNone) {
+        constexpr std::size_t kBatchSize = 256;
+        metadata.resize(plan.size());
+        parallelFor((plan.size() + kBatchSize - 1) / kBatchSize, options.jobs, [&](std::size_t batch) {
+            std::string errorMessage;
+            std::size_t end = std::min(plan.size(), (batch + 1) * kBatchSize);
+            for (std::size_t i = batch * kBatchSize; i < end; ++i) {
+                FileMetadata fileMetadata;
+                if (options.fileSystem->readMetadata(plan[i].source, folderTemplate.metadata, fileMetadata, errorMessage)) {
+                    metadata[i] = fileMetadata;
+                } else {
+                    errorMessage = "Failed to read file attributes: " + errorMessage;
+                    logger.logError(plan[i].source, errorMessage);
+                    logger.emit(EventKind::Error, "Failed to read '" + displayPath(plan[i].source) + "': " + errorMessage, plan[i].source);
+                }
+            }
+        });
+    }
+
+    std::vector<MoveRequest> rendered;
+    rendered.reserve(plan.size());
+    PathString buffer;
+    for (std::size_t i = 0; i < plan.size(); ++i) {
+        MoveRequest &request = plan[i];
+        if (!metadata.empty() && !metadata[i]) {
+            continue;
+        }
+
+        PathStringView stem = filenameOf(request.destinationFolder);
+        buffer.clear();
+        if (folderTemplate.shape == TemplateShape::ExtensionThenStem) {
+            appendExtension(buffer, request.source, options);
+            buffer.push_back(fs::path::preferred_separator);
+            buffer.append(stem);
+        } else {
+            for (const auto &instruction : folderTemplate.instructions) {
+                switch (instruction.field) {
+                case TemplateField::Literal:
+                    buffer.append(instruction.literal);
+                    break;
+                case TemplateField::Stem:
+                    buffer.append(stem);
+                    break;
+                case TemplateField::Extension:
+                    appendExtension(buffer, request.source, options);
+                    break;
+                case TemplateField::ModifiedTime:
+                    appendFormattedTime(buffer, metadata[i]->modifiedTime, instruction.timeFormat);
+                    break;
+                }
+            }
+        }
+
+        request.destinationFolder.replace_filename(buffer);
+        rendered.push_back(std::move(request));
+    }
+    plan = std::move(rendered);
+}
+
+bool hasSidecarExtension(const fs::path &file, const std::vector<PathString> &sidecarExtensions) {
+    PathString extension = asciiLower(file.extension().native());
+    return std::find(sidecarExtensions.begin(), sidecarExtensions.end(), extension) != sidecarExtensions.end();
+}
+
+// splitmix64 finaliser, so that hashes of similar names share no visible prefix and spread evenly
+// over any number of shards.
+std::uint64_t mixHash(std::uint64_t hash) {
+    hash = (hash ^ (hash >> 30)) * 0xBF58476D1CE4E5B9ull;
+    hash = (hash ^ (hash >> 27)) * 0x94D049BB133111EBull;
+    return hash ^ (hash >> 31);
+}
+
+// --shard: whether a destination folder, relative to the folder being sorted, belongs to this
+// process. The name is composed, case-folded and hashed as UTF-8 whatever --fold-names says, so
+// processes on different platforms and mount points agree, and "Photo" and "photo" stay together.
+bool inShard(PathStringView folder, const Settings &options) {
+    if (options.shardCount <= 1) {
+        return true;
+    }
+    PathString key = normaliseName(folder, true, true);
+#ifdef _WIN32
+    std::replace(key.begin(), key.end(), L'\\', L'/');
+#endif
+    return mixHash(hashUtf8(fs::path(key).u8string())) % options.shardCount == options.shardIndex;
+}
+
+// Drops the moves whose folder belongs to another shard. Each shard plans the whole listing first, so
+// every file of a folder (its sidecars included) is on the same side of the cut.
+void keepShard(std::vector<MoveRequest> &plan, const Settings &options) {
+    if (options.shardCount <= 1) {
+        return;
+    }
+    plan.erase(std::remove_if(plan.begin(), plan.end(), [&options](const MoveRequest &request) {
+        PathStringView folder = request.destinationFolder.native();
+        PathStringView source = request.source.native();
+        PathStringView parent = source.substr(0, source.size() - filenameOf(request.source).size());
+        if (!parent.empty() && folder.substr(0, parent.size()) == parent) {
+            folder.remove_prefix(parent.size());
+        }
+        return !inShard(folder, options);
+    }), plan.end());
+}
+
+// True when `name` is one ordinary path component: not empty, "." or "..", and free of separators
+// and NUL, so joining it to a folder can only name a child of that folder.
+bool isPlainFolderName(PathStringView name) {
+    if (name.empty() || (name.size() == 1 && name[0] == '.') || (name.size() == 2 && name[0] == '.' && name[1] == '.')) {
+        return false;
+    }
+    return std::none_of(name.begin(), name.end(), [](PathString::value_type c) {
+        return c == 0 || c == '/' || c == fs::path::preferred_separator;
+    });
+}
+
+// Refuses the moves whose grouped folder name is not a plain child of the file's own folder. The
+// grouping modes build every destination as "parent / name", so anything else means a name that
+// would have escaped into another folder.
+void dropUnsafeFolders(std::vector<MoveRequest> &plan, Reporter &logger) {
+    plan.erase(std::remove_if(plan.begin(), plan.end(), [&logger](const MoveRequest &request) {
+        PathStringView folder = request.destinationFolder.native();
+        PathStringView source = request.source.native();
+        PathStringView parent = source.substr(0, source.size() - filenameOf(request.source).size());
+        if (folder.substr(0, parent.size()) == parent && isPlainFolderName(folder.substr(parent.size()))) {
+            return false;
+        }
+        logger.logError(request.source, "The folder name made from this file name is not a plain name; the file was left in place.");
+        logger.emit(EventKind::Error, "Cannot make a folder for '" + displayPath(request.source) + "': the name is not a plain folder name.",
+                    request.source);
+        return true;
+    }), plan.end());
+}
+
+// Routes each sidecar into the folder already chosen for its master. "photo.jpg.xmp" pairs with the
+// file named "photo.jpg"; "movie.srt" and "movie.en.srt" pair with any file whose stem is "movie".
+// Masters come from the same snapshot, so pairing is a few hash lookups and never probes the disk.
+void planSidecarMoves(std::vector<MoveRequest> &plan, const std::vector<fs::path> &sidecars, const Settings &options, Reporter &logger) {
+    std::unordered_map<PathString, std::size_t> mastersByName;
+    std::unordered_map<PathString, std::size_t> mastersByStem;
+    mastersByName.reserve(plan.size());
+    mastersByStem.reserve(plan.size());
+    for (std::size_t i = 0; i < plan.size(); ++i) {
+        const fs::path &source = plan[i].source;
+        mastersByName.emplace(comparisonKey(source.native(), options), i);
+        mastersByStem.emplace(comparisonKey((source.parent_path() / stemOf(filenameOf(source), options)).native(), options), i);
+    }
+
+    for (const auto &sidecar : sidecars) {
+        fs::path base = sidecar.parent_path() / sidecar.stem();
+        std::optional<std::size_t> master;
+        PathString baseKey = comparisonKey(base.native(), options);
+        if (auto it = mastersByName.find(baseKey); it != mastersByName.end()) {
+            master = it->second;
+        } else if (auto stemIt = mastersByStem.find(baseKey); stemIt != mastersByStem.end()) {
+            master = stemIt->second;
+        } else if (base.has_extension()) {
+            PathString outerKey = comparisonKey((base.parent_path() / base.stem()).native(), options);
+            if (auto outerIt = mastersByStem.find(outerKey); outerIt != mastersByStem.end()) {
+                master = outerIt->second;
+            }
+        }
+
+        if (!master) {
+            // Under --shard only the shard its own stem falls in reports it, so it is reported once.
+            if (inShard(stemOf(filenameOf(sidecar), options), options)) {
+                logger.logError(sidecar, "Sidecar has no matching master file and was left in place.");
+                logger.emit(EventKind::Error, "No master file found for sidecar: " + displayPath(sidecar), sidecar);
+            }
+            continue;
+        }
+
+        fs::path destinationFolder = plan[*master].destinationFolder;
+        plan.push_back({sidecar, std::move(destinationFolder)});
+    }
+}
+
+// Spells every destination folder the way it was first planned, so "Photo" and "photo" become one
+// batch instead of two workers racing to create the same folder on a case-insensitive volume.
+void unifyFolderSpellings(std::vector<MoveRequest> &plan, const Settings &options) {
+    if (!options.foldCase) {
+        return;
+    }
+    std::unordered_map<PathString, std::size_t> firstSpelling;
+    firstSpelling.reserve(plan.size());
+    for (std::size_t i = 0; i < plan.size(); ++i) {
+        auto [it, inserted] = firstSpelling.emplace(comparisonKey(plan[i].destinationFolder.native(), options), i);
+        if (!inserted) {
+            plan[i].destinationFolder = plan[it->second].destinationFolder;
+        }
+    }
+}
+
+// Works out the destination folder of every file and renders it through the folder template. When
+// sidecar pairing is enabled, sidecars are held back from the grouping rule and follow their master.
+std::vector<MoveRequest> planMoves(const std::vector<fs::path> &files, const Settings &options, Reporter &logger) {
+    if (options.sidecarExtensions.empty()) {
+        std::vector<MoveRequest> plan = planGroupedMoves(files, options, logger);
+        dropUnsafeFolders(plan, logger);
+        applyFolderTemplate(plan, options, logger);
+        unifyFolderSpellings(plan, options);
+        keepShard(plan, options);
+        return plan;
+    }
+
+    std::vector<fs::path> masters;
+    std::vector<fs::path> sidecars;
+    masters.reserve(files.size());
+    for (const auto &file : files) {
+        (hasSidecarExtension(file, options.sidecarExtensions) ? sidecars : masters).push_back(file);
+    }
+
+    std::vector<MoveRequest> plan = planGroupedMoves(masters, options, logger);
+    dropUnsafeFolders(plan, logger);
+    applyFolderTemplate(plan, options, logger);
+    unifyFolderSpellings(plan, options);
+    planSidecarMoves(plan, sidecars, options, logger);
+    keepShard(plan, options);
+    return plan;
+}
+
+// Collects what a run produced for --exec-batch and hands it to the command in as few invocations
+// as the system's argument length limit allows, running up to `jobs` of them at a time.
+class PostMoveHook {
+public:
+    explicit PostMoveHook(CommandTemplate command)
+        : command_(std::move(command))
+    {
+    }
+
+    void add(const fs::path &folder, const fs::path &file) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        arguments_.push_back(command_.passFiles ? file.native() : folder.native());
+    }
+
+    bool run(unsigned jobs, Reporter &logger) {
+        std::sort(arguments_.begin(), arguments_.end());
+        arguments_.erase(std::unique(arguments_.begin(), arguments_.end()), arguments_.end());
+        if (arguments_.empty()) {
+            return true;
+        }
+
+        std::size_t fixedSize = 0;
+        for (const auto &word : command_.before) {
+            fixedSize += argumentSize(word);
+        }
+        for (const auto &word : command_.after) {
+            fixedSize += argumentSize(word);
+        }
+        const std::size_t limit = argumentSpace();
+
+        // [start, end) ranges of arguments_, one per invocation.
+        std::vector<std::pair<std::size_t, std::size_t>> invocations;
+        std::size_t used = fixedSize;
+        for (std::size_t i = 0; i < arguments_.size(); ++i) {
+            std::size_t size = argumentSize(arguments_[i]);
+            if (invocations.empty() || used + size > limit) {
+                invocations.emplace_back(i, i);
+                used = fixedSize;
+            }
+            invocations.back().second = i + 1;
+            used += size;
+        }
+
+        // The children inherit our standard output, so anything still buffered goes first.
+        std::fflush(nullptr);
+        std::atomic<bool> allSucceeded {true};
+        parallelFor(invocations.size(), jobs, [&](std::size_t index) {
+            auto [start, end] = invocations[index];
+            std::vector<PathString> argv(command_.before);
+            argv.insert(argv.end(), arguments_.begin() + static_cast<std::ptrdiff_t>(start), arguments_.begin() + static_cast<std::ptrdiff_t>(end));
+            argv.insert(argv.end(), command_.after.begin(), command_.after.end());
+
+            std::string errorMessage;
+            if (!runCommand(argv, errorMessage)) {
+                std::string message = "Hook command failed for " + std::to_string(end - start) + (command_.passFiles ? " file(s): " : " folder(s): ") +
+                                      errorMessage;
+                logger.logError(fs::path(arguments_[start]), message);
+                logger.emit(EventKind::Error, message + " (first: '" + displayName(arguments_[start]) + "')", fs::path(arguments_[start]));
+                allSucceeded.store(false);
+            }
+        });
+        return allSucceeded.load();
+    }
+
+private:
+#ifdef _WIN32
+    // CreateProcessW takes a single command line of at most 32767 characters.
+    static std::size_t argumentSize(const PathString &argument) {
+        return quoteArgument(argument).size() + 1;
+    }
+
+    static std::size_t argumentSpace() {
+        return 32767 - 1024;
+    }
+
+    // Quotes an argument so that CommandLineToArgvW and the C runtime read it back unchanged.
+    static std::wstring quoteArgument(const std::wstring &argument) {
+        if (!argument.empty() && argument.find_first_of(L" \t\n\v\"") == std::wstring::npos) {
+            return argument;
+        }
+        std::wstring quoted = L"\"";
+        std::size_t backslashes = 0;
+        for (wchar_t c : argument) {
+            if (c == L'\\') {
+                ++backslashes;
+                continue;
+            }
+            quoted.append(c == L'"' ? backslashes * 2 + 1 : backslashes, L'\\');
+            backslashes = 0;
+            quoted.push_back(c);
+        }
+        quoted.append(backslashes * 2, L'\\');
+        quoted.push_back(L'"');
+        return quoted;
+    }
+
+    static bool runCommand(const std::vector<PathString> &argv, std::string &errorMessage) {
+        std::wstring commandLine;
+        for (const auto &argument : argv) {
+            if (!commandLine.empty()) {
+                commandLine.push_back(L' ');
+            }
+            commandLine += quoteArgument(argument);
+        }
+        STARTUPINFOW startup {};
+        startup.cb = sizeof(startup);
+        PROCESS_INFORMATION process {};
+        if (!CreateProcessW(nullptr, commandLine.data(), nullptr, nullptr, FALSE, CREATE_NO_WINDOW, nullptr, nullptr, &startup, &process)) {
+            errorMessage = "Unable to start the command: " + windowsErrorMessage(GetLastError());
+            return false;
+        }
+        CloseHandle(process.hThread);
+        WaitForSingleObject(process.hProcess, INFINITE);
+        DWORD exitCode = 0;
+        GetExitCodeProcess(process.hProcess, &exitCode);
+        CloseHandle(process.hProcess);
+        if (exitCode != 0) {
+            errorMessage = "The command exited with status " + std::to_string(exitCode);
+            return false;
+        }
+        return true;
+    }
+#else
+    // execve counts each string with its terminator plus its pointer in argv.
+    static std::size_t argumentSize(const PathString &argument) {
+        return argument.size() + 1 + sizeof(char *);
+    }
+
+    // ARG_MAX covers the arguments and the environment together; keep some headroom like xargs does.
+    static std::size_t argumentSpace() {
+        long argMax = ::sysconf(_SC_ARG_MAX);
+        std::size_t space = argMax > 0 ? static_cast<std::size_t>(argMax) : 131072;
+        for (char **variable = environ; *variable != nullptr; ++variable) {
+            space -= std::min(space, std::strlen(*variable) + 1 + sizeof(char *));
+        }
+        return space > 4096 ? space - 4096 : 0;
+    }
+
+    static bool runCommand(const std::vector<PathString> &argv, std::string &errorMessage) {
+        std::vector<char *> pointers;
+        pointers.reserve(argv.size() + 1);
+        for (const auto &argument : argv) {
+            pointers.push_back(const_cast<char *>(argument.c_str()));
+        }
+        pointers.push_back(nullptr);
+
+        pid_t child = 0;
+        int error = ::posix_spawnp(&child, pointers[0], nullptr, nullptr, pointers.data(), environ);
+        if (error != 0) {
+            errorMessage = "Unable to start the command: " + std::generic_category().message(error);
+            return false;
+        }
+        int status = 0;
+        while (::waitpid(child, &status, 0) < 0) {
+            if (errno != EINTR) {
+                errorMessage = "Unable to wait for the command: " + std::generic_category().message(errno);
+                return false;
+            }
+        }
+        if (WIFSIGNALED(status)) {
+            errorMessage = "The command was terminated by signal " + std::to_string(WTERMSIG(status));
+            return false;
+        }
+        if (WEXITSTATUS(status) != 0) {
+            errorMessage = "The command exited with status " + std::to_string(WEXITSTATUS(status));
+            return false;
+        }
+        return true;
+    }
+#endif
+
+    CommandTemplate command_;
+    std::mutex mutex_;
+    std::vector<PathString> arguments_;
+};
+
+struct ExecutionSummary {
+    std::size_t moved = 0;
+    // Files whose link was already in place; with --link, a plan made only of these changes nothing.
+    std::size_t alreadyLinked = 0;
+    // Set when the budget ran out: every file named before this one has been handled.
+    std::optional<PathString> resumeFrom;
+};
+
+// Reserves room for a batch of `size` files under --max-files. `claimed` is shared by every group of
+// the run, so the limit holds for the run as a whole. The first batch of the run is always allowed,
+// however large, so that a run always makes progress.
+bool claimFileBudget(std::atomic<std::size_t> &claimed, std::size_t size, std::size_t maxFiles) {
+    std::size_t current = claimed.load();
+    do {
+        if (current != 0 && current + size > maxFiles) {
+            return false;
+        }
+    } while (!claimed.compare_exchange_weak(current, current + size));
+    return true;
+}
+
+// Executes the plan with one batch per destination folder, so a folder is only ever created by a
+// single worker. Under a budget, batches are admitted strictly in order of their first file name and
+// admission stops at the first batch the budget refuses, so the unfinished part of the plan is a
+// suffix of that order and can be resumed by name.
+ExecutionSummary executeMoves(std::vector<MoveRequest> plan, const Settings &options, PostMoveHook *hook, std::atomic<std::size_t> &claimedFiles,
+                              Reporter &logger) {
+    std::stable_sort(plan.begin(), plan.end(), [](const MoveRequest &lhs, const MoveRequest &rhs) {
+        return lhs.destinationFolder < rhs.destinationFolder;
+    });
+
+    std::vector<std::size_t> batchStarts;
+    for (std::size_t i = 0; i < plan.size(); ++i) {
+        if (i == 0 || plan[i].destinationFolder != plan[i - 1].destinationFolder) {
+            batchStarts.push_back(i);
+        }
+    }
+    batchStarts.push_back(plan.size());
+    const std::size_t batchCount = batchStarts.size() - 1;
+
+    std::vector<std::size_t> order(batchCount);
+    for (std::size_t batch = 0; batch < batchCount; ++batch) {
+        order[batch] = batch;
+    }
+    const bool budgeted = options.deadline || options.maxFiles;
+    std::vector<PathStringView> firstNames;
+    if (budgeted) {
+        firstNames.resize(batchCount);
+        for (std::size_t batch = 0; batch < batchCount; ++batch) {
+            firstNames[batch] = filenameOf(plan[batchStarts[batch]].source);
+            for (std::size_t i = batchStarts[batch] + 1; i < batchStarts[batch + 1]; ++i) {
+                firstNames[batch] = std::min(firstNames[batch], filenameOf(plan[i].source));
+            }
+        }
+        std::sort(order.begin(), order.end(), [&](std::size_t lhs, std::size_t rhs) {
+            return firstNames[lhs] < firstNames[rhs];
+        });
+    }
+
+    std::atomic<std::size_t> moved {0};
+    std::atomic<std::size_t> alreadyLinked {0};
+    // Under a budget, positions are taken from `admitted` under the lock rather than from parallelFor,
+    // so that the check and the claim happen in order and nothing is admitted after a refusal.
+    std::mutex admissionMutex;
+    std::size_t admitted = 0;
+    bool stopped = false;
+    parallelFor(batchCount, options.jobs, [&](std::size_t position) {
+        if (budgeted) {
+            std::lock_guard<std::mutex> lock(admissionMutex);
+            if (stopped) {
+                return;
+            }
+            const std::size_t size = batchStarts[order[admitted] + 1] - batchStarts[order[admitted]];
+            if ((options.deadline && std::chrono::steady_clock::now() >= *options.deadline) ||
+                (options.maxFiles && !claimFileBudget(claimedFiles, size, *options.maxFiles))) {
+                stopped = true;
+                return;
+            }
+            position = admitted++;
+        }
+        const std::size_t batch = order[position];
+
+        bool folderReady = false;
+        for (std::size_t i = batchStarts[batch]; i < batchStarts[batch + 1]; ++i) {
+            PlacementOutcome outcome = moveFileToFolder(plan[i].source, plan[i].destinationFolder, options, folderReady, logger);
+            if (outcome == PlacementOutcome::AlreadyLinked) {
+                alreadyLinked.fetch_add(1, std::memory_order_relaxed);
+            } else if (outcome == PlacementOutcome::Placed) {
+                moved.fetch_add(1, std::memory_order_relaxed);
+                if (hook) {
+                    hook->add(plan[i].destinationFolder, plan[i].destinationFolder / plan[i].source.filename());
+                }
+            }
+        }
+    });
+
+    ExecutionSummary summary;
+    summary.moved = moved.load();
+    summary.alreadyLinked = alreadyLinked.load();
+    if (budgeted && admitted < batchCount) {
+        summary.resumeFrom = PathString(firstNames[order[admitted]]);
+    }
+    return summary;
+}
+
+// Lists the regular files of `directory` that pass the filter. Names are matched on the raw entry
+// names, and paths are only built for accepted entries. Symbolic links, and entries whose size or time
+// matters but did not come with the listing, are read afterwards in parallel batches.
+bool scanDirectory(const fs::path &directory, const Settings &options, std::vector<fs::path> &files, Reporter &logger) {
+    const FileFilter &filter = options.filter;
+    std::vector<DirectoryEntry> entries;
+    std::string errorMessage;
+    if (!options.fileSystem->listDirectory(directory, entries, errorMessage)) {
+        logger.logError(directory, "Failed to scan directory: " + errorMessage);
+        logger.emit(EventKind::Error, "Failed to scan directory '" + displayPath(directory) + "': " + errorMessage, directory);
+        return false;
+    }
+
+    const unsigned metadataNeeded = filter.metadataNeeded();
+    std::vector<DirectoryEntry> candidates;
+    bool needsMetadata = false;
+    for (auto &entry : entries) {
+        if (entry.type != FileType::Regular && entry.type != FileType::Symlink) {
+            continue;
+        }
+        if (!filter.acceptsName(entry.name, options.foldCase)) {
+            continue;
+        }
+        needsMetadata = needsMetadata || entry.type == FileType::Symlink || (metadataNeeded != kMetadataNone && !entry.metadata);
+        candidates.push_back(std::move(entry));
+    }
+
+    std::vector<char> accepted(candidates.size(), 1);
+    if (needsMetadata || metadataNeeded != kMetadataNone) {
+        constexpr std::size_t kBatchSize = 256;
+        parallelFor((candidates.size() + kBatchSize - 1) / kBatchSize, options.jobs, [&](std::size_t batch) {
+            std::string readError;
+            std::size_t end = std::min(candidates.size(), (batch + 1) * kBatchSize);
+            for (std::size_t i = batch * kBatchSize; i < end; ++i) {
+                DirectoryEntry &candidate = candidates[i];
+                if (candidate.type == FileType::Regular && (metadataNeeded == kMetadataNone || candidate.metadata)) {
+                    accepted[i] = !candidate.metadata || filter.acceptsMetadata(*candidate.metadata);
+                    continue;
+                }
+                FileMetadata metadata;
+                if (!options.fileSystem->readMetadata(directory / candidate.name, metadataNeeded | kMetadataType, metadata, readError)) {
+                    logger.logError(directory / candidate.name, "Failed to read file attributes: " + readError);
+                    accepted[i] = 0;
+                    continue;
+                }
+                accepted[i] = metadata.type == FileType::Regular && filter.acceptsMetadata(metadata);
+            }
+        });
+    }
+
+    files.reserve(files.size() + candidates.size());
+    for (std::size_t i = 0; i < candidates.size(); ++i) {
+        if (accepted[i]) {
+            files.push_back(directory / candidates[i].name);
+        }
+    }
+    return true;
+}
+
+// Applies the filter to an explicit file selection. Files whose metadata cannot be read are kept so
+// that the move reports the problem.
+std::vector<fs::path> filterFiles(const std::vector<fs::path> &files, const Settings &options) {
+    const FileFilter &filter = options.filter;
+    const unsigned metadataNeeded = filter.metadataNeeded();
+    std::vector<fs::path> accepted;
+    accepted.reserve(files.size());
+    std::string errorMessage;
+    for (const auto &file : files) {
+        if (!filter.acceptsName(filenameOf(file), options.foldCase)) {
+            continue;
+        }
+        if (metadataNeeded != kMetadataNone) {
+            FileMetadata metadata;
+            if (options.fileSystem->readMetadata(file, metadataNeeded, metadata, errorMessage) && metadata.type != FileType::NotFound &&
+                !filter.acceptsMetadata(metadata)) {
+                continue;
+            }
+        }
+        accepted.push_back(file);
+    }
+    return accepted;
+}
+
+// What --incremental remembers about a folder. Creating, removing or renaming an entry updates the
+// folder's modification and change times, so an identical record means the listing is unchanged.
+struct DirectoryState {
+    std::uint64_t device = 0;
+    std::uint64_t inode = 0;
+    std::int64_t modifiedNs = 0;
+    std::int64_t changedNs = 0;
+    std::uint64_t settingsDigest = 0;
+
+    bool operator==(const DirectoryState &other) const {
+        return device == other.device && inode == other.inode && modifiedNs == other.modifiedNs && changedNs == other.changedNs &&
+               settingsDigest == other.settingsDigest;
+    }
+};
+
+std::optional<DirectoryState> readDirectoryState(const fs::path &directory, FileSystem &fileSystem, std::uint64_t settingsDigest) {
+    std::optional<DirectoryStamp> stamp = fileSystem.readDirectoryStamp(directory);
+    if (!stamp) {
+        return std::nullopt;
+    }
+    DirectoryState state;
+    state.device = stamp->device;
+    state.inode = stamp->inode;
+    state.modifiedNs = stamp->modifiedNs;
+    state.changedNs = stamp->changedNs;
+    state.settingsDigest = settingsDigest;
+    return state;
+}
+
+// A folder touched within the last couple of seconds may be touched again inside the same timestamp
+// tick (FAT and some network shares keep 1-2 s granularity), so such a state is not trusted yet.
+bool isSettled(const DirectoryState &state) {
+    constexpr std::int64_t kTimestampSlackNs = 2000000000;
+    const std::int64_t now = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+    return now - std::max(state.modifiedNs, state.changedNs) >= kTimestampSlackNs;
+}
+
+// The state file behind --incremental and the resume cursors of --time-budget and --max-files. Each
+// folder is keyed by a hash of its absolute path, salted with the shard under --shard so that shards
+// sharing a state file never resume from each other's cursor. Updates are merged into the file as it
+// is on disk when saving, so overlapping runs on different folders keep each other's records.
+class DirectoryStateStore {
+public:
+    DirectoryStateStore(fs::path path, std::uint64_t keySalt)
+        : path_(std::move(path)), keySalt_(keySalt)
+    {
+        load(records_);
+    }
+
+    std::optional<DirectoryState> find(const fs::path &directory) const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto it = records_.find(keyOf(directory));
+        if (it == records_.end()) {
+            return std::nullopt;
+        }
+        return it->second.state;
+    }
+
+    PathString cursor(const fs::path &directory) const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto it = records_.find(keyOf(directory));
+        return it == records_.end() ? PathString() : it->second.cursor;
+    }
+
+    void record(const fs::path &directory, const DirectoryState &state) {
+        update(directory, [&](Record &record) { record.state = state; });
+    }
+
+    void forget(const fs::path &directory) {
+        update(directory, [](Record &record) { record.state.reset(); });
+    }
+
+    // An empty cursor means the last pass over the folder completed.
+    void setCursor(const fs::path &directory, PathString cursor) {
+        update(directory, [&](Record &record) { record.cursor = std::move(cursor); });
+    }
+
+    bool save(std::string &errorMessage) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (updated_.empty()) {
+            return true;
+        }
+        // Concurrent process() calls each have their own store. Serialising their load-merge-rename
+        // keeps one from overwriting the other's records; other processes can still interleave, as
+        // the class comment says.
+        static std::mutex saveMutex;
+        std::lock_guard<std::mutex> saveLock(saveMutex);
+        std::unordered_map<std::uint64_t, Record> merged;
+        load(merged);
+        for (std::uint64_t key : updated_) {
+            auto it = records_.find(key);
+            if (it == records_.end()) {
+                merged.erase(key);
+            } else {
+                merged[key] = it->second;
+            }
+        }
+
+#ifdef _WIN32
+        const unsigned long processId = GetCurrentProcessId();
+#else
+        const unsigned long processId = static_cast<unsigned long>(::getpid());
+#endif
+        fs::path temporary = path_;
+        static std::atomic<unsigned> saveCount {0};
+        temporary += "." + std::to_string(processId) + "-" + std::to_string(saveCount.fetch_add(1)) + ".tmp";
+        {
+            std::ofstream output(temporary, std::ios::trunc);
+            if (!output && path_.has_parent_path()) {
+                // The folder is shared with the log, which creates it lazily as well.
+                std::error_code ec;
+                fs::create_directories(path_.parent_path(), ec);
+                output.clear();
+                output.open(temporary, std::ios::trunc);
+            }
+            output << kHeader << "\n" << std::hex << std::setfill('0');
+            for (const auto &[key, record] : merged) {
+                if (const auto &state = record.state) {
+                    output << "S " << key << ' ' << state->device << ' ' << state->inode << ' ' << static_cast<std::uint64_t>(state->modifiedNs)
+                           << ' ' << static_cast<std::uint64_t>(state->changedNs) << ' ' << state->settingsDigest << "\n";
+                }
+                if (!record.cursor.empty()) {
+                    // Hex code units, as the name may hold any byte (or, on Windows, unpaired surrogates).
+                    output << "C " << key << ' ';
+                    for (auto unit : record.cursor) {
+                        output << std::setw(sizeof(unit) * 2) << static_cast<std::uint32_t>(static_cast<std::make_unsigned_t<decltype(unit)>>(unit));
+                    }
+                    output << "\n";
+                }
+            }
+            if (!output.flush()) {
+                errorMessage = "Unable to write " + displayPath(temporary);
+                return false;
+            }
+        }
+        std::error_code ec;
+        fs::rename(temporary, path_, ec);
+        if (ec) {
+            errorMessage = ec.message();
+            fs::remove(temporary, ec);
+            return false;
+        }
+        updated_.clear();
+        return true;
+    }
+
+private:
+    struct Record {
+        std::optional<DirectoryState> state;
+        PathString cursor;
+    };
+
+    static constexpr std::string_view kHeader = "PushToFolders state 2";
+
+    std::uint64_t keyOf(const fs::path &directory) const {
+        std::error_code ec;
+        fs::path absolute = fs::absolute(directory, ec).lexically_normal();
+        if (!absolute.has_filename() && absolute.has_relative_path()) {
+            absolute = absolute.parent_path();
+        }
+        return hashNativeText(absolute.native(), kFnvOffsetBasis ^ keySalt_);
+    }
+
+    template <typename Function>
+    void update(const fs::path &directory, Function &&function) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        std::uint64_t key = keyOf(directory);
+        Record &record = records_[key];
+        function(record);
+        if (!record.state && record.cursor.empty()) {
+            records_.erase(key);
+        }
+        updated_.insert(key);
+    }
+
+    // A missing, foreign or damaged file simply yields fewer records: every folder it would have
+    // described is rescanned from the start.
+    void load(std::unordered_map<std::uint64_t, Record> &records) const {
+        std::ifstream input(path_);
+        std::string line;
+        if (!std::getline(input, line) || line != kHeader) {
+            return;
+        }
+        while (std::getline(input, line)) {
+            std::istringstream fields(line);
+            char kind = 0;
+            std::uint64_t key = 0;
+            if (!(fields >> kind >> std::hex >> key)) {
+                continue;
+            }
+            if (kind == 'S') {
+                DirectoryState state;
+                std::uint64_t modified = 0;
+                std::uint64_t changed = 0;
+                if (fields >> state.device >> state.inode >> modified >> changed >> state.settingsDigest) {
+                    state.modifiedNs = static_cast<std::int64_t>(modified);
+                    state.changedNs = static_cast<std::int64_t>(changed);
+                    records[key].state = state;
+                }
+            } else if (kind == 'C') {
+                std::string digits;
+                fields >> digits;
+                constexpr std::size_t kUnitDigits = sizeof(PathString::value_type) * 2;
+                if (digits.empty() || digits.size() % kUnitDigits != 0 || digits.find_first_not_of("0123456789abcdef") != std::string::npos) {
+                    continue;
+                }
+                PathString cursor;
+                for (std::size_t i = 0; i < digits.size(); i += kUnitDigits) {
+                    cursor.push_back(static_cast<PathString::value_type>(std::stoul(digits.substr(i, kUnitDigits), nullptr, 16)));
+                }
+                records[key].cursor = std::move(cursor);
+            }
+        }
+    }
+
+    fs::path path_;
+    const std::uint64_t keySalt_;
+    mutable std::mutex mutex_;
+    std::unordered_map<std::uint64_t, Record> records_;
+    std::unordered_set<std::uint64_t> updated_;
+};
+
+bool processDirectory(const fs::path &directoryPath, const Settings &requestedOptions, DirectoryStateStore *stateStore, PostMoveHook *hook,
+                      std::atomic<std::size_t> &claimedFiles, Reporter &logger) {
+    FileMetadata metadata;
+    std::string errorMessage;
+    if (!requestedOptions.fileSystem->readMetadata(directoryPath, kMetadataType, metadata, errorMessage) || metadata.type != FileType::Directory) {
+        logger.logError(directoryPath, "The supplied path is not a directory.");
+        logger.emit(EventKind::Error, "The path is not a folder: " + displayPath(directoryPath), directoryPath);
+        return false;
+    }
+
+    std::optional<DirectoryState> stateBefore;
+    if (stateStore && requestedOptions.incremental) {
+        stateBefore = readDirectoryState(directoryPath, *requestedOptions.fileSystem, requestedOptions.settingsDigest);
+        if (stateBefore && stateStore->find(directoryPath) == stateBefore) {
+            logger.logInfo("Skipped unchanged folder " + displayPath(directoryPath));
+            logger.emit(EventKind::Notice, "No changes since the last run in " + displayPath(directoryPath), directoryPath);
+            return true;
+        }
+    }
+
+    // Snapshot the directory first: the moves create new sub-folders that must not be revisited.
+    Settings options = resolveNameFolding(requestedOptions, directoryPath);
+    if (stateStore) {
+        options.filter.resumeFrom = stateStore->cursor(directoryPath);
+    }
+    std::vector<fs::path> files;
+    if (!scanDirectory(directoryPath, options, files, logger)) {
+        return false;
+    }
+
+    std::vector<MoveRequest> plan = planMoves(files, options, logger);
+    const std::size_t planned = plan.size();
+    ExecutionSummary summary = executeMoves(std::move(plan), options, hook, claimedFiles, logger);
+
+    // A folder is only recorded once a full scan finds nothing to move (or, with --link, only links
+    // that are already in place), and it did not change while being read. Moving files out of it
+    // changes it, so it is forgotten and rescanned on the next run.
+    if (stateStore && options.incremental) {
+        if (summary.alreadyLinked == planned && !summary.resumeFrom && options.filter.resumeFrom.empty() && stateBefore &&
+            isSettled(*stateBefore) && readDirectoryState(directoryPath, *requestedOptions.fileSystem, requestedOptions.settingsDigest) == stateBefore) {
+            stateStore->record(directoryPath, *stateBefore);
+        } else {
+            stateStore->forget(directoryPath);
+        }
+    }
+
+    bool anyProcessed = summary.moved > 0 || summary.alreadyLinked > 0;
+    if (stateStore) {
+        stateStore->setCursor(directoryPath, summary.resumeFrom.value_or(PathString()));
+    }
+    if (summary.resumeFrom) {
+        logger.logInfo("Budget used up in " + displayPath(directoryPath) + "; the next run resumes at " + displayName(*summary.resumeFrom));
+        logger.emit(EventKind::Notice, "Stopped at the time or file limit in '" + displayPath(directoryPath) + "'. The next run continues from '" + displayName(*summary.resumeFrom) + "'.", directoryPath);
+        return true;
+    }
+
+    if (!anyProcessed) {
+        logger.emit(EventKind::Notice, "No files found to process in " + displayPath(directoryPath), directoryPath);
+    } else if (summary.moved == 0) {
+        logger.emit(EventKind::Notice, "Every file in " + displayPath(directoryPath) + " is already linked", directoryPath);
+    }
+
+    return anyProcessed;
+}
+
+bool processFiles(const std::vector<fs::path> &files, const Settings &requestedOptions, PostMoveHook *hook, std::atomic<std::size_t> &claimedFiles,
+                  Reporter &logger) {
+    const Settings options = resolveNameFolding(requestedOptions, files.empty() ? fs::path() : files.front().parent_path());
+    ExecutionSummary summary = executeMoves(planMoves(filterFiles(files, options), options, logger), options, hook, claimedFiles, logger);
+    bool anyProcessed = summary.moved > 0 || summary.alreadyLinked > 0;
+    if (summary.resumeFrom) {
+        logger.emit(EventKind::Notice, "Stopped at the time or file limit before '" + displayName(*summary.resumeFrom) + "'.", fs::path(*summary.resumeFrom));
+    }
+
+    if (!anyProcessed) {
+        logger.emit(EventKind::Notice, "No files were processed.");
+    }
+
+    return anyProcessed;
+}
+
+struct FlattenFolder {
+    fs::path folder;
+    std::vector<PathString> names;
+    // Empty when the folder only holds regular files that can all be moved up.
+    std::string skipReason;
+    // Set when a file has the folder's own name ("X/X"): the folder is first renamed to this free
+    // name in the parent, so the file can take its place.
+    PathString stagingName;
+};
+
+// Whether every file of `folder` would be sorted back into it by the current grouping settings,
+// i.e. whether the folder looks like one PushToFolders made rather than one the user keeps.
+bool isGroupFolder(const fs::path &folder, const std::vector<PathString> &names, const Settings &options) {
+    std::vector<fs::path> files;
+    files.reserve(names.size());
+    for (const auto &name : names) {
+        files.push_back(folder / name);
+    }
+    // Planning is only a test here, so whatever it would report is dropped.
+    Reporter quiet(nullptr, {});
+    std::vector<MoveRequest> plan = planMoves(files, options, quiet);
+    if (plan.size() != files.size()) {
+        return false;
+    }
+
+    const PathString folderKey = comparisonKey(filenameOf(folder), options);
+    const PathStringView prefix = folder.native();
+    return std::all_of(plan.begin(), plan.end(), [&](const MoveRequest &request) {
+        PathStringView destination = request.destinationFolder.native();
+        return destination.size() > prefix.size() + 1 && destination.substr(0, prefix.size()) == prefix &&
+               destination[prefix.size()] == fs::path::preferred_separator &&
+               comparisonKey(destination.substr(prefix.size() + 1), options) == folderKey;
+    });
+}
+
+// The inverse of processDirectory: moves the files of every child folder back into directoryPath and
+// removes each folder once it is empty. Child folders are scanned in parallel, and every planned
+// name is claimed up front. A folder holding a sub-folder or special file, a file the grouping
+// settings would not put in it, or a file whose name is already taken in the parent, is therefore
+// left untouched as a whole rather than half-emptied.
+bool flattenDirectory(const fs::path &directoryPath, const Settings &requestedOptions, Reporter &logger) {
+    FileSystem &fileSystem = *requestedOptions.fileSystem;
+    FileMetadata metadata;
+    std::string errorMessage;
+    if (!fileSystem.readMetadata(directoryPath, kMetadataType, metadata, errorMessage) || metadata.type != FileType::Directory) {
+        logger.logError(directoryPath, "The supplied path is not a directory.");
+        logger.emit(EventKind::Error, "The path is not a folder: " + displayPath(directoryPath), directoryPath);
+        return false;
+    }
+
+    const Settings options = resolveNameFolding(requestedOptions, directoryPath);
+    // Every file is checked against the folder it would be sorted into, whichever shard owns it.
+    Settings unsharded = options;
+    unsharded.shardIndex = 0;
+    unsharded.shardCount = 1;
+    std::vector<FlattenFolder> folders;
+    std::unordered_set<PathString> takenNames;
+    std::vector<DirectoryEntry> entries;
+    if (!fileSystem.listDirectory(directoryPath, entries, errorMessage)) {
+        logger.logError(directoryPath, "Failed to scan directory: " + errorMessage);
+        logger.emit(EventKind::Error, "Failed to scan directory '" + displayPath(directoryPath) + "': " + errorMessage, directoryPath);
+        return false;
+    }
+    for (const auto &entry : entries) {
+        takenNames.insert(comparisonKey(entry.name, options));
+        if (entry.type == FileType::Directory) {
+            folders.push_back({directoryPath / entry.name, {}, {}, {}});
+        }
+    }
+
+    parallelFor(folders.size(), options.jobs, [&](std::size_t index) {
+        FlattenFolder &candidate = folders[index];
+        std::vector<DirectoryEntry> children;
+        std::string scanError;
+        if (!fileSystem.listDirectory(candidate.folder, children, scanError)) {
+            candidate.skipReason = "Failed to scan folder: " + scanError;
+            return;
+        }
+        for (auto &child : children) {
+            if (child.type != FileType::Regular) {
+                candidate.skipReason = "Folder contains a sub-folder or special file.";
+                return;
+            }
+            candidate.names.push_back(std::move(child.name));
+        }
+        if (!candidate.names.empty() && !isGroupFolder(candidate.folder, candidate.names, unsharded)) {
+            candidate.skipReason = "Folder holds files that would not be sorted into it.";
+        }
+    });
+
+    for (auto &candidate : folders) {
+        if (!candidate.skipReason.empty() || candidate.names.empty()) {
+            continue;
+        }
+        // The folder's own name is only free once the folder has moved out of the way.
+        const PathString folderKey = comparisonKey(filenameOf(candidate.folder), options);
+        bool needsStaging = false;
+        std::vector<PathString> keys;
+        keys.reserve(candidate.names.size());
+        for (const auto &name : candidate.names) {
+            keys.push_back(comparisonKey(name, options));
+            if (keys.back() == folderKey) {
+                needsStaging = true;
+            } else if (takenNames.count(keys.back()) != 0) {
+                candidate.skipReason = "A file named '" + displayName(name) + "' already exists in the parent folder.";
+                break;
+            }
+        }
+        if (!candidate.skipReason.empty()) {
+            continue;
+        }
+        takenNames.insert(keys.begin(), keys.end());
+        if (needsStaging) {
+            PathString staging = PathString(filenameOf(candidate.folder)) + PATH_LITERAL(".flatten");
+            for (unsigned attempt = 1; !takenNames.insert(comparisonKey(staging, options)).second; ++attempt) {
+                staging = PathString(filenameOf(candidate.folder)) + PATH_LITERAL(".flatten-") + fs::path(std::to_string(attempt)).native();
+            }
+            candidate.stagingName = std::move(staging);
+        }
+    }
+
+    std::atomic<std::size_t> moved {0};
+    parallelFor(folders.size(), options.jobs, [&](std::size_t index) {
+        const FlattenFolder &candidate = folders[index];
+        if (!candidate.skipReason.empty()) {
+            logger.logError(candidate.folder, candidate.skipReason + " Folder left untouched.");
+            logger.emit(EventKind::Error, "Left '" + displayPath(candidate.folder) + "' untouched: " + candidate.skipReason, candidate.folder);
+            return;
+        }
+        if (candidate.names.empty()) {
+            return;
+        }
+
+        bool allMoved = true;
+        std::string moveError;
+        fs::path sourceFolder = candidate.folder;
+        if (!candidate.stagingName.empty()) {
+            sourceFolder = directoryPath / candidate.stagingName;
+            if (!fileSystem.renameNoReplace(candidate.folder, sourceFolder, moveError)) {
+                logger.logError(candidate.folder, "Failed to move folder aside: " + moveError);
+                logger.emit(EventKind::Error, "Failed to move folder '" + displayPath(candidate.folder) + "' aside: " + moveError, candidate.folder);
+                return;
+            }
+        }
+        for (const auto &name : candidate.names) {
+            fs::path source = sourceFolder / name;
+            fs::path destination = directoryPath / name;
+            if (!fileSystem.renameNoReplace(source, destination, moveError)) {
+                allMoved = false;
+                logger.logError(source, "Failed to move file: " + moveError);
+                logger.emit(EventKind::Error, "Failed to move '" + displayPath(source) + "': " + moveError, source);
+                continue;
+            }
+            moved.fetch_add(1, std::memory_order_relaxed);
+            logger.logInfo("Moved " + displayPath(source) + " to " + displayPath(directoryPath));
+            logger.emit(EventKind::Flattened, "Moved '" + displayName(name) + "' out of '" + displayName(filenameOf(candidate.folder)) + "'", source, directoryPath);
+        }
+
+        if (allMoved) {
+            if (!fileSystem.removeEmptyDirectory(sourceFolder, moveError)) {
+                logger.logError(sourceFolder, "Failed to remove folder: " + moveError);
+                logger.emit(EventKind::Error, "Failed to remove folder '" + displayPath(sourceFolder) + "': " + moveError, sourceFolder);
+            }
+        } else if (sourceFolder != candidate.folder && !fileSystem.renameNoReplace(sourceFolder, candidate.folder, moveError)) {
+            // The file named like the folder may already be in its place; the rest stay aside.
+            logger.logError(sourceFolder, "Failed to restore the folder name: " + moveError);
+            logger.emit(EventKind::Error, "Files left in '" + displayPath(sourceFolder) + "': " + moveError, sourceFolder);
+        }
+    });
+
+    if (moved.load() == 0) {
+        logger.emit(EventKind::Notice, "No files found to flatten in " + displayPath(directoryPath), directoryPath);
+        return false;
+    }
+    return true;
+}
+
+// Shape files keep sizes to their four leading bits, which is enough for size distributions and
+// thresholds but does not identify a particular file.
+std::uintmax_t roundedSize(std::uintmax_t size) {
+    std::uintmax_t limit = 16;
+    unsigned shift = 0;
+    while (size >= limit) {
+        size >>= 1;
+        ++shift;
+    }
+    return size << shift;
+}
+
+// UTF-8 length of a name and whether it has non-ASCII characters, as "<length> a|u".
+std::string shapeOfName(PathStringView name) {
+    std::string utf8 = fs::path(PathString(name)).u8string();
+    bool ascii = std::all_of(utf8.begin(), utf8.end(), [](char c) { return static_cast<unsigned char>(c) < 0x80; });
+    return std::to_string(utf8.size()) + (ascii ? " a" : " u");
+}
+
+// File types common enough to say nothing about whose files they are, sorted for binary search. Only
+// these are written in clear; a dotted suffix of a name such as "Jane.Doe" must not leak into a shape.
+constexpr std::string_view kKnownExtensions[] = {
+    "3gp", "7z", "aac", "aae", "ai", "aiff", "arw", "ass", "avi", "avif", "bak", "bat", "bin", "bmp", "bz2", "c", "cfg", "cpp",
+    "cr2", "cr3", "cs", "css", "csv", "dat", "db", "dll", "dmg", "dng", "doc", "docx", "dop", "eml", "eps", "epub", "exe", "flac",
+    "flv", "gif", "go", "gz", "h", "heic", "heif", "hpp", "htm", "html", "ico", "ini", "iso", "java", "jpeg", "jpg", "js", "json",
+    "jxl", "key", "log", "lrv", "lz4", "m2ts", "m4a", "m4v", "md", "mid", "midi", "mkv", "mov", "mp3", "mp4", "mpeg", "mpg",
+    "msg", "mts", "nef", "numbers", "odp", "ods", "odt", "ogg", "opus", "orf", "otf", "pages", "part", "pdf", "php", "png", "pp3",
+    "ppt", "pptx", "ps1", "psd", "py", "raf", "rar", "raw", "rb", "rs", "rtf", "rw2", "sh", "sql", "sqlite", "srt", "sub", "svg",
+    "tar", "tgz", "thm", "tif", "tiff", "tmp", "toml", "ts", "tsv", "ttf", "txt", "vtt", "wav", "webm", "webp", "wma", "wmv",
+    "woff", "woff2", "xcf", "xls", "xlsx", "xml", "xmp", "xz", "yaml", "yml", "zip", "zst",
+};
+
+bool isKnownExtension(PathStringView part) {
+    std::string lower;
+    for (auto c : part) {
+        if (c < 0x20 || c >= 0x7F) {
+            return false;
+        }
+        lower.push_back(static_cast<char>(c >= 'A' && c <= 'Z' ? c + 0x20 : c));
+    }
+    return std::binary_search(std::begin(kKnownExtensions), std::end(kKnownExtensions), std::string_view(lower));
+}
+
+// An extension is kept when every dotted part of it is a known file type (".jpg", ".tar.gz"). Anything
+// else becomes "~" with its UTF-8 length and, after a colon, its hash under the same salt as the stems,
+// so that files sharing an unknown extension still share it when the tree is rebuilt.
+std::string shapeOfExtension(PathStringView extension, std::uint64_t salt) {
+    if (extension.empty()) {
+        return "-";
+    }
+    bool known = extension.size() > 1 && extension[0] == '.';
+    for (std::size_t start = 1; known && start <= extension.size();) {
+        std::size_t end = std::min(extension.find('.', start), extension.size());
+        known = end > start && isKnownExtension(extension.substr(start, end - start));
+        start = end + 1;
+    }
+    if (!known) {
+        std::ostringstream hidden;
+        hidden << '~' << fs::path(PathString(extension)).u8string().size() << ':' << std::hex << std::setw(16) << std::setfill('0')
+               << mixHash(hashNativeText(extension, salt));
+        return hidden.str();
+    }
+    return std::string(extension.begin(), extension.end());
+}
+
+// --capture-shape: records the layout of each tree without reading or changing any file. Each folder
+// becomes a "D id parent length a|u" line, written before anything inside it, and each regular file
+// an "F folder stem-hash stem-length a|u extension size" line. Stems are hashed with a salt that is
+// never written, so files sharing a stem share a hash but the names cannot be looked up.
+bool captureDirectoryShape(const std::vector<fs::path> &roots, const fs::path &shapeFile, const Settings &options, Reporter &logger) {
+    std::uint64_t salt = (static_cast<std::uint64_t>(std::random_device()()) << 32) ^ std::random_device()();
+    std::string shape = "PushToFolders shape 1\n";
+    std::size_t folderCount = 0;
+    std::size_t fileCount = 0;
+    bool success = true;
+
+    struct PendingFolder {
+        fs::path path;
+        std::size_t parent;
+    };
+    std::vector<PendingFolder> pending;
+    for (auto it = roots.rbegin(); it != roots.rend(); ++it) {
+        pending.push_back({*it, SIZE_MAX});
+    }
+    while (!pending.empty()) {
+        PendingFolder folder = std::move(pending.back());
+        pending.pop_back();
+        std::vector<DirectoryEntry> entries;
+        std::string errorMessage;
+        if (!options.fileSystem->listDirectory(folder.path, entries, errorMessage)) {
+            logger.logError(folder.path, "Failed to scan directory: " + errorMessage);
+            logger.emit(EventKind::Error, "Failed to scan directory '" + displayPath(folder.path) + "': " + errorMessage, folder.path);
+            success = false;
+            continue;
+        }
+
+        const std::size_t id = folderCount++;
+        shape += "D " + std::to_string(id) + (folder.parent == SIZE_MAX ? std::string(" - 0 a") : " " + std::to_string(folder.parent) + " " +
+                                                                                              shapeOfName(filenameOf(folder.path))) + "\n";
+
+        std::vector<DirectoryEntry> files;
+        for (auto &entry : entries) {
+            if (entry.type == FileType::Directory) {
+                pending.push_back({folder.path / entry.name, id});
+            } else if (entry.type == FileType::Regular || entry.type == FileType::Symlink) {
+                files.push_back(std::move(entry));
+            }
+        }
+
+        constexpr std::size_t kBatchSize = 256;
+        std::vector<std::optional<FileMetadata>> metadata(files.size());
+        parallelFor((files.size() + kBatchSize - 1) / kBatchSize, options.jobs, [&](std::size_t batch) {
+            std::string readError;
+            std::size_t end = std::min(files.size(), (batch + 1) * kBatchSize);
+            for (std::size_t i = batch * kBatchSize; i < end; ++i) {
+                FileMetadata fileMetadata;
+                if (files[i].type == FileType::Regular && files[i].metadata) {
+                    metadata[i] = files[i].metadata;
+                } else if (options.fileSystem->readMetadata(folder.path / files[i].name, kMetadataSize | kMetadataType, fileMetadata, readError) &&
+                           fileMetadata.type == FileType::Regular) {
+                    metadata[i] = fileMetadata;
+                }
+            }
+        });
+
+        for (std::size_t i = 0; i < files.size(); ++i) {
+            if (!metadata[i]) {
+                continue;
+            }
+            PathStringView name = files[i].name;
+            PathStringView stem = stemOf(name, options);
+            std::ostringstream line;
+            line << "F " << id << ' ' << std::hex << std::setw(16) << std::setfill('0') << mixHash(hashNativeText(stem, salt)) << std::dec
+                 << ' ' << shapeOfName(stem) << ' ' << shapeOfExtension(name.substr(stem.size()), salt) << ' ' << roundedSize(metadata[i]->size) << "\n";
+            shape += line.str();
+            ++fileCount;
+        }
+    }
+
+    std::ofstream output(shapeFile, std::ios::binary | std::ios::trunc);
+    output << shape;
+    output.close();
+    if (!output) {
+        logger.logError(shapeFile, "Failed to write the shape file.");
+        logger.emit(EventKind::Error, "Unable to write the shape file '" + displayPath(shapeFile) + "'.", shapeFile);
+        return false;
+    }
+    logger.logInfo("Captured the shape of " + std::to_string(fileCount) + " files in " + std::to_string(folderCount) + " folders into " +
+                   displayPath(shapeFile));
+    logger.emit(EventKind::Notice, "Captured " + std::to_string(fileCount) + " files in " + std::to_string(folderCount) + " folders into '" +
+                                       displayPath(shapeFile) + "'.", shapeFile);
+    return success;
+}
+
+// Nearest-rank percentile of latencies that are already sorted.
+double sortedPercentile(const std::vector<double> &sorted, double fraction) {
+    if (sorted.empty()) {
+        return 0;
+    }
+    auto index = static_cast<std::size_t>(fraction * static_cast<double>(sorted.size() - 1) + 0.5);
+    return sorted[std::min(index, sorted.size() - 1)];
+}
+
+// --self-benchmark: every concurrency level gets its own folder of empty files. Each file is then
+// read the way moveFileToFolder reads its source, given a folder the way ensureDirectory creates
+// one, and renamed into it, one timed step after the other so the numbers do not mix.
+bool selfBenchmarkDirectory(const fs::path &directory, const Settings &options, SelfBenchmarkReport &report, Reporter &logger) {
+    constexpr std::size_t kOperationsPerStep = 256;
+    constexpr unsigned kThreadLevels[] = {1, 2, 4, 8, 16, 32, 64};
+    FileSystem &fileSystem = *options.fileSystem;
+    report = SelfBenchmarkReport();
+    report.operationsPerStep = kOperationsPerStep;
+
+    std::ostringstream workspaceName;
+    workspaceName << ".pushtofolders-benchmark-" << std::hex << std::random_device()();
+    const fs::path workspace = directory / workspaceName.str();
+    std::string errorMessage;
+    FileMetadata metadata;
+    if (!fileSystem.readMetadata(directory, kMetadataType, metadata, errorMessage) || metadata.type != FileType::Directory) {
+        if (errorMessage.empty()) {
+            errorMessage = metadata.type == FileType::NotFound ? "The folder does not exist." : "Not a folder.";
+        }
+        logger.logError(directory, "Cannot run the self-benchmark: " + errorMessage);
+        logger.emit(EventKind::Error, "Cannot run the self-benchmark in '" + displayPath(directory) + "': " + errorMessage, directory);
+        return false;
+    }
+
+    bool success = true;
+    double bestThroughput = 0;
+    std::vector<double> levelThroughput;
+    for (unsigned threads : kThreadLevels) {
+        const fs::path levelFolder = workspace / ("threads-" + std::to_string(threads));
+        if (!fileSystem.createDirectories(levelFolder, errorMessage)) {
+            logger.logError(levelFolder, "Failed to create the self-benchmark folder: " + errorMessage);
+            logger.emit(EventKind::Error, "Failed to create the self-benchmark folder '" + displayPath(levelFolder) + "': " + errorMessage, levelFolder);
+            success = false;
+            break;
+        }
+
+        std::vector<fs::path> files(kOperationsPerStep);
+        std::vector<fs::path> folders(kOperationsPerStep);
+        std::atomic<std::size_t> created {0};
+        parallelFor(kOperationsPerStep, threads, [&](std::size_t i) {
+            files[i] = levelFolder / ("file-" + std::to_string(i) + ".dat");
+            folders[i] = levelFolder / ("folder-" + std::to_string(i));
+            if (std::ofstream(files[i], std::ios::binary)) {
+                created.fetch_add(1, std::memory_order_relaxed);
+            }
+        });
+        if (created.load() != kOperationsPerStep) {
+            logger.logError(levelFolder, "Failed to create the self-benchmark files.");
+            logger.emit(EventKind::Error, "Failed to create the self-benchmark files in '" + displayPath(levelFolder) + "'.", levelFolder);
+            success = false;
+            break;
+        }
+
+        double totalSeconds = 0;
+        std::size_t totalOperations = 0;
+        const auto timeStep = [&](const char *name, auto &&operation) {
+            std::vector<double> latencies(kOperationsPerStep, -1.0);
+            std::mutex firstErrorMutex;
+            std::string firstError;
+            auto start = std::chrono::steady_clock::now();
+            parallelFor(kOperationsPerStep, threads, [&](std::size_t i) {
+                std::string stepError;
+                auto callStart = std::chrono::steady_clock::now();
+                bool succeeded = operation(i, stepError);
+                auto elapsed = std::chrono::steady_clock::now() - callStart;
+                if (succeeded) {
+                    latencies[i] = std::chrono::duration<double, std::micro>(elapsed).count();
+                } else {
+                    std::lock_guard<std::mutex> lock(firstErrorMutex);
+                    if (firstError.empty()) {
+                        firstError = std::move(stepError);
+                    }
+                }
+            });
+            double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+            latencies.erase(std::remove(latencies.begin(), latencies.end(), -1.0), latencies.end());
+            std::sort(latencies.begin(), latencies.end());
+            OperationTiming timing;
+            timing.operation = name;
+            timing.threads = threads;
+            timing.operations = latencies.size();
+            timing.failures = kOperationsPerStep - latencies.size();
+            timing.operationsPerSecond = seconds > 0 ? static_cast<double>(latencies.size()) / seconds : 0;
+            timing.p50 = sortedPercentile(latencies, 0.5);
+            timing.p90 = sortedPercentile(latencies, 0.9);
+            timing.p99 = sortedPercentile(latencies, 0.99);
+            timing.max = sortedPercentile(latencies, 1.0);
+            if (timing.failures > 0) {
+                logger.logError(levelFolder, std::string("Self-benchmark ") + name + " failed " + std::to_string(timing.failures) + " times: " + firstError);
+                logger.emit(EventKind::Error, std::string("The self-benchmark ") + name + " step failed " + std::to_string(timing.failures) +
+                                                  " times at " + std::to_string(threads) + " threads: " + firstError, levelFolder);
+                success = false;
+            }
+            totalSeconds += seconds;
+            totalOperations += timing.operations;
+            report.timings.push_back(std::move(timing));
+        };
+
+        timeStep("stat", [&](std::size_t i, std::string &stepError) {
+            FileMetadata fileMetadata;
+            return fileSystem.readMetadata(files[i], kMetadataType, fileMetadata, stepError);
+        });
+        // The same two calls ensureDirectory makes for a folder that does not exist yet.
+        timeStep("mkdir", [&](std::size_t i, std::string &stepError) {
+            FileMetadata folderMetadata;
+            if (fileSystem.readMetadata(folders[i], kMetadataType, folderMetadata, stepError) && folderMetadata.type != FileType::NotFound) {
+                stepError = "The folder already exists.";
+                return false;
+            }
+            stepError.clear();
+            return fileSystem.createDirectories(folders[i], stepError);
+        });
+        timeStep("rename", [&](std::size_t i, std::string &stepError) {
+            return fileSystem.renameNoReplace(files[i], folders[i] / files[i].filename(), stepError);
+        });
+
+        double throughput = totalSeconds > 0 ? static_cast<double>(totalOperations) / totalSeconds : 0;
+        levelThroughput.push_back(throughput);
+        bestThroughput = std::max(bestThroughput, throughput);
+
+        // Each level is removed before the next starts, so a full share does not skew later levels.
+        std::error_code ec;
+        fs::remove_all(levelFolder, ec);
+    }
+
+    for (std::size_t i = 0; i < levelThroughput.size(); ++i) {
+        if (levelThroughput[i] >= bestThroughput * 0.9) {
+            report.recommendedJobs = kThreadLevels[i];
+            break;
+        }
+    }
+
+    std::error_code ec;
+    fs::remove_all(workspace, ec);
+    if (ec) {
+        logger.logError(workspace, "Failed to remove the self-benchmark folder: " + ec.message());
+        logger.emit(EventKind::Error, "Unable to remove the self-benchmark folder '" + displayPath(workspace) + "': " + ec.message(), workspace);
+        success = false;
+    }
+    logger.logInfo("Self-benchmark of " + displayPath(directory) + " recommends --jobs " + std::to_string(report.recommendedJobs));
+    return success;
+}
+
+// One unit of work from the input list: a folder to scan, or the loose files that share a parent.
+struct InputGroup {
+    fs::path directory;
+    bool scan = false;
+    std::vector<fs::path> files;
+};
+
+// Sorts the inputs into folders to scan and per-parent groups of files. Repeated paths
+// are dropped, as are files inside a folder that is scanned anyway, so no two groups can race for
+// the same file.
+std::vector<InputGroup> groupInputs(const std::vector<fs::path> &inputs, FileSystem &fileSystem) {
+    const auto keyOf = [](const fs::path &path) {
+        std::error_code ec;
+        fs::path absolute = fs::absolute(path, ec).lexically_normal();
+        if (!absolute.has_filename() && absolute.has_relative_path()) {
+            absolute = absolute.parent_path();
+        }
+        return absolute.native();
+    };
+
+    std::vector<InputGroup> groups;
+    std::unordered_map<PathString, std::size_t> directoryGroups;
+    std::vector<fs::path> files;
+    std::unordered_set<PathString> seenFiles;
+    for (const auto &path : inputs) {
+        FileMetadata metadata;
+        std::string errorMessage;
+        if (fileSystem.readMetadata(path, kMetadataType, metadata, errorMessage) && metadata.type == FileType::Directory) {
+            if (directoryGroups.emplace(keyOf(path), groups.size()).second) {
+                groups.push_back({path, true, {}});
+            }
+        } else if (seenFiles.insert(keyOf(path)).second) {
+            files.push_back(path);
+        }
+    }
+
+    std::unordered_map<PathString, std::size_t> fileGroups;
+    for (auto &file : files) {
+        PathString parentKey = keyOf(file.parent_path());
+        if (directoryGroups.count(parentKey) != 0) {
+            continue;
+        }
+        auto [it, inserted] = fileGroups.emplace(std::move(parentKey), groups.size());
+        if (inserted) {
+            groups.push_back({file.parent_path(), false, {}});
+        }
+        groups[it->second].files.push_back(std::move(file));
+    }
+    return groups;
+}
+
+// Processes the groups concurrently. The worker threads are shared out between the groups, so that
+// many small folders run side by side while a single large one still gets every thread. They all
+// claim their --max-files share from one counter.
+bool processInputs(const std::vector<InputGroup> &groups, const Settings &options, DirectoryStateStore *stateStore, PostMoveHook *hook,
+                   Reporter &logger) {
+    std::atomic<std::size_t> claimedFiles {0};
+    const unsigned concurrentGroups = static_cast<unsigned>(std::min<std::size_t>(groups.size(), options.jobs));
+    Settings groupOptions = options;
+    groupOptions.jobs = std::max(1u, options.jobs / std::max(1u, concurrentGroups));
+
+    std::atomic<bool> allSucceeded {true};
+    parallelFor(groups.size(), concurrentGroups, [&](std::size_t index) {
+        const InputGroup &group = groups[index];
+        bool success = group.scan ? processDirectory(group.directory, groupOptions, stateStore, hook, claimedFiles, logger)
+                                  : processFiles(group.files, groupOptions, hook, claimedFiles, logger);
+        if (!success) {
+            allSucceeded.store(false);
+        }
+    });
+    return allSucceeded.load();
+}
+
+// Lower-cases a list of extensions and gives each exactly one leading dot (or none, for compound
+// extensions, which are matched after the first dot of the name).
+std::vector<PathString> normaliseExtensions(const std::vector<PathString> &extensions, bool leadingDot) {
+    std::vector<PathString> normalised;
+    normalised.reserve(extensions.size());
+    for (const auto &extension : extensions) {
+        std::size_t firstCharacter = extension.find_first_not_of('.');
+        if (firstCharacter == PathString::npos) {
+            continue;
+        }
+        PathString lower = asciiLower(extension.substr(firstCharacter));
+        if (leadingDot) {
+            lower.insert(lower.begin(), '.');
+        }
+        normalised.push_back(std::move(lower));
+    }
+    return normalised;
+}
+
+std::optional<CommandTemplate> compileCommandTemplate(const std::vector<PathString> &words, std::string &errorMessage) {
+    CommandTemplate command;
+    bool placeholderSeen = false;
+    for (const auto &word : words) {
+        bool folders = word == PATH_LITERAL("{}+");
+        bool files = word == PATH_LITERAL("{file}+");
+        if (folders || files) {
+            if (placeholderSeen) {
+                errorMessage = "--exec-batch accepts only one {}+ or {file}+ placeholder.";
+                return std::nullopt;
+            }
+            placeholderSeen = true;
+            command.passFiles = files;
+            continue;
+        }
+        (placeholderSeen ? command.after : command.before).push_back(word);
+    }
+    if (!placeholderSeen || command.before.empty()) {
+        errorMessage = "--exec-batch requires a command followed by a {}+ or {file}+ placeholder.";
+        return std::nullopt;
+    }
+    return command;
+}
+
+std::optional<Settings> compileSettings(const Options &options, std::string &errorMessage) {
+    Settings settings;
+    settings.grouping = options.grouping;
+    settings.jobs = options.jobs == 0 ? defaultJobCount() : options.jobs;
+    settings.prefixDelimiters = options.prefixDelimiters;
+    settings.sidecarExtensions = normaliseExtensions(options.sidecarExtensions, true);
+    settings.stripCopySuffixes = options.stripCopySuffixes;
+    if (!options.copyMarkers.empty()) {
+        settings.copyMarkers.clear();
+        for (const auto &marker : options.copyMarkers) {
+            settings.copyMarkers.push_back(asciiLower(marker));
+        }
+    }
+    settings.compoundExtensions = normaliseExtensions(options.compoundExtensions, false);
+    if (!options.folderTemplate.empty()) {
+        auto compiled = compileFolderTemplate(options.folderTemplate, errorMessage);
+        if (!compiled) {
+            return std::nullopt;
+        }
+        settings.folderTemplate = std::move(*compiled);
+    }
+    for (const auto &pattern : options.include) {
+        settings.filter.include.add(pattern);
+    }
+    for (const auto &pattern : options.exclude) {
+        settings.filter.exclude.add(pattern);
+    }
+    settings.filter.minSize = options.minSize;
+    settings.filter.newerThan = options.newerThan;
+    settings.placement = options.placement;
+    settings.nameFolding = options.nameFolding;
+    settings.incremental = options.incremental;
+    settings.deadline = options.deadline;
+    settings.maxFiles = options.maxFiles;
+    if (options.shardCount == 0 || options.shardIndex >= options.shardCount) {
+        errorMessage = "The shard number must be below the number of shards.";
+        return std::nullopt;
+    }
+    settings.shardIndex = options.shardIndex;
+    settings.shardCount = options.shardCount;
+    if (options.fileSystem != nullptr) {
+        settings.fileSystem = options.fileSystem;
+    }
+    if (!options.execBatch.empty()) {
+        settings.execBatch = compileCommandTemplate(options.execBatch, errorMessage);
+        if (!settings.execBatch) {
+            return std::nullopt;
+        }
+    }
+
+    // The digest is built from the compiled settings in a fixed order, and lists are sorted first, so
+    // the order options were given in does not matter. The --newer-than threshold is left out: it is
+    // usually an age, and so moves with every run. The shard is left out too, since each shard keeps
+    // its own records anyway.
+    std::uint64_t digest = hashNativeText({}, options.settingsDigest ^ kFnvOffsetBasis);
+    const auto mix = [&digest](PathStringView text) {
+        digest = hashNativeText(text, digest);
+        digest = (digest ^ 0xFF) * kFnvPrime;
+    };
+    const auto mixNumber = [&mix](std::uintmax_t value) {
+        mix(fs::path(std::to_string(value)).native());
+    };
+    mixNumber(static_cast<std::uintmax_t>(options.grouping));
+    mix(options.prefixDelimiters);
+    const std::vector<PathString> *lists[] = {&settings.sidecarExtensions, &settings.copyMarkers, &settings.compoundExtensions, &options.include,
+                                              &options.exclude};
+    for (const auto *list : lists) {
+        std::vector<PathString> sorted(*list);
+        std::sort(sorted.begin(), sorted.end());
+        mixNumber(sorted.size());
+        for (const auto &word : sorted) {
+            mix(word);
+        }
+    }
+    mixNumber(options.stripCopySuffixes);
+    mix(options.folderTemplate);
+    mixNumber(options.minSize.value_or(0));
+    mixNumber(static_cast<std::uintmax_t>(options.placement));
+    mixNumber(static_cast<std::uintmax_t>(options.nameFolding));
+    settings.settingsDigest = digest;
+    return settings;
+}
+
+} // namespace
+
+struct PushEngine::Impl {
+    Impl(Settings settings, fs::path stateFile, Logger *logger, EventCallback events)
+        : settings(std::move(settings)), stateFile(std::move(stateFile)), reporter(logger, std::move(events))
+    {
+    }
+
+    Settings settings;
+    fs::path stateFile;
+    Reporter reporter;
+};
+
+std::optional<PushEngine> PushEngine::create(const Options &options, Logger *logger, EventCallback events, std::string &errorMessage) {
+    auto settings = compileSettings(options, errorMessage);
+    if (!settings) {
+        return std::nullopt;
+    }
+    return PushEngine(std::make_unique<Impl>(std::move(*settings), options.stateFile, logger, std::move(events)));
+}
+
+PushEngine::PushEngine(std::unique_ptr<Impl> impl)
+    : impl_(std::move(impl))
+{
+}
+
+PushEngine::PushEngine(PushEngine &&) noexcept = default;
+PushEngine &PushEngine::operator=(PushEngine &&) noexcept = default;
+PushEngine::~PushEngine() = default;
+
+RunSummary PushEngine::process(const std::vector<fs::path> &inputs) {
+    const Settings &settings = impl_->settings;
+    Reporter &reporter = impl_->reporter;
+    const std::vector<InputGroup> groups = groupInputs(inputs, *impl_->settings.fileSystem);
+
+    RunSummary summary;
+    for (const auto &group : groups) {
+        ++(group.scan ? summary.folders : summary.fileGroups);
+    }
+
+    std::optional<DirectoryStateStore> stateStore;
+    if (summary.folders > 0 && !impl_->stateFile.empty() && (settings.incremental || settings.deadline || settings.maxFiles)) {
+        const std::uint64_t shardSalt = settings.shardCount > 1 ? mixHash((std::uint64_t {settings.shardIndex} << 32) | settings.shardCount) : 0;
+        stateStore.emplace(impl_->stateFile, shardSalt);
+    }
+    std::optional<PostMoveHook> hook;
+    if (settings.execBatch) {
+        hook.emplace(*settings.execBatch);
+    }
+
+    summary.success = processInputs(groups, settings, stateStore ? &*stateStore : nullptr, hook ? &*hook : nullptr, reporter);
+    std::string stateError;
+    if (stateStore && !stateStore->save(stateError)) {
+        reporter.logError(impl_->stateFile, "Failed to save the folder state: " + stateError);
+        reporter.emit(EventKind::Error, "Unable to save the folder state: " + stateError, impl_->stateFile);
+    }
+    if (hook && !hook->run(settings.jobs, reporter)) {
+        summary.success = false;
+    }
+    return summary;
+}
+
+bool PushEngine::flatten(const fs::path &directory) {
+    return flattenDirectory(directory, impl_->settings, impl_->reporter);
+}
+
+bool PushEngine::captureShape(const std::vector<fs::path> &folders, const fs::path &shapeFile) {
+    return captureDirectoryShape(folders, shapeFile, impl_->settings, impl_->reporter);
+}
+
+bool PushEngine::selfBenchmark(const fs::path &directory, SelfBenchmarkReport &report) {
+    return selfBenchmarkDirectory(directory, impl_->settings, report, impl_->reporter);
+}
+
+#undef PATH_LITERAL
+
+} // namespace pushtofolders
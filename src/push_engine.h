@@ -0,0 +1,172 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <ctime>
+#include <filesystem>
+#include <functional>
+#include <memory>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "file_system.h"
+
+// The scanning, planning and moving logic of PushToFolders, usable in-process. The command line tool
+// is a thin client of this interface.
+namespace pushtofolders {
+
+enum class GroupingMode {
+    Stem,
+    Content,
+    Sequence,
+    Prefix,
+};
+
+// What happens to each file once its folder is known.
+enum class PlacementMode {
+    Move,
+    HardLink,
+    SymbolicLink,
+    Reflink,
+};
+
+enum class NameFolding {
+    Auto,
+    On,
+    Off,
+};
+
+// Everything that controls a run. Each field mirrors the command line option of the same name.
+struct Options {
+    GroupingMode grouping = GroupingMode::Stem;
+    // Worker threads; 0 uses one per processor core.
+    unsigned jobs = 0;
+    PathString prefixDelimiters = fs::path("_-. ").native();
+    // Extensions with or without the leading dot, matched case-insensitively.
+    std::vector<PathString> sidecarExtensions;
+    bool stripCopySuffixes = false;
+    // Empty uses the built-in list of localised copy words.
+    std::vector<PathString> copyMarkers;
+    std::vector<PathString> compoundExtensions;
+    // Empty is the same as "{stem}".
+    PathString folderTemplate;
+    std::vector<PathString> include;
+    std::vector<PathString> exclude;
+    std::optional<std::uintmax_t> minSize;
+    std::optional<std::time_t> newerThan;
+    PlacementMode placement = PlacementMode::Move;
+    NameFolding nameFolding = NameFolding::Auto;
+    bool incremental = false;
+    std::optional<std::chrono::steady_clock::time_point> deadline;
+    std::optional<std::size_t> maxFiles;
+    // Holds the --incremental records and the resume positions of --time-budget and --max-files.
+    fs::path stateFile;
+    // --exec-batch as separate words, one of which is the "{}+" or "{file}+" placeholder.
+    std::vector<PathString> execBatch;
+    // --shard: handle only the folders whose name hashes to shardIndex, counted from 0 up to
+    // shardCount - 1. Processes given every index over the same folders share the work without
+    // overlapping; all files bound for one folder go to the same shard.
+    unsigned shardIndex = 0;
+    unsigned shardCount = 1;
+    // Mixed into the digest that --incremental records carry, for settings the engine cannot see as
+    // given (the command line hashes the --newer-than text, so "--newer-than 7d" stays the same setting).
+    std::uint64_t settingsDigest = 0;
+    // Where the sorted files live; null is the operating system's file system. It must outlive the
+    // engine. The state file and the log are always on disk.
+    FileSystem *fileSystem = nullptr;
+};
+
+// Receives the diagnostic log. Calls are serialised by the engine.
+class Logger {
+public:
+    virtual ~Logger() = default;
+    virtual void logError(const fs::path &target, std::string_view message) = 0;
+    virtual void logInfo(std::string_view message) = 0;
+};
+
+enum class EventKind {
+    // A file was moved or linked into `folder`.
+    Placed,
+    // --flatten moved a file back up into `folder`.
+    Flattened,
+    Notice,
+    Error,
+};
+
+struct Event {
+    EventKind kind;
+    // Ready-made console text, without a trailing newline.
+    std::string message;
+    fs::path path;
+    fs::path folder;
+};
+
+// Called for every event, from worker threads but never concurrently.
+using EventCallback = std::function<void(const Event &)>;
+
+struct RunSummary {
+    bool success = true;
+    std::size_t folders = 0;
+    std::size_t fileGroups = 0;
+};
+
+// One primitive timed by selfBenchmark() at one concurrency level. Latencies are in microseconds.
+struct OperationTiming {
+    // "stat", "mkdir" (the existence check plus the creation) or "rename".
+    std::string operation;
+    unsigned threads = 1;
+    std::size_t operations = 0;
+    std::size_t failures = 0;
+    double operationsPerSecond = 0;
+    double p50 = 0;
+    double p90 = 0;
+    double p99 = 0;
+    double max = 0;
+};
+
+struct SelfBenchmarkReport {
+    std::size_t operationsPerStep = 0;
+    std::vector<OperationTiming> timings;
+    // The fewest threads that came within 10% of the best combined throughput.
+    unsigned recommendedJobs = 1;
+};
+
+class PushEngine {
+public:
+    // Validates and compiles the options; on failure returns nullopt and explains why.
+    static std::optional<PushEngine> create(const Options &options, Logger *logger, EventCallback events, std::string &errorMessage);
+
+    PushEngine(PushEngine &&) noexcept;
+    PushEngine &operator=(PushEngine &&) noexcept;
+    ~PushEngine();
+
+    // Sorts any mix of folders (which are scanned) and files. Independent inputs run concurrently.
+    // Several threads may call process() on the same engine at once.
+    RunSummary process(const std::vector<fs::path> &inputs);
+
+    // Moves the files of every sub-folder of `directory` back up into it.
+    bool flatten(const fs::path &directory);
+
+    // Writes the anonymised layout of the trees under `folders` to `shapeFile`: folder nesting, name
+    // lengths, extensions, rounded sizes and which files share a stem, but no names. Nothing under
+    // `folders` is changed. The bench programs can rebuild a tree of the same shape from the file.
+    bool captureShape(const std::vector<fs::path> &folders, const fs::path &shapeFile);
+
+    // Times the calls a move is made of (reading a file's metadata, creating its folder, renaming it
+    // into place) on a throwaway workload inside `directory`, at 1 to 64 threads, and removes the
+    // workload afterwards. The workload files are created with the standard library, so
+    // Options::fileSystem must be the native one or a wrapper around it.
+    bool selfBenchmark(const fs::path &directory, SelfBenchmarkReport &report);
+
+private:
+    struct Impl;
+    explicit PushEngine(std::unique_ptr<Impl> impl);
+    std::unique_ptr<Impl> impl_;
+};
+
+// Renders a path as valid UTF-8, escaping invalid bytes and control characters as \xNN.
+std::string displayPath(const fs::path &path);
+
+} // namespace pushtofolders